@@ -0,0 +1,208 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*!
+ * \file src/runtime/contrib/bananapi/bananapi_arena.cc
+ * \brief Huge-page backed memory arena for the buffers of the bananapi runtime.
+ */
+#include "bananapi_arena.h"
+
+#include <sys/mman.h>
+#include <tvm/runtime/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+namespace tvm {
+namespace runtime {
+namespace contrib {
+
+namespace {
+
+constexpr size_t kAlign = 64;
+
+size_t RoundUp(size_t value, size_t align) { return (value + align - 1) / align * align; }
+
+/*! \brief Hugepagesize from /proc/meminfo, 2 MiB if unknown. */
+size_t ReadHugePageSize() {
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  while (std::getline(meminfo, line)) {
+    unsigned long kb = 0;
+    if (std::sscanf(line.c_str(), "Hugepagesize: %lu kB", &kb) == 1 && kb > 0) return kb * 1024;
+  }
+  return 2 << 20;
+}
+
+std::string MiB(size_t bytes) {
+  std::ostringstream os;
+  os.precision(1);
+  os << std::fixed << bytes / 1048576.0 << " MiB";
+  return os.str();
+}
+
+}  // namespace
+
+BananapiArena* BananapiArena::Global() {
+  // Never destroyed: modules may release their buffers during static destruction.
+  static BananapiArena* inst = []() {
+    auto* arena = new BananapiArena();
+    const char* report = std::getenv("BANANAPI_ARENA_REPORT");
+    if (report && std::string(report) == "1") {
+      std::atexit([]() { Global()->Report(std::cerr); });
+    }
+    return arena;
+  }();
+  return inst;
+}
+
+BananapiArena::BananapiArena() : huge_page_size_(ReadHugePageSize()) {
+  const char* mode = std::getenv("BANANAPI_HUGEPAGES");
+  mode_ = mode && *mode ? mode : "thp";
+  if (mode_ != "thp" && mode_ != "explicit" && mode_ != "off") {
+    LOG(WARNING) << "bananapi: unknown BANANAPI_HUGEPAGES=" << mode_ << ", using thp";
+    mode_ = "thp";
+  }
+}
+
+void BananapiArena::MapSlab(size_t bytes) {
+  size_t size = RoundUp(std::max(bytes, huge_page_size_), huge_page_size_);
+  char* base = nullptr;
+  bool huge = false;
+  if (mode_ == "explicit") {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      base = static_cast<char*>(p);
+      huge = true;
+    } else {
+      LOG(WARNING) << "bananapi: MAP_HUGETLB failed for " << MiB(size)
+                   << " (see /proc/sys/vm/nr_hugepages), using transparent huge pages";
+    }
+  }
+  if (base == nullptr) {
+    // Over-map and trim so the slab starts on a huge page boundary, as THP requires.
+    size_t span = size + huge_page_size_;
+    void* p = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ICHECK(p != MAP_FAILED) << "bananapi: cannot map " << MiB(span) << " for the arena";
+    char* raw = static_cast<char*>(p);
+    base = reinterpret_cast<char*>(RoundUp(reinterpret_cast<uintptr_t>(raw), huge_page_size_));
+    if (base > raw) munmap(raw, base - raw);
+    if (raw + span > base + size) munmap(base + size, raw + span - (base + size));
+#ifdef MADV_HUGEPAGE
+    if (mode_ != "off") huge = madvise(base, size, MADV_HUGEPAGE) == 0;
+#endif
+  }
+  Slab slab;
+  slab.base = base;
+  slab.size = size;
+  slab.huge = huge;
+  slab.free[0] = size;
+  slabs_.push_back(std::move(slab));
+  mapped_ += size;
+}
+
+bool BananapiArena::Take(size_t slab, size_t bytes, void** out) {
+  auto& free = slabs_[slab].free;
+  for (auto it = free.begin(); it != free.end(); ++it) {
+    if (it->second < bytes) continue;
+    size_t offset = it->first, left = it->second - bytes;
+    free.erase(it);
+    if (left > 0) free[offset + bytes] = left;
+    *out = slabs_[slab].base + offset;
+    blocks_[*out] = Block{slab, offset, bytes};
+    return true;
+  }
+  return false;
+}
+
+void BananapiArena::Reserve(size_t bytes) {
+  bytes = RoundUp(bytes, kAlign);
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const auto& slab : slabs_) {
+    for (const auto& extent : slab.free) {
+      if (extent.second >= bytes) return;
+    }
+  }
+  MapSlab(bytes);
+}
+
+void* BananapiArena::Allocate(size_t bytes) {
+  bytes = RoundUp(std::max<size_t>(bytes, 1), kAlign);
+  std::lock_guard<std::mutex> lock(mu_);
+  void* ptr = nullptr;
+  for (size_t i = 0; i < slabs_.size() && ptr == nullptr; ++i) Take(i, bytes, &ptr);
+  if (ptr == nullptr) {
+    MapSlab(bytes);
+    Take(slabs_.size() - 1, bytes, &ptr);
+  }
+  size_t in_use = in_use_.load(std::memory_order_relaxed) + bytes;
+  in_use_.store(in_use, std::memory_order_relaxed);
+  peak_ = std::max(peak_, in_use);
+  return ptr;
+}
+
+void BananapiArena::Free(void* ptr) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = blocks_.find(ptr);
+  ICHECK(it != blocks_.end()) << "bananapi: freeing a pointer the arena does not own";
+  Block block = it->second;
+  blocks_.erase(it);
+  in_use_.store(in_use_.load(std::memory_order_relaxed) - block.size, std::memory_order_relaxed);
+
+  // Insert the extent and merge it with its free neighbours.
+  auto& free = slabs_[block.slab].free;
+  auto next = free.lower_bound(block.offset);
+  size_t offset = block.offset, size = block.size;
+  if (next != free.end() && offset + size == next->first) {
+    size += next->second;
+    next = free.erase(next);
+  }
+  if (next != free.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      offset = prev->first;
+      size += prev->second;
+      free.erase(prev);
+    }
+  }
+  free[offset] = size;
+}
+
+void BananapiArena::Report(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(mu_);
+  size_t huge = 0;
+  for (const auto& slab : slabs_) huge += slab.huge ? slab.size : 0;
+  os << "bananapi arena (" << mode_ << ", huge page " << MiB(huge_page_size_) << "): mapped "
+     << MiB(mapped_) << " in " << slabs_.size() << " slab(s), " << MiB(huge)
+     << " huge-page backed; peak in use " << MiB(peak_) << ", steady state "
+     << MiB(steady_.load(std::memory_order_relaxed)) << ", in use now "
+     << MiB(in_use_.load(std::memory_order_relaxed)) << "\n";
+  os.flush();
+}
+
+}  // namespace contrib
+}  // namespace runtime
+}  // namespace tvm
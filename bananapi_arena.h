@@ -0,0 +1,134 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*!
+ * \file src/runtime/contrib/bananapi/bananapi_arena.h
+ * \brief Huge-page backed memory arena for the buffers of the bananapi runtime.
+ */
+#ifndef TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_ARENA_H_
+#define TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_ARENA_H_
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace tvm {
+namespace runtime {
+namespace contrib {
+
+/*!
+ * \brief Process-wide arena for packed weights, block-sparse weights, partition intermediates
+ * and kernel scratch of every bananapi module.
+ *
+ * Memory comes from a few large slabs, aligned to the huge page size and backed according to
+ * BANANAPI_HUGEPAGES: "thp" (default, madvise(MADV_HUGEPAGE)), "explicit" (MAP_HUGETLB from the
+ * hugetlbfs pool, falling back to thp) or "off". Freed blocks go back to a first-fit free list
+ * of their slab and are coalesced; slabs are never unmapped, so a long-running session stops
+ * mapping memory once its modules are loaded. Each module reserves its whole footprint, known
+ * from its kernel plans at Init, so its buffers land in one slab.
+ *
+ * With BANANAPI_ARENA_REPORT=1 the mapped, peak and steady-state (in use at the latest Run)
+ * footprints are printed to stderr at exit.
+ */
+class BananapiArena {
+ public:
+  static BananapiArena* Global();
+
+  /*! \brief Make sure a single free extent of at least bytes exists, mapping a slab if needed. */
+  void Reserve(size_t bytes);
+  /*! \brief 64-byte aligned block of at least bytes. */
+  void* Allocate(size_t bytes);
+  void Free(void* ptr);
+  /*! \brief Record the bytes in use now as the steady-state footprint. */
+  void NoteRun() { steady_.store(in_use_.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+  void Report(std::ostream& os);
+
+ private:
+  struct Slab {
+    char* base;
+    size_t size;
+    bool huge;
+    /*! \brief Free extents, offset -> length. */
+    std::map<size_t, size_t> free;
+  };
+  struct Block {
+    size_t slab, offset, size;
+  };
+
+  BananapiArena();
+  void MapSlab(size_t bytes);
+  bool Take(size_t slab, size_t bytes, void** out);
+
+  std::mutex mu_;
+  std::vector<Slab> slabs_;
+  std::map<void*, Block> blocks_;
+  std::string mode_;
+  size_t huge_page_size_;
+  size_t mapped_{0}, peak_{0};
+  std::atomic<size_t> in_use_{0}, steady_{0};
+};
+
+/*! \brief Owning handle of one arena block, released when the handle goes away. */
+class ArenaBuffer {
+ public:
+  ArenaBuffer() = default;
+  explicit ArenaBuffer(size_t bytes)
+      : data_(BananapiArena::Global()->Allocate(bytes)), size_(bytes) {}
+  ArenaBuffer(ArenaBuffer&& other) noexcept : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+  }
+  ArenaBuffer& operator=(ArenaBuffer&& other) noexcept {
+    if (this != &other) {
+      Release();
+      data_ = other.data_;
+      size_ = other.size_;
+      other.data_ = nullptr;
+    }
+    return *this;
+  }
+  ArenaBuffer(const ArenaBuffer&) = delete;
+  ArenaBuffer& operator=(const ArenaBuffer&) = delete;
+  ~ArenaBuffer() { Release(); }
+
+  template <typename T>
+  T* data() const {
+    return static_cast<T*>(data_);
+  }
+  size_t size() const { return size_; }
+
+ private:
+  void Release() {
+    if (data_ != nullptr) BananapiArena::Global()->Free(data_);
+    data_ = nullptr;
+  }
+
+  void* data_{nullptr};
+  size_t size_{0};
+};
+
+}  // namespace contrib
+}  // namespace runtime
+}  // namespace tvm
+
+#endif  // TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_ARENA_H_
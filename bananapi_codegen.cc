@@ -23,11 +23,15 @@
  */
 #include <tvm/ir/module.h>
 #include <tvm/ir/transform.h>
-// TODO(sunggg): add operator attribute when it's ready
-// #include <tvm/relax/attrs/nn.h>
+#include <tvm/relax/attrs/index.h>
+#include <tvm/relax/attrs/manipulate.h>
+#include <tvm/relax/attrs/nn.h>
 #include <tvm/relax/type.h>
 
+#include <iomanip>
+#include <limits>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -47,6 +51,199 @@ using JSONSerializer = backend::contrib::JSONSerializer;
 
 class bananapiJSONSerializer;
 
+/*! \brief Block shape used to measure (and later compress) the sparsity of constant weights. */
+constexpr int kSparseBlockK = 4;
+constexpr int kSparseBlockN = 16;
+/*! \brief Default fraction of all-zero blocks above which the block-sparse kernel is used. */
+constexpr double kDefaultSparseThreshold = 0.5;
+
+/*! \brief Options of the bananapi codegen, see bananapiCompiler. */
+struct bananapiCodegenOptions {
+  /*! \brief Fraction of all-zero blocks from which a constant weight is treated as sparse. */
+  double sparse_threshold = kDefaultSparseThreshold;
+  /*! \brief Whether kernels are enqueued asynchronously by the runtime. */
+  bool async = false;
+  /*! \brief Whether activations passed between kernels of one partition may stay blocked. */
+  bool blocked_layout = true;
+};
+
+/*! \brief Read a numeric codegen option given as a float, an int or a string. */
+static double GetNumericOption(const Map<String, ObjectRef>& options, const std::string& key,
+                               double default_value) {
+  auto opt = options.Get(key);
+  if (!opt.defined()) return default_value;
+  if (const auto* f = opt.value().as<FloatImmNode>()) return f->value;
+  if (const auto* i = opt.value().as<IntImmNode>()) return static_cast<double>(i->value);
+  if (const auto* str = opt.value().as<runtime::StringObj>()) return std::stod(str->data);
+  LOG(FATAL) << "bananapi codegen option '" << key << "' must be a number";
+  return default_value;
+}
+
+/*! \brief Attach a string list attribute the same way OpAttrExtractor does. */
+static void SetStringAttr(const JSONGraphObjectPtr& node, const std::string& key,
+                          const std::vector<std::string>& value) {
+  std::vector<dmlc::any> attr;
+  attr.emplace_back(value);
+  node->SetAttr(key, attr);
+}
+
+/*!
+ * \brief Count the [block_k, block_n] blocks of a 2D float32 weight that hold at least one
+ * non-zero, the same way matmul_bsr_count() in libmatmul_rvv.cpp does.
+ */
+static int64_t CountNonZeroBlocks(const runtime::NDArray& weight, int block_k, int block_n,
+                                  int64_t* num_blocks) {
+  int64_t m = weight->shape[0];
+  int64_t o = weight->shape[1];
+  const float* data = static_cast<const float*>(weight->data);
+  int64_t nnz = 0;
+  *num_blocks = 0;
+  for (int64_t kb = 0; kb < m; kb += block_k) {
+    for (int64_t jb = 0; jb < o; jb += block_n) {
+      bool zero = true;
+      for (int64_t k = kb; k < std::min(kb + block_k, m) && zero; ++k) {
+        for (int64_t j = jb; j < std::min(jb + block_n, o); ++j) {
+          if (data[k * o + j] != 0.0f) {
+            zero = false;
+            break;
+          }
+        }
+      }
+      nnz += zero ? 0 : 1;
+      ++*num_blocks;
+    }
+  }
+  return nnz;
+}
+
+/*! \brief Static shape of a tensor expression; false if unknown or symbolic. */
+static bool StaticShape(const Expr& expr, std::vector<int64_t>* shape) {
+  const auto* sinfo = GetStructInfoAs<TensorStructInfoNode>(expr);
+  if (sinfo == nullptr || !sinfo->shape.defined()) return false;
+  const auto* shape_expr = sinfo->shape.value().as<ShapeExprNode>();
+  if (shape_expr == nullptr) return false;
+  shape->clear();
+  for (const PrimExpr& dim : shape_expr->values) {
+    const auto* imm = dim.as<IntImmNode>();
+    if (imm == nullptr) return false;
+    shape->push_back(imm->value);
+  }
+  return true;
+}
+
+static std::vector<int64_t> DenseStrides(const std::vector<int64_t>& shape) {
+  std::vector<int64_t> strides(shape.size(), 1);
+  for (size_t i = shape.size(); i-- > 1;) strides[i - 1] = strides[i] * shape[i];
+  return strides;
+}
+
+static bool IsOpCall(const Expr& expr, const char* op_name) {
+  const auto* call = expr.as<CallNode>();
+  return call != nullptr && call->op.same_as(Op::Get(op_name));
+}
+
+static bool IsViewCall(const Expr& expr) {
+  return IsOpCall(expr, "relax.reshape") || IsOpCall(expr, "relax.permute_dims");
+}
+
+/*! \brief Look through the var bindings of a composite body. */
+static Expr ResolveBinding(Expr expr, const Map<Var, Expr>& bindings) {
+  while (const auto* var = expr.as<VarNode>()) {
+    auto it = bindings.find(GetRef<Var>(var));
+    if (it == bindings.end()) break;
+    expr = (*it).second;
+  }
+  return expr;
+}
+
+/*! \brief Source axis of every output axis of a permute_dims call (reversed if none given). */
+static std::vector<int64_t> PermuteAxes(const CallNode* call, int64_t ndim) {
+  std::vector<int64_t> axes;
+  const auto* attrs = call->attrs.as<PermuteDimsAttrs>();
+  if (attrs != nullptr && attrs->axes.defined()) {
+    for (const Integer& axis : attrs->axes.value()) {
+      axes.push_back(axis->value < 0 ? axis->value + ndim : axis->value);
+    }
+  } else {
+    for (int64_t i = ndim; i-- > 0;) axes.push_back(i);
+  }
+  return axes;
+}
+
+/*!
+ * \brief Describe a matmul operand of the form permute_dims(reshape(x)) / permute_dims(x) as
+ * element strides over the dense x, so the kernel reads x in place instead of TVM copying out
+ * the permuted tensor. Returns x; shape and strides stay empty if the operand is x itself.
+ */
+static Expr TraceOperandView(const Expr& operand, const Map<Var, Expr>& bindings,
+                             std::vector<int64_t>* shape, std::vector<int64_t>* strides) {
+  std::vector<const CallNode*> chain;  // outermost first
+  Expr expr = ResolveBinding(operand, bindings);
+  while (IsViewCall(expr)) {
+    chain.push_back(expr.as<CallNode>());
+    expr = ResolveBinding(chain.back()->args[0], bindings);
+  }
+  shape->clear();
+  strides->clear();
+  if (chain.empty()) return expr;
+  ICHECK(StaticShape(expr, shape)) << "bananapi: a fused view needs static shapes";
+  *strides = DenseStrides(*shape);
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+    const CallNode* call = *it;
+    if (call->op.same_as(Op::Get("relax.reshape"))) {
+      ICHECK(*strides == DenseStrides(*shape)) << "bananapi: cannot reshape a permuted view";
+      ICHECK(StaticShape(GetRef<Call>(call), shape)) << "bananapi: a fused view needs static shapes";
+      *strides = DenseStrides(*shape);
+    } else {
+      std::vector<int64_t> axes = PermuteAxes(call, shape->size());
+      std::vector<int64_t> new_shape, new_strides;
+      for (int64_t axis : axes) {
+        new_shape.push_back((*shape)[axis]);
+        new_strides.push_back((*strides)[axis]);
+      }
+      *shape = new_shape;
+      *strides = new_strides;
+    }
+  }
+  return expr;
+}
+
+/*!
+ * \brief For a composite output of the form reshape(permute_dims(matmul)) / permute_dims(matmul),
+ * the strides at which the [.., n, o] matmul result lands in the dense output, so the kernel
+ * writes it there directly. Returns the matmul call; shape and strides stay empty if the
+ * output is the matmul itself.
+ */
+static Expr TraceOutputView(const Expr& output, const Map<Var, Expr>& bindings,
+                            std::vector<int64_t>* shape, std::vector<int64_t>* strides) {
+  std::vector<const CallNode*> chain;  // outermost first
+  Expr expr = ResolveBinding(output, bindings);
+  while (IsViewCall(expr)) {
+    chain.push_back(expr.as<CallNode>());
+    expr = ResolveBinding(chain.back()->args[0], bindings);
+  }
+  shape->clear();
+  strides->clear();
+  if (chain.empty()) return expr;
+  ICHECK(StaticShape(GetRef<Call>(chain[0]), shape)) << "bananapi: a fused view needs static shapes";
+  *strides = DenseStrides(*shape);
+  for (const CallNode* call : chain) {
+    std::vector<int64_t> in_shape;
+    ICHECK(StaticShape(call->args[0], &in_shape)) << "bananapi: a fused view needs static shapes";
+    if (call->op.same_as(Op::Get("relax.reshape"))) {
+      ICHECK(*strides == DenseStrides(*shape)) << "bananapi: cannot reshape a permuted view";
+      *strides = DenseStrides(in_shape);
+    } else {
+      std::vector<int64_t> axes = PermuteAxes(call, in_shape.size());
+      std::vector<int64_t> in_strides(in_shape.size());
+      for (size_t k = 0; k < axes.size(); ++k) in_strides[axes[k]] = (*strides)[k];
+      *strides = in_strides;
+    }
+    *shape = in_shape;
+  }
+  return expr;
+}
+
 /*!
  * \brief Collect the constants and attributes from all operator calls in the body
  * of a "Composite" function.
@@ -68,6 +265,16 @@ class bananapiCollectFromCompositeFunctionBody : public ExprVisitor {
   bananapiJSONSerializer* serializer_;
   /*! \brief Accumulated translated arguments. */
   std::vector<JSONGraphNodeEntry> args_;
+  /*! \brief The constant behind each of args_. */
+  std::vector<const ConstantNode*> constants_;
+  /*! \brief The constant rhs of the relax.matmul in the body, if any. */
+  Optional<Constant> matmul_rhs_const_;
+  /*! \brief The relax.nn.layer_norm call of a bananapi.layernorm_matmul body. */
+  const CallNode* layer_norm_{nullptr};
+  /*! \brief The relax.matmul call of the body. */
+  const CallNode* matmul_{nullptr};
+  /*! \brief The relax.take call of a bananapi.matmul_gather body. */
+  const CallNode* take_{nullptr};
   /*!
    * \brief Temporary node into which we'll accumulate attributes. Ideally this would be the
    * final JSONGraphNode however we don't yet know how many inputs that will have.
@@ -82,8 +289,9 @@ class bananapiCollectFromCompositeFunctionBody : public ExprVisitor {
  */
 class bananapiJSONSerializer : public JSONSerializer {
  public:
-  explicit bananapiJSONSerializer(Map<Constant, String> constant_names, Map<Var, Expr> bindings)
-      : JSONSerializer(constant_names), bindings_(bindings) {}
+  explicit bananapiJSONSerializer(Map<Constant, String> constant_names, Map<Var, Expr> bindings,
+                                  const bananapiCodegenOptions& options)
+      : JSONSerializer(constant_names), bindings_(bindings), options_(options) {}
 
   using JSONSerializer::VisitExpr_;
 
@@ -113,47 +321,234 @@ class bananapiJSONSerializer : public JSONSerializer {
       inputs.emplace_back(node);
     }
 
-    // Create the final node.
+    // Create the final node. Composites returning a tuple (e.g. bananapi.matmul_topk's
+    // values and indices) get one output per field.
+    size_t num_output = 1;
+    if (const auto* tuple = fn->ret_struct_info.as<TupleStructInfoNode>()) {
+      num_output = tuple->fields.size();
+    }
     auto node = std::make_shared<JSONGraphNode>(name,
-                                                /*op_type=*/"kernel", inputs,
-                                                /*num_output=*/1);
+                                                /*op_type=*/"kernel", inputs, num_output);
 
     // Transfer attributes from the collector's node to the final node.
     node->CaptureAttrs(*collector.node_);
 
+    if (name == "bananapi.matmul" && collector.matmul_rhs_const_.defined()) {
+      AnnotateBlockSparsity(node, collector.matmul_rhs_const_.value());
+    }
+    if (name == "bananapi.matmul") {
+      AnnotateViews(node, fn, collector);
+    }
+    if (name == "bananapi.layernorm_matmul") {
+      AnnotateLayerNorm(node, fn, collector);
+    }
+    if (name == "bananapi.matmul_gather") {
+      AnnotateGather(node, fn, collector);
+    }
+    if (options_.async) {
+      SetStringAttr(node, "async", {"1"});
+    }
+    if (options_.blocked_layout && name == "bananapi.matmul") {
+      SetStringAttr(node, "blocked_layout", {"1"});
+    }
+
     VLOG(1) << name << " has " << node->GetInputs().size() << " inputs";
 
     return AddNode(node, GetRef<Expr>(call_node));
   }
 
  private:
+  /*!
+   * \brief Select the block-sparse kernel for a constant 2D float32 weight whose fraction of
+   * all-zero blocks reaches the threshold. The runtime compresses the weight at Init using the
+   * block shape recorded here.
+   */
+  void AnnotateBlockSparsity(const JSONGraphObjectPtr& node, const Constant& weight) {
+    const runtime::NDArray& data = weight->data;
+    if (data->ndim != 2 || data->dtype.code != kDLFloat || data->dtype.bits != 32 ||
+        data->device.device_type != kDLCPU || !data.IsContiguous()) {
+      return;
+    }
+    int64_t num_blocks = 0;
+    int64_t nnz_blocks = CountNonZeroBlocks(data, kSparseBlockK, kSparseBlockN, &num_blocks);
+    double zero_fraction = 1.0 - static_cast<double>(nnz_blocks) / num_blocks;
+    VLOG(1) << "bananapi.matmul weight [" << data->shape[0] << ", " << data->shape[1]
+            << "]: " << nnz_blocks << "/" << num_blocks << " non-zero blocks";
+    if (zero_fraction < options_.sparse_threshold) return;
+
+    std::ostringstream density;
+    density << 1.0 - zero_fraction;
+    SetStringAttr(node, "sparse_block",
+                  {std::to_string(kSparseBlockK), std::to_string(kSparseBlockN)});
+    SetStringAttr(node, "sparse_nnz_blocks", {std::to_string(nnz_blocks)});
+    SetStringAttr(node, "sparse_density", {density.str()});
+  }
+
+  /*!
+   * \brief Record the reshape / permute_dims views fused around the matmul of a composite:
+   * "<a|b|c>_view_shape" / "<a|b|c>_view_strides" and, since the views no longer start at the
+   * matmul's own operands, "operand_inputs" with the node inputs A and B are read from.
+   */
+  void AnnotateViews(const JSONGraphObjectPtr& node, const Function& fn,
+                     const bananapiCollectFromCompositeFunctionBody& collector) {
+    Map<Var, Expr> bindings = AnalyzeVar2Value(fn);
+    Expr output = fn->body;
+    if (const auto* seq = output.as<SeqExprNode>()) output = seq->body;
+    std::vector<int64_t> shape, strides;
+    Expr matmul = TraceOutputView(output, bindings, &shape, &strides);
+    if (!IsOpCall(matmul, "relax.matmul")) return;
+    bool has_view = !strides.empty();
+    if (has_view) SetViewAttrs(node, "c", shape, strides);
+
+    std::vector<std::string> operand_inputs;
+    const char* names[] = {"a", "b"};
+    for (int i = 0; i < 2; ++i) {
+      Expr base = TraceOperandView(matmul.as<CallNode>()->args[i], bindings, &shape, &strides);
+      if (!strides.empty()) {
+        SetViewAttrs(node, names[i], shape, strides);
+        has_view = true;
+      }
+      int64_t index = InputIndex(fn, collector, base);
+      ICHECK_GE(index, 0) << "bananapi: matmul operand " << i << " is not a composite input";
+      operand_inputs.push_back(std::to_string(index));
+    }
+    if (has_view) SetStringAttr(node, "operand_inputs", operand_inputs);
+  }
+
+  /*!
+   * \brief Describe the layer norm of a bananapi.layernorm_matmul to the runtime: its A is the
+   * layer norm's input x ("operand_inputs"), gamma and beta are "layernorm_inputs" (constants
+   * of the body when the weights are bound, collected as extra node inputs) and epsilon is
+   * "layernorm_epsilon", printed at full precision.
+   */
+  void AnnotateLayerNorm(const JSONGraphObjectPtr& node, const Function& fn,
+                         const bananapiCollectFromCompositeFunctionBody& collector) {
+    ICHECK(collector.layer_norm_ != nullptr && collector.matmul_ != nullptr)
+        << "bananapi.layernorm_matmul needs a relax.nn.layer_norm and a relax.matmul";
+    const auto* attrs = collector.layer_norm_->attrs.as<LayerNormAttrs>();
+    ICHECK(attrs != nullptr && attrs->center && attrs->scale)
+        << "bananapi.layernorm_matmul needs both gamma and beta";
+    Map<Var, Expr> bindings = AnalyzeVar2Value(fn);
+    auto index_of = [&](const Expr& expr, const char* what) {
+      int64_t index = InputIndex(fn, collector, ResolveBinding(expr, bindings));
+      ICHECK_GE(index, 0) << "bananapi.layernorm_matmul: " << what << " is not a composite input";
+      return std::to_string(index);
+    };
+    const auto& ln_args = collector.layer_norm_->args;
+    SetStringAttr(node, "operand_inputs",
+                  {index_of(ln_args[0], "x"), index_of(collector.matmul_->args[1], "the weight")});
+    SetStringAttr(node, "layernorm_inputs",
+                  {index_of(ln_args[1], "gamma"), index_of(ln_args[2], "beta")});
+    std::ostringstream epsilon;
+    epsilon << std::setprecision(std::numeric_limits<double>::max_digits10) << attrs->epsilon;
+    SetStringAttr(node, "layernorm_epsilon", {epsilon.str()});
+  }
+
+  /*!
+   * \brief Describe the vocabulary gather of a bananapi.matmul_gather to the runtime: the
+   * matmul reads take(W, ids, axis=1), so A and the full weight W are "operand_inputs" and the
+   * ids are "gather_inputs". The kernel computes the ids' columns of A * W directly.
+   */
+  void AnnotateGather(const JSONGraphObjectPtr& node, const Function& fn,
+                      const bananapiCollectFromCompositeFunctionBody& collector) {
+    ICHECK(collector.take_ != nullptr && collector.matmul_ != nullptr)
+        << "bananapi.matmul_gather needs a relax.take and a relax.matmul";
+    const auto* attrs = collector.take_->attrs.as<TakeAttrs>();
+    std::vector<int64_t> w_shape;
+    ICHECK(StaticShape(collector.take_->args[0], &w_shape) && w_shape.size() == 2)
+        << "bananapi.matmul_gather needs a 2D weight of static shape";
+    ICHECK(attrs != nullptr && attrs->axis.defined() &&
+           (attrs->axis.value()->value == 1 || attrs->axis.value()->value == -1))
+        << "bananapi.matmul_gather only gathers the columns (axis 1) of the weight";
+    Map<Var, Expr> bindings = AnalyzeVar2Value(fn);
+    auto index_of = [&](const Expr& expr, const char* what) {
+      int64_t index = InputIndex(fn, collector, ResolveBinding(expr, bindings));
+      ICHECK_GE(index, 0) << "bananapi.matmul_gather: " << what << " is not a composite input";
+      return std::to_string(index);
+    };
+    SetStringAttr(node, "operand_inputs", {index_of(collector.matmul_->args[0], "A"),
+                                           index_of(collector.take_->args[0], "the weight")});
+    SetStringAttr(node, "gather_inputs", {index_of(collector.take_->args[1], "the ids")});
+  }
+
+  /*!
+   * \brief Node input index of expr: a parameter of the composite function, or a constant of
+   * its body (appended after the parameters). -1 if neither.
+   */
+  static int64_t InputIndex(const Function& fn,
+                            const bananapiCollectFromCompositeFunctionBody& collector,
+                            const Expr& expr) {
+    for (size_t p = 0; p < fn->params.size(); ++p) {
+      if (fn->params[p].same_as(expr)) return p;
+    }
+    for (size_t c = 0; c < collector.constants_.size(); ++c) {
+      if (collector.constants_[c] == expr.get()) return fn->params.size() + c;
+    }
+    return -1;
+  }
+
+  static void SetViewAttrs(const JSONGraphObjectPtr& node, const std::string& name,
+                           const std::vector<int64_t>& shape, const std::vector<int64_t>& strides) {
+    std::vector<std::string> shape_str, strides_str;
+    for (int64_t dim : shape) shape_str.push_back(std::to_string(dim));
+    for (int64_t stride : strides) strides_str.push_back(std::to_string(stride));
+    SetStringAttr(node, name + "_view_shape", shape_str);
+    SetStringAttr(node, name + "_view_strides", strides_str);
+  }
+
   /*! \brief The bindings to look up composite functions. */
   Map<Var, Expr> bindings_;
+  /*! \brief The codegen options. */
+  bananapiCodegenOptions options_;
 };
 
 void bananapiCollectFromCompositeFunctionBody::VisitExpr_(const ConstantNode* constant_node) {
   for (const auto& entry : serializer_->VisitExpr(GetRef<Constant>(constant_node))) {
     args_.emplace_back(entry);
+    constants_.push_back(constant_node);
   }
 }
 
 void bananapiCollectFromCompositeFunctionBody::VisitExpr_(const CallNode* call_node) {
   SetGenericAttributes(call_node);
+  static const Op& matmul_op = Op::Get("relax.matmul");
+  static const Op& layer_norm_op = Op::Get("relax.nn.layer_norm");
+  static const Op& take_op = Op::Get("relax.take");
+  if (call_node->op.same_as(matmul_op)) matmul_ = call_node;
+  if (call_node->op.same_as(take_op)) take_ = call_node;
+  if (call_node->op.same_as(matmul_op) && call_node->args[1]->IsInstance<ConstantNode>()) {
+    matmul_rhs_const_ = Downcast<Constant>(call_node->args[1]);
+  }
+  if (call_node->op.same_as(layer_norm_op)) layer_norm_ = call_node;
   ExprVisitor::VisitExpr_(call_node);
 }
 
 /*!
  * \brief Create runtime modules for bananapi.
  * \param functions The extern functions to be compiled via bananapi
+ * \param options Codegen options, passed as RunCodegen({"bananapi": {...}}):
+ *   - "sparse_threshold": fraction of all-zero [4, 16] blocks from which a constant weight
+ *     uses the block-sparse kernel (default 0.5, > 1 disables it).
+ *   - "async": non-zero to let the runtime enqueue the kernels and return immediately. The
+ *     caller must then wait through "runtime.bananapi_wait" before reading the outputs, see
+ *     insert_bananapi_waits() in bananapi_relax.py.
+ *   - "blocked_layout": 0 to keep every activation row-major. By default, when a partition
+ *     holds several matmuls (MergeCompositeFunctions), the outputs consumed only inside it stay
+ *     in the kernel's blocked layout instead of being converted back to row-major.
  * \return Runtime modules.
  */
 Array<runtime::Module> bananapiCompiler(Array<Function> functions,
-                                            Map<String, ObjectRef> /*unused*/,
+                                            Map<String, ObjectRef> options,
                                             Map<Constant, String> constant_names) {
+  bananapiCodegenOptions codegen_options;
+  codegen_options.sparse_threshold =
+      GetNumericOption(options, "sparse_threshold", kDefaultSparseThreshold);
+  codegen_options.async = GetNumericOption(options, "async", 0) != 0;
+  codegen_options.blocked_layout = GetNumericOption(options, "blocked_layout", 1) != 0;
   Array<runtime::Module> compiled_functions;
   for (const auto& func : functions) {
     VLOG(1) << "bananapi partition:" << std::endl << func;
-    bananapiJSONSerializer serializer(constant_names, AnalyzeVar2Value(func));
+    bananapiJSONSerializer serializer(constant_names, AnalyzeVar2Value(func), codegen_options);
     serializer.serialize(func);
     std::string graph_json = serializer.GetJSON();
     VLOG(1) << "bananapi JSON:" << std::endl << graph_json;
@@ -0,0 +1,343 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*!
+ * \file src/runtime/contrib/bananapi/bananapi_perf.cc
+ * \brief perf_event_open based kernel counters of the bananapi runtime.
+ */
+#include "bananapi_perf.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace tvm {
+namespace runtime {
+namespace contrib {
+
+namespace {
+
+enum CounterId {
+  kCycles,
+  kInstructions,
+  kCacheMisses,
+  kDtlbMisses,
+  kVectorInstructions,
+  kTaskClock,
+  kPageFaults,
+  kNumCounters
+};
+
+int64_t NowNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+int OpenEvent(uint32_t type, uint64_t config, pid_t tid) {
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  // pid 0 is the calling thread, otherwise a thread id; cpu -1: on any CPU
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0));
+}
+
+}  // namespace
+
+/*! \brief The perf events of one thread: the calling thread (tid 0) or a library worker. */
+struct ThreadCounters {
+  int fd[kNumCounters];
+  std::string source;
+  pid_t tid;
+
+  explicit ThreadCounters(pid_t tid) : tid(tid) {
+    std::fill(fd, fd + kNumCounters, -1);
+    fd[kCycles] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, tid);
+    if (fd[kCycles] >= 0) {
+      source = "hardware";
+      fd[kInstructions] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, tid);
+      fd[kCacheMisses] = OpenEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, tid);
+      fd[kDtlbMisses] = OpenEvent(PERF_TYPE_HW_CACHE,
+                                  PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+                                  tid);
+      // No generic event counts vector instructions; the raw code is PMU specific.
+      const char* vector_event = std::getenv("BANANAPI_PERF_VECTOR_EVENT");
+      if (vector_event && *vector_event) {
+        fd[kVectorInstructions] =
+            OpenEvent(PERF_TYPE_RAW, std::strtoull(vector_event, nullptr, 16), tid);
+      }
+    }
+    fd[kTaskClock] = OpenEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, tid);
+    fd[kPageFaults] = OpenEvent(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN, tid);
+    if (source.empty()) source = fd[kTaskClock] >= 0 ? "software" : "clock";
+  }
+
+  ~ThreadCounters() {
+    for (int f : fd) {
+      if (f >= 0) close(f);
+    }
+  }
+
+  /*! \brief True when at least one event could be opened for the thread. */
+  bool opened() const {
+    return std::any_of(fd, fd + kNumCounters, [](int f) { return f >= 0; });
+  }
+
+  /*! \brief Current counter values, scaled up when the kernel multiplexed the event. */
+  PerfSample Read() const {
+    PerfSample s;
+    int64_t values[kNumCounters];
+    for (int i = 0; i < kNumCounters; ++i) {
+      values[i] = -1;
+      uint64_t buf[3];
+      if (fd[i] < 0 || read(fd[i], buf, sizeof(buf)) != sizeof(buf)) continue;
+      double scale = buf[2] > 0 ? static_cast<double>(buf[1]) / buf[2] : 1.0;
+      values[i] = static_cast<int64_t>(buf[0] * scale);
+    }
+    s.cycles = values[kCycles];
+    s.instructions = values[kInstructions];
+    s.cache_misses = values[kCacheMisses];
+    s.dtlb_misses = values[kDtlbMisses];
+    s.vector_instructions = values[kVectorInstructions];
+    s.task_clock_ns = values[kTaskClock];
+    // The clock fallback only sees the calling thread.
+    if (s.task_clock_ns < 0 && tid == 0) {
+      s.task_clock_ns = NowNs(CLOCK_THREAD_CPUTIME_ID);
+      struct rusage usage;
+      if (getrusage(RUSAGE_THREAD, &usage) == 0) s.page_faults = usage.ru_minflt;
+    }
+    s.wall_ns = static_cast<double>(NowNs(CLOCK_MONOTONIC));
+    return s;
+  }
+};
+
+namespace {
+
+ThreadCounters& Counters() {
+  static thread_local ThreadCounters counters(0);
+  return counters;
+}
+
+int64_t Delta(int64_t end, int64_t begin) { return end >= 0 && begin >= 0 ? end - begin : -1; }
+
+/*! \brief Accumulate b into a, keeping -1 for counters that were never available. */
+void Accumulate(int64_t* a, int64_t b) {
+  if (b < 0) return;
+  *a = (*a < 0 ? 0 : *a) + b;
+}
+
+/*! \brief Add the counters (not the wall time) of b to a. */
+void AccumulateCounters(PerfSample* a, const PerfSample& b) {
+  Accumulate(&a->cycles, b.cycles);
+  Accumulate(&a->instructions, b.instructions);
+  Accumulate(&a->cache_misses, b.cache_misses);
+  Accumulate(&a->dtlb_misses, b.dtlb_misses);
+  Accumulate(&a->vector_instructions, b.vector_instructions);
+  Accumulate(&a->task_clock_ns, b.task_clock_ns);
+  Accumulate(&a->page_faults, b.page_faults);
+}
+
+std::string PerCall(int64_t total, int64_t calls) {
+  if (total < 0) return "-";
+  std::ostringstream os;
+  double v = static_cast<double>(total) / calls;
+  if (v >= 1e6) {
+    os.precision(3);
+    os << std::fixed << v / 1e6 << "M";
+  } else {
+    os << static_cast<int64_t>(v);
+  }
+  return os.str();
+}
+
+}  // namespace
+
+PerfCollector* PerfCollector::Global() {
+  static PerfCollector* inst = []() -> PerfCollector* {
+    const char* env = std::getenv("BANANAPI_PERF");
+    if (env == nullptr || std::string(env) != "1") return nullptr;
+    static PerfCollector collector;
+    return &collector;
+  }();
+  return inst;
+}
+
+PerfCollector::PerfCollector() {
+  source_ = Counters().source;
+  if (const char* p = std::getenv("BANANAPI_PEAK_GFLOPS")) peak_gflops_ = std::atof(p);
+  if (const char* p = std::getenv("BANANAPI_PEAK_GBPS")) peak_gbps_ = std::atof(p);
+}
+
+PerfCollector::~PerfCollector() {
+  const char* path = std::getenv("BANANAPI_PERF_REPORT");
+  if (path && *path) {
+    std::ofstream out(path);
+    Report(out);
+  } else {
+    Report(std::cerr);
+  }
+}
+
+void PerfCollector::AttachWorkers(int (*worker_tids)(int64_t* tids, int max)) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (attached_) return;
+  attached_ = true;
+  if (worker_tids == nullptr) return;
+  std::vector<int64_t> tids(256);
+  int n = std::min(worker_tids(tids.data(), static_cast<int>(tids.size())),
+                   static_cast<int>(tids.size()));
+  library_workers_ = n;
+  for (int i = 0; i < n; ++i) {
+    std::unique_ptr<ThreadCounters> counters(new ThreadCounters(static_cast<pid_t>(tids[i])));
+    if (counters->opened()) workers_.push_back(std::move(counters));
+  }
+}
+
+PerfSample PerfCollector::Read(bool workers_first) {
+  // Reading the workers stays outside the wall time of the scope.
+  PerfSample workers;
+  auto read_workers = [&]() {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& counters : workers_) AccumulateCounters(&workers, counters->Read());
+  };
+  if (workers_first) read_workers();
+  PerfSample s = Counters().Read();
+  if (!workers_first) read_workers();
+  AccumulateCounters(&s, workers);
+  return s;
+}
+
+PerfCollector::Scope::Scope(PerfCollector* collector, const std::string& signature, double flops,
+                            double bytes)
+    : collector_(collector), signature_(&signature), flops_(flops), bytes_(bytes) {
+  if (collector_) begin_ = collector_->Read(true);
+}
+
+PerfCollector::Scope::~Scope() {
+  if (!collector_) return;
+  PerfSample end = collector_->Read(false);
+  PerfSample delta;
+  delta.wall_ns = end.wall_ns - begin_.wall_ns;
+  delta.cycles = Delta(end.cycles, begin_.cycles);
+  delta.instructions = Delta(end.instructions, begin_.instructions);
+  delta.cache_misses = Delta(end.cache_misses, begin_.cache_misses);
+  delta.dtlb_misses = Delta(end.dtlb_misses, begin_.dtlb_misses);
+  delta.vector_instructions = Delta(end.vector_instructions, begin_.vector_instructions);
+  delta.task_clock_ns = Delta(end.task_clock_ns, begin_.task_clock_ns);
+  delta.page_faults = Delta(end.page_faults, begin_.page_faults);
+  collector_->Record(*signature_, flops_, bytes_, delta);
+}
+
+void PerfCollector::Record(const std::string& signature, double flops, double bytes,
+                           const PerfSample& delta) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Stats& st = stats_[signature];
+  st.calls += 1;
+  st.flops += flops;
+  st.bytes += bytes;
+  st.total.wall_ns += delta.wall_ns;
+  Accumulate(&st.total.cycles, delta.cycles);
+  Accumulate(&st.total.instructions, delta.instructions);
+  Accumulate(&st.total.cache_misses, delta.cache_misses);
+  Accumulate(&st.total.dtlb_misses, delta.dtlb_misses);
+  Accumulate(&st.total.vector_instructions, delta.vector_instructions);
+  Accumulate(&st.total.task_clock_ns, delta.task_clock_ns);
+  Accumulate(&st.total.page_faults, delta.page_faults);
+}
+
+void PerfCollector::Report(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<std::pair<std::string, Stats>> rows(stats_.begin(), stats_.end());
+  std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+    return a.second.total.wall_ns > b.second.total.wall_ns;
+  });
+  bool roofline = peak_gflops_ > 0 && peak_gbps_ > 0;
+  char line[512];
+  os << "bananapi kernel counters (source: " << source_ << ", per call, calling thread + "
+     << workers_.size() << " library worker threads)\n";
+  if (library_workers_ < 0 || static_cast<int>(workers_.size()) < library_workers_) {
+    os << "warning: no counters on the library's worker threads; kernels that run on its thread "
+          "pool are under-counted (run with BANANAPI_NUM_THREADS=1 for complete counts)\n";
+  }
+  if (roofline) {
+    snprintf(line, sizeof(line), "peak %.2f GFLOP/s, %.2f GB/s, ridge point %.2f FLOP/byte\n",
+             peak_gflops_, peak_gbps_, peak_gflops_ / peak_gbps_);
+    os << line;
+  } else {
+    os << "set BANANAPI_PEAK_GFLOPS and BANANAPI_PEAK_GBPS to classify compute / memory bound\n";
+  }
+  snprintf(line, sizeof(line), "%-56s %7s %10s %9s %9s %6s %9s %9s %9s %9s %9s %7s %s\n",
+           "signature", "calls", "ms/call", "GFLOP/s", "FLOP/B", "IPC", "cyc", "cache-mis",
+           "dtlb-mis", "vec-ins", "cpu-ms", "pgflt", "bound");
+  os << line;
+  for (const auto& row : rows) {
+    const Stats& st = row.second;
+    double seconds = st.total.wall_ns * 1e-9;
+    double gflops = seconds > 0 ? st.flops / seconds * 1e-9 : 0;
+    double intensity = st.bytes > 0 ? st.flops / st.bytes : 0;
+    std::string ipc = "-";
+    if (st.total.cycles > 0 && st.total.instructions >= 0) {
+      std::ostringstream s;
+      s.precision(2);
+      s << std::fixed << static_cast<double>(st.total.instructions) / st.total.cycles;
+      ipc = s.str();
+    }
+    std::string bound = "-";
+    if (roofline) {
+      double attainable = std::min(peak_gflops_, intensity * peak_gbps_);
+      std::ostringstream s;
+      s.precision(0);
+      s << (intensity < peak_gflops_ / peak_gbps_ ? "memory" : "compute") << " " << std::fixed
+        << (attainable > 0 ? 100.0 * gflops / attainable : 0) << "%";
+      bound = s.str();
+    }
+    double cpu_ms = st.total.task_clock_ns >= 0 ? st.total.task_clock_ns * 1e-6 / st.calls : -1;
+    snprintf(line, sizeof(line), "%-56s %7lld %10.3f %9.3f %9.2f %6s %9s %9s %9s %9s %9.3f %7s %s\n",
+             row.first.c_str(), static_cast<long long>(st.calls), seconds * 1e3 / st.calls, gflops,
+             intensity, ipc.c_str(), PerCall(st.total.cycles, st.calls).c_str(),
+             PerCall(st.total.cache_misses, st.calls).c_str(),
+             PerCall(st.total.dtlb_misses, st.calls).c_str(),
+             PerCall(st.total.vector_instructions, st.calls).c_str(), cpu_ms,
+             PerCall(st.total.page_faults, st.calls).c_str(), bound.c_str());
+    os << line;
+  }
+  os.flush();
+}
+
+}  // namespace contrib
+}  // namespace runtime
+}  // namespace tvm
@@ -0,0 +1,127 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*!
+ * \file src/runtime/contrib/bananapi/bananapi_perf.h
+ * \brief Per-kernel performance counters and roofline report of the bananapi runtime.
+ */
+#ifndef TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_PERF_H_
+#define TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_PERF_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace tvm {
+namespace runtime {
+namespace contrib {
+
+/*! \brief Counters collected around one kernel call; -1 marks a counter that is unavailable. */
+struct PerfSample {
+  double wall_ns{0};
+  int64_t cycles{-1};
+  int64_t instructions{-1};
+  int64_t cache_misses{-1};
+  int64_t dtlb_misses{-1};
+  int64_t vector_instructions{-1};
+  /*! \brief Software fallback: thread CPU time and minor page faults. */
+  int64_t task_clock_ns{-1};
+  int64_t page_faults{-1};
+};
+
+struct ThreadCounters;
+
+/*!
+ * \brief Process-wide collector enabled by BANANAPI_PERF=1.
+ *
+ * Counts the calling thread with perf_event_open: cycles, instructions, cache misses and dTLB
+ * misses, plus the raw PMU event given by BANANAPI_PERF_VECTOR_EVENT (hex) as the vector
+ * instruction count. Where hardware events cannot be opened (containers, perf_event_paranoid)
+ * it falls back to the software task-clock / page-fault events, and from there to
+ * CLOCK_THREAD_CPUTIME_ID and getrusage. Once AttachWorkers is called, the worker threads of
+ * libmatmul's pool are counted too and added to the calling thread's counts. Samples are aggregated per kernel signature and the
+ * roofline report is written at exit to BANANAPI_PERF_REPORT, or to stderr.
+ */
+class PerfCollector {
+ public:
+  /*! \brief The collector, or nullptr when BANANAPI_PERF is not set. */
+  static PerfCollector* Global();
+
+  /*!
+   * \brief Open counters on the worker threads of libmatmul's pool; first call wins.
+   * \param worker_tids The library's matmul_worker_tids, or nullptr when it has none.
+   */
+  void AttachWorkers(int (*worker_tids)(int64_t* tids, int max));
+
+  /*! \brief Times and counts the calling thread and the attached workers until destruction. */
+  class Scope {
+   public:
+    /*!
+     * \param collector The collector, may be nullptr (then the scope does nothing).
+     * \param signature Aggregation key, e.g. "bananapi.matmul [6,1500,64]x[6,64,1500]".
+     * \param flops Nominal floating point operations of the call.
+     * \param bytes Minimum memory traffic of the call: operands read once, output written once.
+     */
+    Scope(PerfCollector* collector, const std::string& signature, double flops, double bytes);
+    ~Scope();
+
+   private:
+    PerfCollector* collector_;
+    const std::string* signature_;
+    double flops_, bytes_;
+    PerfSample begin_;
+  };
+
+  /*! \brief Write the per-signature table sorted by total time. */
+  void Report(std::ostream& os);
+
+  ~PerfCollector();
+
+ private:
+  struct Stats {
+    int64_t calls{0};
+    double flops{0}, bytes{0};
+    PerfSample total;
+  };
+
+  PerfCollector();
+  /*! \brief Sum of the calling thread's and the workers' counters; workers first if first. */
+  PerfSample Read(bool workers_first);
+  void Record(const std::string& signature, double flops, double bytes, const PerfSample& delta);
+
+  std::mutex mu_;
+  std::map<std::string, Stats> stats_;
+  /*! \brief "hardware", "software" or "clock", the best source that could be opened. */
+  std::string source_;
+  double peak_gflops_{0}, peak_gbps_{0};
+  bool attached_{false};
+  /*! \brief Worker threads reported by the library, -1 when it cannot report them. */
+  int library_workers_{-1};
+  std::vector<std::unique_ptr<ThreadCounters>> workers_;
+};
+
+}  // namespace contrib
+}  // namespace runtime
+}  // namespace tvm
+
+#endif  // TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_PERF_H_
@@ -0,0 +1,651 @@
+"""Relax-side helpers shared by compile_encoder.py / compile_decoder.py / compile_decoder_with_past.py.
+
+Keep this file next to the compile scripts.
+"""
+import csv
+import glob
+import os
+import re
+import statistics
+
+import numpy as np
+import tvm
+from tvm import relax
+from tvm.relax.dpl import is_const, is_op, wildcard
+
+
+def bananapi_patterns(fuse_logits=None, cost_model=None, fuse_siblings=False, fuse_views=False,
+                      fuse_layernorm=False, fuse_gather=False, static_shapes=False):
+    """Patterns for FuseOpsByPattern, larger composites first (earlier entries win).
+
+    fuse_logits: None, "argmax" or "topk". Matches the logits projection followed by the
+    reduction added by fuse_logits_reduction(), so the kernel never writes the full logits.
+    cost_model: a BananapiCostModel. When given, a plain matmul is only offloaded if the model
+    expects the bananapi kernel to beat TVM's own code for its shape.
+    fuse_siblings: match the split(matmul(x, concat(W...))) left by fuse_sibling_matmuls() as
+    one bananapi.matmul_multi, which writes every field of the split directly.
+    fuse_views: let bananapi.matmul absorb permute_dims(reshape(x)) / permute_dims(x) operands
+    and a permute_dims / reshape(permute_dims) of its result, e.g. the per-head split of Q, K
+    and V and the merge of the heads afterwards. The kernel then reads x and writes the output
+    in place through strides instead of TVM copying the permuted tensors.
+    fuse_layernorm: match matmul(layer_norm(x, gamma, beta), W) as bananapi.layernorm_matmul.
+    The kernel normalizes x while packing its A panels, so the normalized activation is never
+    written to memory. Only fuses a layer norm whose output feeds nothing but this matmul.
+    fuse_gather: match matmul(x, take(W, ids, axis=1)), left by restrict_vocabulary(), as
+    bananapi.matmul_gather. The kernel reads only the ids' columns of W instead of TVM copying
+    them out first. Not subject to cost_model: it always moves less data than the copy.
+    static_shapes: only offload matches whose tensors all have static shapes, which the
+    bananapi runtime needs. For modules with symbolic dimensions such as decoder_with_past,
+    whose self-attention grows with the past sequence length and stays on TVM.
+    """
+    patterns = []
+    if fuse_siblings:
+        check = _check_multi if cost_model is None else cost_model.check_multi
+        patterns.append(("bananapi.matmul_multi",
+                         is_op("relax.split")(is_op("relax.matmul")(wildcard(), wildcard())),
+                         {}, check))
+    if fuse_logits == "argmax":
+        patterns.append(("bananapi.matmul_argmax",
+                         is_op("relax.argmax")(is_op("relax.matmul")(wildcard(), wildcard()))))
+    elif fuse_logits == "topk":
+        patterns.append(("bananapi.matmul_topk",
+                         is_op("relax.topk")(is_op("relax.matmul")(wildcard(), wildcard()))))
+    if fuse_gather:
+        gathered = is_op("relax.take")(wildcard(), wildcard())
+        patterns.append(("bananapi.matmul_gather",
+                         is_op("relax.matmul")(wildcard(), gathered), {}, _check_gather))
+    if fuse_layernorm:
+        layer_norm = is_op("relax.nn.layer_norm")(wildcard(), is_const(), is_const())
+        check = _check_layernorm if cost_model is None else cost_model.check_layernorm
+        patterns.append(("bananapi.layernorm_matmul",
+                         is_op("relax.matmul")(layer_norm, wildcard()), {}, check))
+    if fuse_views:
+        view_matmul = is_op("relax.matmul")(_operand_view(), _operand_view())
+        permuted = is_op("relax.permute_dims")(view_matmul)
+        output = is_op("relax.reshape")(permuted, wildcard()) | permuted | view_matmul
+        check = _check_views if cost_model is None else cost_model.check_views
+        patterns.append(("bananapi.matmul", output, {}, check))
+    matmul = is_op("relax.matmul")(wildcard(), wildcard())
+    if cost_model is None:
+        patterns.append(("bananapi.matmul", matmul))
+    else:
+        patterns.append(("bananapi.matmul", matmul, {}, cost_model.check))
+    if static_shapes:
+        patterns = [_require_static(pattern) for pattern in patterns]
+    return patterns
+
+
+def _require_static(pattern):
+    """pattern with its check function also requiring static shapes throughout the match."""
+    name, pat = pattern[0], pattern[1]
+    check = pattern[3] if len(pattern) > 3 else None
+
+    def static_check(context):
+        if not _match_is_static(context):
+            return False
+        return check is None or check(context)
+
+    return (name, pat, {}, static_check)
+
+
+def _sinfo_is_static(sinfo):
+    if isinstance(sinfo, relax.TupleStructInfo):
+        return all(_sinfo_is_static(field) for field in sinfo.fields)
+    if isinstance(sinfo, relax.TensorStructInfo):
+        return _static_shape(sinfo) is not None
+    return True  # shapes and attributes of reshape etc.
+
+
+def _match_is_static(context):
+    """Every call of the match, its operands and its result have static shapes."""
+    for value in [context.matched_expr] + list(context.matched_bindings.values()):
+        if not isinstance(value, relax.Call):
+            continue
+        if not _sinfo_is_static(value.struct_info):
+            return False
+        if not all(_sinfo_is_static(arg.struct_info) for arg in value.args):
+            return False
+    return True
+
+
+def _operand_view():
+    """x, permute_dims(x) or permute_dims(reshape(x)): operands the kernel reads in place."""
+    return (is_op("relax.permute_dims")(is_op("relax.reshape")(wildcard(), wildcard()))
+            | is_op("relax.permute_dims")(wildcard())
+            | wildcard())
+
+
+def _is_op_call(expr, *names):
+    return isinstance(expr, relax.Call) and isinstance(expr.op, tvm.ir.Op) and expr.op.name in names
+
+
+def _bound_value(context, expr):
+    """The value of a var bound inside the match, else expr."""
+    if isinstance(expr, relax.Var) and expr in context.matched_bindings:
+        return context.matched_bindings[expr]
+    return expr
+
+
+def _find_matmul(context):
+    """The relax.matmul call of a match, under its split / reshape / permute_dims."""
+    expr = context.matched_expr
+    while not _is_op_call(expr, "relax.matmul"):
+        expr = _bound_value(context, expr.args[0])
+    return expr
+
+
+def _intermediates_private(context):
+    """Nothing bound inside the match may be used outside of it."""
+    root = context.value_to_bound_var.get(context.matched_expr, None)
+    for var in context.matched_bindings.keys():
+        if root is not None and var.same_as(root):
+            continue
+        for user in context.var_usages.get(var, []):
+            if user not in context.matched_bindings:
+                return False
+    return True
+
+
+def _check_views(context):
+    """Every view has a static shape whose batch dimensions collapse into one, see
+    CollapseStrides in bananapi_runtime.cc."""
+    matmul = _find_matmul(context)
+    sides = [(arg, _bound_value(context, arg)) for arg in matmul.args]
+    sides.append((matmul, context.matched_expr))
+    for operand, value in sides:
+        if not _is_op_call(value, "relax.permute_dims", "relax.reshape"):
+            continue
+        shape = _static_shape(operand.struct_info)
+        if shape is None or len(shape) < 2 or sum(1 for d in shape[:-2] if d > 1) > 1:
+            return False
+        if _static_shape(value.struct_info) is None:
+            return False
+    return _intermediates_private(context)
+
+
+def _check_multi(context):
+    """bananapi.matmul_multi only splits the columns of a matmul with a 2D weight."""
+    split = context.matched_expr
+    matmul = _find_matmul(context)
+    ndim = matmul.struct_info.ndim
+    return matmul.args[1].struct_info.ndim == 2 and split.attrs.axis in (-1, ndim - 1)
+
+
+def _check_layernorm(context):
+    """The layer norm runs over the last axis of a float32 x, i.e. the K of the matmul, with
+    both gamma and beta, the weight is a shared 2D [K, N] and the normalized x is private."""
+    matmul = context.matched_expr
+    layer_norm = _bound_value(context, matmul.args[0])
+    ndim = layer_norm.struct_info.ndim
+    attrs = layer_norm.attrs
+    axes = [int(a) for a in attrs.axes]
+    return (axes in ([-1], [ndim - 1]) and attrs.center and attrs.scale
+            and layer_norm.struct_info.dtype == "float32"
+            and matmul.args[1].struct_info.ndim == 2
+            and _intermediates_private(context))
+
+
+def _check_gather(context):
+    """The take gathers columns (axis 1) of a float32 2D [K, V] weight with 1D integer ids, and
+    the gathered weight is private."""
+    matmul = context.matched_expr
+    take = _bound_value(context, matmul.args[1])
+    weight, ids = take.args
+    axis = take.attrs.axis
+    return (axis is not None and int(axis) in (1, -1)
+            and weight.struct_info.ndim == 2 and weight.struct_info.dtype == "float32"
+            and ids.struct_info.ndim == 1 and ids.struct_info.dtype in ("int32", "int64")
+            and _intermediates_private(context))
+
+
+def _const_weight_matmul(value):
+    """(lhs, weight) if value is relax.matmul(lhs, <2D constant>), else None."""
+    if not (isinstance(value, relax.Call) and isinstance(value.op, tvm.ir.Op)
+            and value.op.name == "relax.matmul"):
+        return None
+    lhs, rhs = value.args
+    if not isinstance(rhs, relax.Constant) or len(rhs.data.shape) != 2:
+        return None
+    if not isinstance(lhs, relax.Var):
+        return None
+    return lhs, rhs
+
+
+def fuse_sibling_matmuls(mod, min_group=2):
+    """Merge matmuls that read the same activation with different constant weights.
+
+    matmul(x, Wq), matmul(x, Wk), matmul(x, Wv) in one block become
+    split(matmul(x, concat([Wq, Wk, Wv], axis=1)), axis=-1), bound where the first of them was,
+    and every original var is rebound to its field of the split. The weights are concatenated
+    here, once, into a single constant. With bananapi_patterns(fuse_siblings=True) the result is
+    offloaded as one bananapi.matmul_multi, which reads x once and writes each projection into
+    its own output; if it is not offloaded TVM still computes the same values.
+    """
+    func = mod["main"]
+    seq = func.body
+    bb = relax.BlockBuilder()
+    new_blocks = []
+    num_fused = 0
+    for block in seq.blocks:
+        # [(lhs, dtype, [binding, ...])] in order of the first binding of each group
+        groups = []
+        for binding in block.bindings:
+            found = _const_weight_matmul(binding.value)
+            if found is None:
+                continue
+            lhs, weight = found
+            dtype = weight.data.dtype
+            for group_lhs, group_dtype, members in groups:
+                if group_lhs.same_as(lhs) and group_dtype == dtype:
+                    members.append(binding)
+                    break
+            else:
+                groups.append((lhs, dtype, [binding]))
+
+        var_cls = relax.DataflowVar if isinstance(block, relax.DataflowBlock) else relax.Var
+        replace = {}  # first binding of a group -> its replacement bindings; others -> []
+        for lhs, _, members in groups:
+            if len(members) < min_group:
+                continue
+            weights = [binding.value.args[1].data.numpy() for binding in members]
+            widths = [w.shape[1] for w in weights]
+            fused_weight = relax.const(np.concatenate(weights, axis=1))
+            matmul = bb.normalize(relax.op.matmul(lhs, fused_weight))
+            matmul_var = var_cls(lhs.name_hint + "_multi_matmul", matmul.struct_info)
+            offsets = list(np.cumsum(widths[:-1]))
+            split = bb.normalize(relax.op.split(matmul_var, [int(x) for x in offsets], axis=-1))
+            split_var = var_cls(lhs.name_hint + "_multi", split.struct_info)
+            bindings = [relax.VarBinding(matmul_var, matmul), relax.VarBinding(split_var, split)]
+            for i, binding in enumerate(members):
+                field = bb.normalize(relax.TupleGetItem(split_var, i))
+                bindings.append(relax.VarBinding(binding.var, field))
+                replace[binding] = []
+            replace[members[0]] = bindings
+            num_fused += 1
+
+        bindings = []
+        for binding in block.bindings:
+            bindings.extend(replace.get(binding, [binding]))
+        if isinstance(block, relax.DataflowBlock):
+            new_blocks.append(relax.DataflowBlock(bindings))
+        else:
+            new_blocks.append(relax.BindingBlock(bindings))
+
+    if num_fused == 0:
+        return mod
+    new_func = relax.Function(func.params, relax.SeqExpr(new_blocks, seq.body),
+                              func.ret_struct_info, attrs=func.attrs)
+    mod["main"] = new_func
+    return relax.transform.Normalize()(mod)
+
+
+def fuse_logits_reduction(mod, reduction="argmax", k=5):
+    """Replace output 0 of main (the logits) by argmax / top-k over the vocabulary axis.
+
+    The reduction is bound in the same dataflow block as the logits and the logits are no longer
+    an output, so FuseOpsByPattern can fuse matmul + reduction into one bananapi composite.
+    After this, out[0] is the int64 token ids [batch, seq] ("argmax") or the tuple
+    (values, indices) of shape [batch, seq, k] ("topk").
+    """
+    func = mod["main"]
+    seq = func.body
+    assert isinstance(seq.body, relax.Tuple), "main is expected to return (logits, present kv...)"
+    logits = seq.body.fields[0]
+
+    bb = relax.BlockBuilder()
+    new_blocks = []
+    new_output = None
+    for block in seq.blocks:
+        bindings = []
+        for binding in block.bindings:
+            if not binding.var.same_as(logits):
+                bindings.append(binding)
+                continue
+            # logits becomes block-local, the reduction becomes the block's output
+            var_cls = relax.DataflowVar if isinstance(block, relax.DataflowBlock) else relax.Var
+            inner = var_cls(logits.name_hint, logits.struct_info)
+            if reduction == "argmax":
+                value = bb.normalize(relax.op.argmax(inner, axis=-1))
+            else:
+                value = bb.normalize(relax.op.topk(inner, k=k, axis=-1, ret_type="both", dtype="int64"))
+            new_output = relax.Var("logits_" + reduction, value.struct_info)
+            bindings.append(relax.VarBinding(inner, binding.value))
+            bindings.append(relax.VarBinding(new_output, value))
+        if isinstance(block, relax.DataflowBlock):
+            new_blocks.append(relax.DataflowBlock(bindings))
+        else:
+            new_blocks.append(relax.BindingBlock(bindings))
+    assert new_output is not None, "logits output is not bound in main"
+
+    fields = [new_output] + list(seq.body.fields[1:])
+    ret_sinfo = relax.TupleStructInfo([field.struct_info for field in fields])
+    new_func = relax.Function(func.params, relax.SeqExpr(new_blocks, relax.Tuple(fields)),
+                              ret_sinfo, attrs=func.attrs)
+    mod["main"] = new_func
+    return relax.transform.Normalize()(mod)
+
+
+def restrict_vocabulary(mod, num_ids):
+    """Compute output 0 of main (the logits) for a subset of the vocabulary only.
+
+    Adds a main parameter allowed_ids (int64 [num_ids]) after the existing inputs and rewrites
+    the logits binding matmul(h, W) to matmul(h, take(W, allowed_ids, axis=1)), which
+    bananapi_patterns(fuse_gather=True) offloads as bananapi.matmul_gather. out[0] becomes
+    [batch, seq, num_ids]: logit i belongs to token allowed_ids[i]. The ids may change on every
+    call; pad a shorter list by repeating one of its ids (see pad_allowed_ids()).
+    """
+    func = mod["main"]
+    seq = func.body
+    assert isinstance(seq.body, relax.Tuple), "main is expected to return (logits, present kv...)"
+    logits = seq.body.fields[0]
+
+    ids = relax.Var("allowed_ids", relax.TensorStructInfo([num_ids], "int64"))
+    params = list(func.params)
+    attrs = func.attrs
+    num_input = attrs.get("num_input") if attrs is not None else None
+    if num_input is not None:
+        # params after num_input are the weights (keep_params_in_input=True)
+        params.insert(int(num_input), ids)
+        attrs = func.with_attr("num_input", int(num_input) + 1).attrs
+    else:
+        params.append(ids)
+
+    bb = relax.BlockBuilder()
+    new_blocks = []
+    new_logits = None
+    for block in seq.blocks:
+        bindings = []
+        for binding in block.bindings:
+            if not binding.var.same_as(logits):
+                bindings.append(binding)
+                continue
+            value = binding.value
+            assert _is_op_call(value, "relax.matmul"), "logits are expected to be a relax.matmul"
+            lhs, weight = value.args
+            assert weight.struct_info.ndim == 2, "the logits weight is expected to be 2D"
+            var_cls = relax.DataflowVar if isinstance(block, relax.DataflowBlock) else relax.Var
+            taken = bb.normalize(relax.op.take(weight, ids, axis=1))
+            taken_var = var_cls("allowed_weight", taken.struct_info)
+            matmul = bb.normalize(relax.op.matmul(lhs, taken_var, out_dtype=value.attrs.out_dtype))
+            new_logits = relax.Var(logits.name_hint, matmul.struct_info)
+            bindings.append(relax.VarBinding(taken_var, taken))
+            bindings.append(relax.VarBinding(new_logits, matmul))
+        if isinstance(block, relax.DataflowBlock):
+            new_blocks.append(relax.DataflowBlock(bindings))
+        else:
+            new_blocks.append(relax.BindingBlock(bindings))
+    assert new_logits is not None, "logits output is not bound in main"
+
+    fields = [new_logits] + list(seq.body.fields[1:])
+    ret_sinfo = relax.TupleStructInfo([field.struct_info for field in fields])
+    new_func = relax.Function(params, relax.SeqExpr(new_blocks, relax.Tuple(fields)),
+                              ret_sinfo, attrs=attrs)
+    mod["main"] = new_func
+    return relax.transform.Normalize()(mod)
+
+
+def pad_allowed_ids(ids, num_ids):
+    """ids as the int64 [num_ids] allowed_ids input of restrict_vocabulary(): a shorter list is
+    padded by repeating its first id, which leaves the argmax over the logits unchanged."""
+    ids = np.asarray(ids, dtype="int64").reshape(-1)
+    assert 0 < len(ids) <= num_ids, "between 1 and %d allowed ids expected" % num_ids
+    return np.concatenate([ids, np.full(num_ids - len(ids), ids[0], dtype="int64")])
+
+
+def _is_bananapi_call(value):
+    """Whether value is a call of a bananapi partition, as left by RunCodegen."""
+    return (isinstance(value, relax.Call)
+            and value.op.same_as(tvm.ir.Op.get("relax.call_dps_packed"))
+            and isinstance(value.args[0], relax.ExternFunc)
+            and str(value.args[0].global_symbol).endswith("_bananapi"))
+
+
+def insert_bananapi_waits(mod):
+    """Synchronize asynchronous bananapi kernels (RunCodegen({"bananapi": {"async": True}})).
+
+    Each offloaded call returns as soon as its kernel is enqueued. This inserts
+    runtime.bananapi_wait(out, inputs...) right before the first binding that reads the output
+    (or before main returns), so host ops in between overlap with the kernel. The wait also takes
+    the kernel's inputs, so the memory planner keeps them alive until the kernel is done.
+    main is converted to non-dataflow form because the wait is an impure packed call.
+    """
+    mod = relax.transform.ToNonDataflow()(mod)
+    func = mod["main"]
+    seq = func.body
+    wait_func = relax.ExternFunc("runtime.bananapi_wait")
+    pending = []  # [(output var, wait operands)], in submission order
+
+    def emit_wait(bindings, operands):
+        call = relax.Call(wait_func, operands, sinfo_args=[relax.ObjectStructInfo()])
+        bindings.append(relax.VarBinding(relax.Var("bananapi_wait", relax.ObjectStructInfo()), call))
+
+    block_bindings = []
+    for block in seq.blocks:
+        bindings = []
+        for binding in block.bindings:
+            used = relax.analysis.free_vars(binding.value)
+            still_pending = []
+            for var, operands in pending:
+                if any(u.same_as(var) for u in used):
+                    emit_wait(bindings, operands)
+                else:
+                    still_pending.append((var, operands))
+            pending = still_pending
+            bindings.append(binding)
+            if _is_bananapi_call(binding.value):
+                pending.append((binding.var, [binding.var] + list(binding.value.args[1].fields)))
+        block_bindings.append(bindings)
+    # outputs only read by the caller of main
+    for _, operands in pending:
+        emit_wait(block_bindings[-1], operands)
+
+    new_blocks = [relax.BindingBlock(bindings) for bindings in block_bindings]
+    new_func = relax.Function(func.params, relax.SeqExpr(new_blocks, seq.body),
+                              func.ret_struct_info, attrs=func.attrs)
+    mod["main"] = new_func.with_attr("relax.force_pure", True)
+    return mod
+
+
+_PROFILE_DATA_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "profile_data")
+_TENSOR_RE = re.compile(r"(\w+)\[([\d, ]*)\]")
+
+
+def _matmul_key(a_shape, b_shape, dtype):
+    """(n, m, o, batch, dtype) of matmul(a, b); batch is the product of the broadcast batch dims."""
+    n, m = a_shape[-2], a_shape[-1]
+    o = b_shape[-1]
+    a_batch, b_batch = list(a_shape[:-2]), list(b_shape[:-2])
+    rank = max(len(a_batch), len(b_batch))
+    a_batch = [1] * (rank - len(a_batch)) + a_batch
+    b_batch = [1] * (rank - len(b_batch)) + b_batch
+    batch = 1
+    for x, y in zip(a_batch, b_batch):
+        batch *= max(x, y)
+    return (n, m, o, batch, dtype)
+
+
+def _static_shape(sinfo):
+    if not isinstance(sinfo, relax.TensorStructInfo) or not isinstance(sinfo.shape, relax.ShapeExpr):
+        return None
+    if not all(isinstance(v, tvm.tir.IntImm) for v in sinfo.shape.values):
+        return None
+    return [int(v) for v in sinfo.shape.values]
+
+
+def _fit_latency(samples):
+    """Fit latency_us = overhead + macs * per_mac to {key: us}, minimizing the relative error.
+
+    Rows of 0 us (below the profiler's resolution) carry no relative error and are skipped."""
+    samples = {key: t for key, t in samples.items() if t > 0}
+    if not samples:
+        return 0.0, 0.0
+    # weighted least squares, weight 1/t^2
+    s00 = s01 = s11 = r0 = r1 = 0.0
+    for key, t in samples.items():
+        macs = float(key[0] * key[1] * key[2] * key[3])
+        w = 1.0 / (t * t)
+        s00 += w
+        s01 += w * macs
+        s11 += w * macs * macs
+        r0 += w * t
+        r1 += w * macs * t
+    det = s00 * s11 - s01 * s01
+    if len(samples) < 2 or det <= 0:
+        t, macs = next((t, k[0] * k[1] * k[2] * k[3]) for k, t in samples.items())
+        return 0.0, t / max(macs, 1)
+    overhead = (s11 * r0 - s01 * r1) / det
+    per_mac = (s00 * r1 - s01 * r0) / det
+    return max(overhead, 0.0), max(per_mac, 0.0)
+
+
+class BananapiCostModel:
+    """Decide per matmul shape whether the bananapi kernel beats TVM's generated code.
+
+    Keyed on (n, m, o, batch, dtype). Shapes measured by the operator profiles (see
+    inference_profile.py) use the median measured latency. Other shapes use
+    overhead + macs * per_mac, fitted per backend to the same measurements, so tiny matmuls pay
+    the dispatch overhead of the bananapi runtime.
+    """
+
+    def __init__(self, tvm_us, bananapi_us, margin=0.0, verbose=True):
+        """tvm_us / bananapi_us: {(n, m, o, batch, dtype): latency in us}.
+
+        margin: offload only when the bananapi estimate is below (1 - margin) * TVM estimate.
+        """
+        assert tvm_us and bananapi_us, "the cost model needs measurements of both backends"
+        self.tvm_us = dict(tvm_us)
+        self.bananapi_us = dict(bananapi_us)
+        self.margin = margin
+        self.verbose = verbose
+        self.tvm_fit = _fit_latency(self.tvm_us)
+        self.bananapi_fit = _fit_latency(self.bananapi_us)
+        self.decisions = {}  # key -> (tvm estimate, bananapi estimate, source, offload)
+
+    @staticmethod
+    def load_profile(profile_dir, offloaded):
+        """{key: median latency in us} of the matmuls in every csv of a profile_data/<run> dir.
+
+        offloaded: take the bananapi partitions (fused_relax_matmul*_bananapi) instead of TVM's
+        own matmul kernels. A run may contain both, e.g. matmuls with dynamic shapes stay on TVM.
+        """
+        durations = {}
+        for path in sorted(glob.glob(os.path.join(profile_dir, "*.csv"))):
+            with open(path) as f:
+                for row in csv.DictReader(f):
+                    name = row.get("Name", "")
+                    if offloaded:
+                        if not (name.startswith("fused_relax_matmul") and name.endswith("_bananapi")):
+                            continue
+                    elif not name.startswith("matmul"):
+                        continue
+                    tensors = _TENSOR_RE.findall(row.get("Argument Shapes") or "")  # aggregation.csv has none
+                    if len(tensors) != 3:
+                        continue
+                    (dtype, a), (_, b), _ = tensors
+                    a = [int(x) for x in a.split(",")]
+                    b = [int(x) for x in b.split(",")]
+                    key = _matmul_key(a, b, dtype)
+                    durations.setdefault(key, []).append(float(row["Duration (us)"]))
+        return {key: statistics.median(v) for key, v in durations.items()}
+
+    @classmethod
+    def from_profile_data(cls, tvm_run="baseline", bananapi_run="rvv_O3",
+                          profile_dir=_PROFILE_DATA_DIR, **kwargs):
+        """Seed the model from profile_data/<tvm_run> (no offload) and profile_data/<bananapi_run>."""
+        return cls(cls.load_profile(os.path.join(profile_dir, tvm_run), offloaded=False),
+                   cls.load_profile(os.path.join(profile_dir, bananapi_run), offloaded=True), **kwargs)
+
+    def estimate(self, key):
+        """(tvm us, bananapi us, source) for a key; source is "measured", "fitted" or "mixed"."""
+        def lookup(table, fit):
+            if key in table:
+                return table[key], True
+            macs = key[0] * key[1] * key[2] * key[3]
+            return fit[0] + macs * fit[1], False
+
+        tvm_us, tvm_measured = lookup(self.tvm_us, self.tvm_fit)
+        bananapi_us, bananapi_measured = lookup(self.bananapi_us, self.bananapi_fit)
+        if tvm_measured and bananapi_measured:
+            source = "measured"
+        elif tvm_measured or bananapi_measured:
+            source = "mixed"
+        else:
+            source = "fitted"
+        return tvm_us, bananapi_us, source
+
+    def should_offload(self, key):
+        if key[4] != "float32":  # libmatmul.so only has fp32 kernels
+            self.decisions[key] = (None, None, "dtype", False)
+            return False
+        tvm_us, bananapi_us, source = self.estimate(key)
+        offload = bananapi_us < (1.0 - self.margin) * tvm_us
+        self.decisions[key] = (tvm_us, bananapi_us, source, offload)
+        return offload
+
+    def check_multi(self, context):
+        """FuseOpsByPattern check function of the bananapi.matmul_multi pattern."""
+        return _check_multi(context) and self.check_call(_find_matmul(context))
+
+    def check_layernorm(self, context):
+        """FuseOpsByPattern check function of the bananapi.layernorm_matmul pattern. The layer
+        norm comes for free, so the matmul alone decides."""
+        return _check_layernorm(context) and self.check_call(context.matched_expr)
+
+    def check_views(self, context):
+        """FuseOpsByPattern check function of the bananapi.matmul pattern with fused views."""
+        return _check_views(context) and self.check_call(_find_matmul(context))
+
+    def check(self, context):
+        """FuseOpsByPattern check function of the bananapi.matmul pattern."""
+        return self.check_call(context.matched_expr)
+
+    def check_call(self, call):
+        """Whether to offload the relax.matmul call."""
+        a_shape = _static_shape(call.args[0].struct_info)
+        b_shape = _static_shape(call.args[1].struct_info)
+        if a_shape is None or b_shape is None or len(a_shape) < 2 or len(b_shape) < 2:
+            return True  # dynamic shapes: keep the old behaviour
+        return self.should_offload(_matmul_key(a_shape, b_shape, call.args[0].struct_info.dtype))
+
+    def report(self, mod):
+        """Print the decision for every bananapi partition of mod and every matmul left to TVM."""
+        offloaded = set()
+        for gv, func in mod.functions.items():
+            if not isinstance(func, relax.Function) or func.attrs is None:
+                continue
+            if func.attrs.get("Codegen") != "bananapi":
+                continue
+            name = str(func.attrs.get("global_symbol", gv.name_hint))
+            matmuls = []
+
+            def visit(expr):
+                if isinstance(expr, relax.Call) and isinstance(expr.op, tvm.ir.Op) \
+                        and expr.op.name == "relax.matmul":
+                    matmuls.append(expr)
+
+            relax.analysis.post_order_visit(func, visit)
+            for call in matmuls:
+                a_shape = _static_shape(call.args[0].struct_info)
+                b_shape = _static_shape(call.args[1].struct_info)
+                if a_shape is None or b_shape is None:
+                    print("[bananapi cost] %s: dynamic shape, offloaded" % name)
+                    continue
+                key = _matmul_key(a_shape, b_shape, call.args[0].struct_info.dtype)
+                offloaded.add(key)
+                self._print_decision(name, key)
+        for key, decision in sorted(self.decisions.items(), key=str):
+            if not decision[3] and key not in offloaded:
+                self._print_decision("(kept on TVM)", key)
+
+    def _print_decision(self, name, key):
+        if key not in self.decisions:
+            self.should_offload(key)
+        tvm_us, bananapi_us, source, offload = self.decisions[key]
+        n, m, o, batch, dtype = key
+        if tvm_us is None:
+            print("[bananapi cost] %s: n=%d m=%d o=%d batch=%d %s -> TVM (unsupported dtype)"
+                  % (name, n, m, o, batch, dtype))
+            return
+        print("[bananapi cost] %s: n=%d m=%d o=%d batch=%d %s tvm=%.1fus bananapi=%.1fus (%s) -> %s"
+              % (name, n, m, o, batch, dtype, tvm_us, bananapi_us, source,
+                 "bananapi" if offload else "TVM"))
@@ -0,0 +1,601 @@
+/*!
+ * \file bananapi_replay.cc
+ * \brief Replays a trace recorded with BANANAPI_TRACE against a matmul library.
+ *
+ * Reads the trace written by bananapi_trace.cc, loads libmatmul.so with dlopen and re-executes
+ * every recorded library call in the recorded order, with the recorded shapes, strides, offsets
+ * and buffer aliasing, N times. Reports per-signature and whole-trace times next to the times of
+ * the recorded run. Only the dlpack header is needed, not TVM, so a trace taken on the board can
+ * be replayed against any build of libmatmul_rvv.cpp / libmatmul_classic.cpp.
+ *
+ * Build (bananapi_trace.h sits next to this file):
+ *   g++ -std=c++17 -O2 -o bananapi_replay bananapi_replay.cc \
+ *       -I ~/tvm/3rdparty/dlpack/include -ldl -pthread
+ */
+#include <dlfcn.h>
+#include <dlpack/dlpack.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "bananapi_trace.h"
+
+using namespace tvm::runtime::contrib;
+
+namespace {
+
+[[noreturn]] void Die(const std::string& message) {
+  std::fprintf(stderr, "bananapi_replay: %s\n", message.c_str());
+  std::exit(1);
+}
+
+/*! \brief Command line options. */
+struct Options {
+  std::string trace_path;
+  /*! \brief libmatmul.so to replay against; BANANAPI_MATMUL_SO or ./libmatmul.so if empty. */
+  std::string lib_path;
+  std::string csv_path;
+  int iters = 10;
+  int warmup = 1;
+  /*! \brief BANANAPI_NUM_THREADS of the replay; -1 = as recorded. */
+  int threads = -1;
+};
+
+/*! \brief One operand of a recorded call. */
+struct Operand {
+  uint32_t buffer;
+  uint64_t byte_offset;
+  DLDataType dtype;
+  std::vector<int64_t> shape, strides;
+  bool has_strides;
+  /*! \brief Recorded contents from byte_offset on, empty unless the trace carries data. */
+  std::string data;
+};
+
+/*! \brief A call or a wait of the trace. */
+struct Event {
+  uint8_t tag;
+  /*! \brief Buffer waited for (kTagWait) or the Bp of the call. */
+  uint32_t buffer;
+  TraceKernel kernel;
+  TraceBp bp;
+  std::string label;
+  std::vector<int64_t> a_shape, b_shape, params;
+  double real, recorded_us;
+  std::vector<Operand> operands;
+  size_t num_written;
+};
+
+struct Trace {
+  uint32_t flags;
+  int32_t threads;
+  std::vector<Event> events;
+  size_t num_buffers{0};
+};
+
+/*! \brief Bounds-checked reads from the trace bytes. */
+class Reader {
+ public:
+  explicit Reader(const std::string& bytes) : bytes_(bytes) {}
+
+  bool done() const { return pos_ == bytes_.size(); }
+
+  template <typename T>
+  T Get() {
+    T value;
+    std::memcpy(&value, Take(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  std::vector<int64_t> Vec() {
+    size_t n = Get<uint8_t>();
+    std::vector<int64_t> v(n);
+    if (n > 0) std::memcpy(v.data(), Take(n * sizeof(int64_t)), n * sizeof(int64_t));
+    return v;
+  }
+
+  std::string Bytes(size_t n) { return std::string(Take(n), n); }
+
+  std::string Str() { return Bytes(Get<uint16_t>()); }
+
+ private:
+  const char* Take(size_t n) {
+    if (bytes_.size() - pos_ < n) Die("truncated trace");
+    const char* p = bytes_.data() + pos_;
+    pos_ += n;
+    return p;
+  }
+
+  const std::string& bytes_;
+  size_t pos_{0};
+};
+
+Trace LoadTrace(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) Die("cannot open " + path);
+  std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  Reader r(bytes);
+  if (r.Bytes(sizeof(kTraceMagic)) != std::string(kTraceMagic, sizeof(kTraceMagic))) {
+    Die(path + " is not a bananapi trace");
+  }
+  if (r.Get<uint32_t>() != kTraceVersion) Die(path + " has an unsupported trace version");
+  Trace trace;
+  trace.flags = r.Get<uint32_t>();
+  trace.threads = r.Get<int32_t>();
+  auto note_buffer = [&](uint32_t id) {
+    trace.num_buffers = std::max<size_t>(trace.num_buffers, id + 1);
+  };
+  while (!r.done()) {
+    Event e;
+    e.tag = r.Get<uint8_t>();
+    if (e.tag == kTagWait) {
+      e.buffer = r.Get<uint32_t>();
+      note_buffer(e.buffer);
+      trace.events.push_back(std::move(e));
+      continue;
+    }
+    if (e.tag != kTagCall) Die("corrupt trace");
+    e.kernel = static_cast<TraceKernel>(r.Get<uint8_t>());
+    e.label = r.Str();
+    e.bp = static_cast<TraceBp>(r.Get<uint8_t>());
+    e.buffer = r.Get<uint32_t>();
+    if (e.bp != TraceBp::kNone) note_buffer(e.buffer);
+    e.a_shape = r.Vec();
+    e.b_shape = r.Vec();
+    e.params = r.Vec();
+    e.real = r.Get<double>();
+    e.recorded_us = r.Get<double>();
+    size_t count = r.Get<uint8_t>();
+    e.num_written = r.Get<uint8_t>();
+    for (size_t i = 0; i < count; ++i) {
+      Operand op;
+      op.buffer = r.Get<uint32_t>();
+      note_buffer(op.buffer);
+      op.byte_offset = r.Get<uint64_t>();
+      op.dtype.code = r.Get<uint8_t>();
+      op.dtype.bits = r.Get<uint8_t>();
+      op.dtype.lanes = r.Get<uint16_t>();
+      op.shape = r.Vec();
+      op.has_strides = r.Get<uint8_t>() != 0;
+      if (op.has_strides) op.strides = r.Vec();
+      if ((trace.flags & kTraceData) && i + e.num_written < count) {
+        op.data = r.Bytes(static_cast<size_t>(r.Get<uint64_t>()));
+      }
+      e.operands.push_back(std::move(op));
+    }
+    trace.events.push_back(std::move(e));
+  }
+  return trace;
+}
+
+/*! \brief Bytes from the first to one past the last element op addresses. */
+size_t SpanBytes(const Operand& op) {
+  int64_t last = 0, dense = 1;
+  for (size_t i = op.shape.size(); i-- > 0;) {
+    if (op.shape[i] == 0) return 0;
+    last += (op.shape[i] - 1) * (op.has_strides ? op.strides[i] : dense);
+    dense *= op.shape[i];
+  }
+  return static_cast<size_t>(last + 1) * ((op.dtype.bits * op.dtype.lanes + 7) / 8);
+}
+
+/*! \brief 64-byte aligned, zero-initialized floats. */
+class AlignedBuffer {
+ public:
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(size_t bytes) {
+    size_t size = (std::max<size_t>(bytes, 1) + 63) / 64 * 64;
+    data_.reset(static_cast<char*>(std::aligned_alloc(64, size)));
+    std::memset(data_.get(), 0, size);
+    size_ = size;
+  }
+  char* data() const { return data_.get(); }
+  size_t size() const { return size_; }
+
+ private:
+  struct Free {
+    void operator()(char* p) const { std::free(p); }
+  };
+  std::unique_ptr<char, Free> data_;
+  size_t size_{0};
+};
+
+/*! \brief The entry points of the matmul library, as the runtime loads them. */
+struct Library {
+  using Operands = std::vector<const DLTensor*>;
+  using Shape = std::vector<int64_t>;
+  void (*matmul)(Operands&, Shape&, Shape&) = nullptr;
+  void (*prepacked)(Operands&, Shape&, Shape&, const float*) = nullptr;
+  void (*strided)(Operands&, Shape&, Shape&, const float*) = nullptr;
+  void (*blocked)(Operands&, Shape&, Shape&, const float*, int) = nullptr;
+  uint64_t (*async)(Operands&, Shape&, Shape&, const float*) = nullptr;
+  void (*wait)(uint64_t) = nullptr;
+  void (*bsr)(Operands&, Shape&, Shape&, int, int, const int32_t*, const int32_t*,
+              const float*) = nullptr;
+  void (*topk)(Operands&, Shape&, Shape&, const float*, int, float*, int64_t*) = nullptr;
+  void (*multi)(Operands&, Shape&, Shape&, const float*, const Shape&) = nullptr;
+  void (*layernorm)(Operands&, Shape&, Shape&, const float*, float) = nullptr;
+  void (*gather)(Operands&, Shape&, Shape&, const float*) = nullptr;
+  void (*pack_b)(const float*, int, int, int, float*) = nullptr;
+  void (*pack_b_multi)(const float*, int, int, const int64_t*, int, float*) = nullptr;
+  void (*pack_b_strided)(const DLTensor*, float*) = nullptr;
+  void (*pack_b_rows)(const float*, int, int, float*) = nullptr;
+  int64_t (*bsr_count)(const float*, int, int, int, int) = nullptr;
+  void (*pack_b_bsr)(const float*, int, int, int, int, int32_t*, int32_t*, float*) = nullptr;
+
+  explicit Library(std::string path) {
+    if (path.empty()) {
+      const char* env = std::getenv("BANANAPI_MATMUL_SO");
+      path = env && *env ? env : "./libmatmul.so";
+    }
+    void* so = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (so == nullptr) Die(std::string("cannot load ") + path + ": " + dlerror());
+    Load(so, "matmul", &matmul);
+    Load(so, "matmul_prepacked", &prepacked);
+    Load(so, "matmul_strided", &strided);
+    Load(so, "matmul_blocked", &blocked);
+    Load(so, "matmul_async", &async);
+    Load(so, "matmul_wait", &wait);
+    Load(so, "matmul_bsr", &bsr);
+    Load(so, "matmul_topk", &topk);
+    Load(so, "matmul_multi", &multi);
+    Load(so, "matmul_layernorm", &layernorm);
+    Load(so, "matmul_gather", &gather);
+    Load(so, "matmul_pack_B", &pack_b);
+    Load(so, "matmul_pack_B_multi", &pack_b_multi);
+    Load(so, "matmul_pack_B_strided", &pack_b_strided);
+    Load(so, "matmul_pack_B_rows", &pack_b_rows);
+    Load(so, "matmul_bsr_count", &bsr_count);
+    Load(so, "matmul_pack_B_bsr", &pack_b_bsr);
+  }
+
+  /*! \brief fn, or exit naming the missing entry point. */
+  template <typename Fn>
+  static Fn Need(Fn fn, const char* name) {
+    if (fn == nullptr) Die(std::string("the library does not export ") + name);
+    return fn;
+  }
+
+ private:
+  template <typename Fn>
+  static void Load(void* so, const char* name, Fn* fn) {
+    *fn = reinterpret_cast<Fn>(dlsym(so, name));
+  }
+};
+
+/*! \brief Per-label timing, in order of first appearance. */
+struct Row {
+  std::string label;
+  int64_t calls{0};
+  double recorded_us{0}, replay_us{0};
+};
+
+class Replayer {
+ public:
+  Replayer(const Trace& trace, const Library& lib) : trace_(trace), lib_(lib) {
+    // Every buffer as large as the furthest byte any call addresses, filled with small values.
+    std::vector<size_t> bytes(trace.num_buffers, 0);
+    for (const Event& e : trace.events) {
+      for (const Operand& op : e.operands) {
+        bytes[op.buffer] = std::max<size_t>(bytes[op.buffer], op.byte_offset + SpanBytes(op));
+      }
+    }
+    uint32_t seed = 12345;
+    for (size_t b = 0; b < bytes.size(); ++b) {
+      buffers_.emplace_back(bytes[b]);
+      float* p = reinterpret_cast<float*>(buffers_.back().data());
+      for (size_t i = 0; i < buffers_.back().size() / sizeof(float); ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        p[i] = static_cast<float>(seed >> 8) / 16777216.0f - 0.5f;
+      }
+    }
+    // Without recorded data, the vocabulary ids of matmul_gather must still be in range.
+    for (const Event& e : trace.events) {
+      if (e.tag != kTagCall || e.kernel != TraceKernel::kGather || !e.operands[2].data.empty()) {
+        continue;
+      }
+      const Operand& ids = e.operands[2];
+      char* base = buffers_[ids.buffer].data() + ids.byte_offset;
+      size_t n = SpanBytes(ids) / (ids.dtype.bits / 8);
+      int64_t vocab = e.b_shape[1];
+      for (size_t i = 0; i < n; ++i) {
+        int64_t id = static_cast<int64_t>(i * 7919) % vocab;
+        if (ids.dtype.bits == 64) {
+          reinterpret_cast<int64_t*>(base)[i] = id;
+        } else {
+          reinterpret_cast<int32_t*>(base)[i] = static_cast<int32_t>(id);
+        }
+      }
+    }
+  }
+
+  /*! \brief Run the whole trace once; returns its wall time in ms and adds each call to rows. */
+  double RunOnce(std::vector<Row>* rows) {
+    std::map<std::string, size_t> index;
+    for (size_t i = 0; i < rows->size(); ++i) index[(*rows)[i].label] = i;
+    double kernel_ms = 0;
+    for (const Event& e : trace_.events) {
+      if (e.tag == kTagWait) {
+        auto it = pending_.find(e.buffer);
+        if (it == pending_.end()) continue;
+        uint64_t token = it->second;
+        pending_.erase(it);
+        auto t0 = Clock::now();
+        lib_.wait(token);
+        kernel_ms += Ms(t0, Clock::now());
+        continue;
+      }
+      std::vector<DLTensor> tensors(e.operands.size());
+      for (size_t i = 0; i < e.operands.size(); ++i) tensors[i] = Tensor(e.operands[i]);
+      const float* bp = PackedB(e, tensors);
+      auto t0 = Clock::now();
+      Call(e, tensors, bp);
+      double ms = Ms(t0, Clock::now());
+      kernel_ms += ms;
+      auto it = index.find(e.label);
+      if (it == index.end()) {
+        it = index.emplace(e.label, rows->size()).first;
+        rows->push_back(Row{e.label});
+      }
+      Row& row = (*rows)[it->second];
+      row.calls += 1;
+      row.recorded_us += e.recorded_us;
+      row.replay_us += ms * 1000.0;
+    }
+    if (!pending_.empty()) {
+      uint64_t last = 0;
+      for (const auto& p : pending_) last = std::max(last, p.second);
+      auto t0 = Clock::now();
+      lib_.wait(last);
+      kernel_ms += Ms(t0, Clock::now());
+      pending_.clear();
+    }
+    return kernel_ms;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Bsr {
+    int64_t nnzb;
+    std::vector<int32_t> col_ptr, k_idx;
+    std::vector<float> vals;
+  };
+
+  static double Ms(Clock::time_point begin, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+  }
+
+  /*! \brief The operand over its replay buffer, with the recorded contents copied in first. */
+  DLTensor Tensor(const Operand& op) {
+    char* base = buffers_[op.buffer].data();
+    if (!op.data.empty()) std::memcpy(base + op.byte_offset, op.data.data(), op.data.size());
+    DLTensor t{};
+    t.data = base;
+    t.device = DLDevice{kDLCPU, 0};
+    t.ndim = static_cast<int32_t>(op.shape.size());
+    t.dtype = op.dtype;
+    t.shape = const_cast<int64_t*>(op.shape.data());
+    t.strides = op.has_strides ? const_cast<int64_t*>(op.strides.data()) : nullptr;
+    t.byte_offset = op.byte_offset;
+    return t;
+  }
+
+  static const float* Data(const DLTensor& t) {
+    return reinterpret_cast<const float*>(static_cast<const char*>(t.data) + t.byte_offset);
+  }
+
+  /*!
+   * \brief Bp of the call, packed from its B on first use like the runtime did at Init. The runtime
+   * reuses one Bp buffer for different views (a pinned K at another valid length, say), so a
+   * packed form is only reused for the same B buffer, byte offset, shape, strides and parameters.
+   */
+  const float* PackedB(const Event& e, const std::vector<DLTensor>& tensors) {
+    if (e.bp == TraceBp::kNone) return nullptr;
+    if (e.bp == TraceBp::kOperand) return Data(tensors[1]);
+    const Operand& b = e.operands[1];
+    PackKey key(e.buffer, e.bp, b.buffer, b.byte_offset, e.b_shape,
+                b.has_strides ? b.strides : std::vector<int64_t>(), e.params);
+    auto it = packed_.find(key);
+    if (it != packed_.end()) return reinterpret_cast<const float*>(it->second.data());
+    size_t elems = 1;
+    for (int64_t d : e.b_shape) elems *= static_cast<size_t>(d);
+    AlignedBuffer dst(elems * sizeof(float));
+    float* out = reinterpret_cast<float*>(dst.data());
+    int m = static_cast<int>(e.b_shape[e.b_shape.size() - 2]);
+    int o = static_cast<int>(e.b_shape.back());
+    if (e.bp == TraceBp::kPacked) {
+      int batch = e.b_shape.size() == 3 ? static_cast<int>(e.b_shape[0]) : 1;
+      Library::Need(lib_.pack_b, "matmul_pack_B")(Data(tensors[1]), batch, m, o, out);
+    } else if (e.bp == TraceBp::kPackedMulti) {
+      Library::Need(lib_.pack_b_multi, "matmul_pack_B_multi")(
+          Data(tensors[1]), m, o, e.params.data(), static_cast<int>(e.params.size()), out);
+    } else if (e.bp == TraceBp::kRows) {
+      Library::Need(lib_.pack_b_rows, "matmul_pack_B_rows")(Data(tensors[1]), m, o, out);
+    } else {
+      Library::Need(lib_.pack_b_strided, "matmul_pack_B_strided")(&tensors[1], out);
+    }
+    packed_.emplace(std::move(key), std::move(dst));
+    return out;
+  }
+
+  /*! \brief Block-sparse form of the call's B, built once per B buffer. */
+  const Bsr& SparseB(const Event& e, const DLTensor& b) {
+    auto it = bsr_.find(e.operands[1].buffer);
+    if (it != bsr_.end()) return it->second;
+    int m = static_cast<int>(e.b_shape[0]), o = static_cast<int>(e.b_shape[1]);
+    int bk = static_cast<int>(e.params[0]), bn = static_cast<int>(e.params[1]);
+    Bsr s;
+    s.nnzb = Library::Need(lib_.bsr_count, "matmul_bsr_count")(Data(b), m, o, bk, bn);
+    s.col_ptr.resize((o + bn - 1) / bn + 1);
+    s.k_idx.resize(s.nnzb);
+    s.vals.resize(s.nnzb * bk * bn);
+    Library::Need(lib_.pack_b_bsr, "matmul_pack_B_bsr")(Data(b), m, o, bk, bn, s.col_ptr.data(),
+                                                         s.k_idx.data(), s.vals.data());
+    return bsr_.emplace(e.operands[1].buffer, std::move(s)).first->second;
+  }
+
+  void Call(const Event& e, std::vector<DLTensor>& tensors, const float* bp) {
+    Library::Operands ops;
+    for (const DLTensor& t : tensors) ops.push_back(&t);
+    Library::Shape a = e.a_shape, b = e.b_shape;
+    switch (e.kernel) {
+      case TraceKernel::kMatmul:
+        lib_.matmul(ops, a, b);
+        break;
+      case TraceKernel::kPrepacked:
+        Library::Need(lib_.prepacked, "matmul_prepacked")(ops, a, b, bp);
+        break;
+      case TraceKernel::kStrided:
+        Library::Need(lib_.strided, "matmul_strided")(ops, a, b, bp);
+        break;
+      case TraceKernel::kBlocked:
+        Library::Need(lib_.blocked, "matmul_blocked")(ops, a, b, bp, static_cast<int>(e.params[0]));
+        break;
+      case TraceKernel::kAsync: {
+        uint64_t token = Library::Need(lib_.async, "matmul_async")(ops, a, b, bp);
+        Library::Need(lib_.wait, "matmul_wait");
+        for (const Operand& op : e.operands) pending_[op.buffer] = token;
+        break;
+      }
+      case TraceKernel::kBsr: {
+        const Bsr& s = SparseB(e, tensors[1]);
+        Library::Need(lib_.bsr, "matmul_bsr")(ops, a, b, static_cast<int>(e.params[0]),
+                                             static_cast<int>(e.params[1]), s.col_ptr.data(),
+                                             s.k_idx.data(), s.vals.data());
+        break;
+      }
+      case TraceKernel::kTopk: {
+        size_t n = static_cast<size_t>(a[0] * a[1] * e.params[0]);
+        if (topk_values_.size() < n) topk_values_.resize(n);
+        if (topk_indices_.size() < n) topk_indices_.resize(n);
+        Library::Need(lib_.topk, "matmul_topk")(ops, a, b, bp, static_cast<int>(e.params[0]),
+                                               e.params[1] ? topk_values_.data() : nullptr,
+                                               topk_indices_.data());
+        break;
+      }
+      case TraceKernel::kMulti:
+        Library::Need(lib_.multi, "matmul_multi")(ops, a, b, bp, e.params);
+        break;
+      case TraceKernel::kLayernorm:
+        Library::Need(lib_.layernorm, "matmul_layernorm")(ops, a, b, bp,
+                                                          static_cast<float>(e.real));
+        break;
+      case TraceKernel::kGather:
+        Library::Need(lib_.gather, "matmul_gather")(ops, a, b, bp);
+        break;
+      default:
+        Die("unknown kernel in trace");
+    }
+  }
+
+  const Trace& trace_;
+  const Library& lib_;
+  std::vector<AlignedBuffer> buffers_;
+  /*! \brief Bp buffer, Bp kind, B buffer, B byte offset, B shape, B strides, parameters. */
+  using PackKey = std::tuple<uint32_t, TraceBp, uint32_t, uint64_t, std::vector<int64_t>,
+                             std::vector<int64_t>, std::vector<int64_t>>;
+  /*! \brief Packed forms by the Bp buffer and the B view they were packed from. */
+  std::map<PackKey, AlignedBuffer> packed_;
+  std::unordered_map<uint32_t, Bsr> bsr_;
+  /*! \brief Newest asynchronous kernel using each buffer. */
+  std::unordered_map<uint32_t, uint64_t> pending_;
+  std::vector<float> topk_values_;
+  std::vector<int64_t> topk_indices_;
+};
+
+void Usage(const char* argv0) {
+  std::fprintf(stderr,
+               "usage: %s TRACE [--lib libmatmul.so] [--iters N] [--warmup N] [--threads N]\n"
+               "          [--csv FILE]\n",
+               argv0);
+  std::exit(1);
+}
+
+Options ParseArgs(int argc, char** argv) {
+  Options opt;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) Usage(argv[0]);
+      return argv[++i];
+    };
+    if (arg == "--lib") {
+      opt.lib_path = value();
+    } else if (arg == "--iters") {
+      opt.iters = std::stoi(value());
+    } else if (arg == "--warmup") {
+      opt.warmup = std::stoi(value());
+    } else if (arg == "--threads") {
+      opt.threads = std::stoi(value());
+    } else if (arg == "--csv") {
+      opt.csv_path = value();
+    } else if (opt.trace_path.empty() && arg[0] != '-') {
+      opt.trace_path = arg;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+  if (opt.trace_path.empty() || opt.iters < 1 || opt.warmup < 0) Usage(argv[0]);
+  return opt;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt = ParseArgs(argc, argv);
+  Trace trace = LoadTrace(opt.trace_path);
+  // The worker pool reads BANANAPI_NUM_THREADS on the first kernel call.
+  int threads = opt.threads >= 0 ? opt.threads : trace.threads;
+  if (threads > 0) setenv("BANANAPI_NUM_THREADS", std::to_string(threads).c_str(), 1);
+  Library lib(opt.lib_path);
+  Replayer replayer(trace, lib);
+
+  size_t calls = 0;
+  for (const Event& e : trace.events) calls += e.tag == kTagCall;
+  std::printf("%s: %zu calls, %zu buffers, %s, %s threads\n\n", opt.trace_path.c_str(), calls,
+              trace.num_buffers, (trace.flags & kTraceData) ? "recorded data" : "synthetic data",
+              threads > 0 ? std::to_string(threads).c_str() : "all");
+
+  std::vector<Row> warm;
+  for (int i = 0; i < opt.warmup; ++i) replayer.RunOnce(&warm);
+  std::vector<Row> rows;
+  std::vector<double> totals;
+  for (int i = 0; i < opt.iters; ++i) totals.push_back(replayer.RunOnce(&rows));
+  std::sort(totals.begin(), totals.end());
+
+  double recorded = 0, replayed = 0;
+  std::printf("%-64s %6s %14s %14s %7s\n", "signature", "calls", "recorded (us)", "replay (us)",
+              "ratio");
+  for (const Row& r : rows) {
+    double rec = r.recorded_us / r.calls, rep = r.replay_us / r.calls;
+    recorded += r.recorded_us / opt.iters;
+    replayed += r.replay_us / opt.iters;
+    std::printf("%-64s %6lld %14.1f %14.1f %7.2f\n", r.label.c_str(),
+                static_cast<long long>(r.calls / opt.iters), rec, rep, rec > 0 ? rep / rec : 0.0);
+  }
+  std::printf("\nkernel time per pass: recorded %.3f ms, replay %.3f ms (p50 %.3f, min %.3f)\n",
+              recorded / 1000.0, replayed / 1000.0, totals[totals.size() / 2], totals.front());
+
+  if (!opt.csv_path.empty()) {
+    std::ofstream csv(opt.csv_path);
+    csv << "signature,calls,recorded_us,replay_us\n";
+    for (const Row& r : rows) {
+      csv << '"' << r.label << "\"," << r.calls / opt.iters << ',' << r.recorded_us / r.calls << ','
+          << r.replay_us / r.calls << '\n';
+    }
+  }
+  return 0;
+}
@@ -30,17 +30,30 @@
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "../../file_utils.h"
 #include "../json/json_node.h"
 #include "../json/json_runtime.h"
+#include "bananapi_arena.h"
+#include "bananapi_perf.h"
+#include "bananapi_trace.h"
 
 // user add
 #include<stdio.h>
 #include<dlfcn.h>
 #include<stdlib.h>
 #include<iostream>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#include<algorithm>
+#include<cstring>
+#include<mutex>
+#include<sstream>
+#include<limits>
 // #include "matmul.h"
 
 namespace tvm {
@@ -49,6 +62,141 @@ namespace contrib {
 
 using namespace tvm::runtime::json;
 
+/*!
+ * \brief Offloaded kernels still in flight, shared by every bananapi module of the process.
+ * Each asynchronous kernel registers the data pointers it reads and writes; anything about to
+ * touch one of them waits for the kernel first.
+ */
+class PendingKernels {
+ public:
+  using WaitFn = void (*)(uint64_t);
+
+  static PendingKernels* Global() {
+    static PendingKernels inst;
+    return &inst;
+  }
+
+  void Add(const std::vector<const void*>& ptrs, uint64_t token, WaitFn wait) {
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const void* p : ptrs) {
+      auto& entry = pending_[p];
+      // Kernels complete in submission order, so the newest token covers older ones.
+      entry.token = std::max(entry.token, token);
+      entry.wait = wait;
+    }
+  }
+
+  /*! \brief Block until no in-flight kernel uses the buffer at ptr. */
+  void WaitFor(const void* ptr) {
+    Entry entry;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      auto it = pending_.find(ptr);
+      if (it == pending_.end()) return;
+      entry = it->second;
+      pending_.erase(it);
+    }
+    if (TraceRecorder* trace = TraceRecorder::Global()) trace->RecordWait(ptr);
+    entry.wait(entry.token);
+  }
+
+ private:
+  struct Entry {
+    uint64_t token{0};
+    WaitFn wait{nullptr};
+  };
+
+  std::mutex mu_;
+  std::unordered_map<const void*, Entry> pending_;
+};
+
+/*!
+ * \brief Valid prefix of the padded sequence axis, shared by every bananapi module of the process
+ * and set per invocation through runtime.bananapi_set_valid_length(valid, full). Whisper pads
+ * each clip to 30 s, i.e. full = 1500 encoder frames; with 0 < valid < full the kernels only
+ * compute the first valid positions of every axis of length full, see bananapi_matmul.
+ */
+class SequenceWindow {
+ public:
+  /*! \brief valid and full of the latest Set; inactive unless 0 < valid < full. */
+  struct Length {
+    int64_t valid{0}, full{0};
+    bool active() const { return valid > 0 && valid < full; }
+  };
+
+  static SequenceWindow* Global() {
+    static SequenceWindow inst;
+    return &inst;
+  }
+
+  void Set(int64_t valid, int64_t full) {
+    std::lock_guard<std::mutex> lock(mu_);
+    length_.valid = valid;
+    length_.full = full;
+  }
+
+  Length Get() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return length_;
+  }
+
+ private:
+  std::mutex mu_;
+  Length length_;
+};
+
+/*!
+ * \brief Tensors the host keeps unchanged for a while (e.g. one utterance), shared by every
+ * bananapi module of the process and set through runtime.bananapi_pin_operands(tensors...).
+ * Whisper's cross-attention K/V are written once by prefill and then passed untouched into every
+ * decoder_with_past step: a non-constant B read from a pinned tensor is packed by its first
+ * kernel and the packed form is reused until the next pin, see bananapi_Runtime::PinnedPackedB.
+ * Every pin, also an empty one, starts a new generation and drops the packed forms of the old.
+ * Packs and reuses are counted for runtime.bananapi_pinned_pack_counts, so a host can check that
+ * only the first step after a pin packs.
+ */
+class PinnedOperands {
+ public:
+  static PinnedOperands* Global() {
+    static PinnedOperands inst;
+    return &inst;
+  }
+
+  void Pin(const std::vector<const void*>& ptrs) {
+    std::lock_guard<std::mutex> lock(mu_);
+    data_.clear();
+    data_.insert(ptrs.begin(), ptrs.end());
+    ++generation_;
+  }
+
+  uint64_t Generation() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return generation_;
+  }
+
+  bool Contains(const void* ptr) {
+    std::lock_guard<std::mutex> lock(mu_);
+    return data_.count(ptr) != 0;
+  }
+
+  void NotePack(bool reused) {
+    std::lock_guard<std::mutex> lock(mu_);
+    ++(reused ? reuses_ : packs_);
+  }
+
+  /*! \brief Pinned B operands packed and packed forms reused since the process started. */
+  std::pair<int64_t, int64_t> Counts() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return {packs_, reuses_};
+  }
+
+ private:
+  std::mutex mu_;
+  std::unordered_set<const void*> data_;
+  uint64_t generation_{0};
+  int64_t packs_{0}, reuses_{0};
+};
+
 class bananapi_Runtime : public JSONRuntimeBase {
  public:
   /*!
@@ -80,115 +228,750 @@ class bananapi_Runtime : public JSONRuntimeBase {
     ICHECK_EQ(consts.size(), const_idx_.size())
         << "The number of input constants must match the number of required.";
     SetupConstants(consts);
+    BuildKernelPlans();
+    ReserveArena();
+    PrepareSparseWeights();
+    PrepareGatherWeights();
+    AllocateIntermediates();
+    PrepackConstantWeights();
+    if (PerfCollector::Global() != nullptr || TraceRecorder::Global() != nullptr) {
+      DescribePlansForPerf();
+    }
   }
 
   ~bananapi_Runtime() override {
     VLOG(1) << "Destroying bananapi runtime";
+    if (last_token_ != 0) matmul_wait_fp_(last_token_);
+    if (packed_map_ != nullptr) munmap(packed_map_, packed_map_size_);
     VLOG(1) << "Destroyed bananapi runtime";
   }
 
   /*! \brief Run inference using built engine. */
   void Run() override {
+    BananapiArena::Global()->NoteRun();
+    SequenceWindow::Length window = SequenceWindow::Global()->Get();
+    DropStalePinnedPacks();
+    // for instance, we have matmul of [6, 1500, 384] multiply by [384, 384], they are equivalent with [x, n, m] multiply by [m, o]
+    for (auto& plan : plans_) {
+      if (plan.op_name == "bananapi.matmul")
+        bananapi_matmul(plan, window);
+      else if (plan.op_name == "bananapi.matmul_argmax" || plan.op_name == "bananapi.matmul_topk")
+        bananapi_matmul_topk(plan);
+      else if (plan.op_name == "bananapi.matmul_multi")
+        bananapi_matmul_multi(plan, window);
+      else if (plan.op_name == "bananapi.layernorm_matmul")
+        bananapi_layernorm_matmul(plan, window);
+      else if (plan.op_name == "bananapi.matmul_gather")
+        bananapi_matmul_gather(plan);
+      // 後續增加其他 OP
+      else;
+    }
+  }
 
-    arg_arr.clear();
-    type_arr.clear();
-    buffer_arr.clear();   
+ private:
+  /*! \brief A constant B compressed into the block-sparse format of matmul_pack_B_bsr. */
+  struct SparseWeight {
+    int block_k, block_n;
+    int64_t nnzb;
+    ArenaBuffer col_ptr, k_idx, vals;
+  };
 
-    // for(size_t i=0; i<nodes_.size(); i++){
-      
-    //   // shape
-    //   // the following implementation is add operator's runtime, i need to implement matrix multiplication, which need to get the shape of m,n,o
-    //   auto A_shape = nodes_[i].GetOpShape()[0][0];
-    //   auto B_shape = nodes_[i].GetOpShape()[0][1];
+  /*! \brief An entry that never leaves the partition, held in the arena. */
+  struct ArenaTensor {
+    DLTensor tensor;
+    std::vector<int64_t> shape;
+    ArenaBuffer buffer;
+  };
 
-    //   int64_t n = A_shape[A_shape.size() - 2];
-    //   int64_t m = A_shape[A_shape.size() - 1];
-    //   int64_t o = B_shape[B_shape.size() - 1];
-    //   std::cout<<"N: "<<n<<", M: "<<m<<", O: "<<o<<std::endl;
-    //   arg_arr.push_back(n);
-    //   arg_arr.push_back(m);
-    //   arg_arr.push_back(o);
+  /*!
+   * \brief Everything Run() needs to dispatch one kernel node, resolved once at Init
+   * from the JSON graph instead of assuming the node order of a single-matmul partition.
+   */
+  struct KernelPlan {
+    /*! \brief Id of the kernel node in nodes_. */
+    uint32_t nid;
+    /*! \brief Composite name, e.g. "bananapi.matmul". */
+    std::string op_name;
+    /*! \brief Entry ids of the A, B operands and the C output. */
+    uint32_t a_eid, b_eid, c_eid;
+    /*! \brief Entry ids of all outputs; out_eids[0] == c_eid. */
+    std::vector<uint32_t> out_eids;
+    /*! \brief Number of kept entries per row for matmul_argmax (1) / matmul_topk. */
+    int top_k{0};
+    /*! \brief Columns of B written to each output of bananapi.matmul_multi, in output order. */
+    std::vector<int64_t> out_widths;
+    /*! \brief Entry ids of gamma and beta and the epsilon of bananapi.layernorm_matmul. */
+    uint32_t gamma_eid{0}, beta_eid{0};
+    float epsilon{0};
+    /*! \brief Entry id and length of the vocabulary ids of bananapi.matmul_gather. */
+    uint32_t ids_eid{0};
+    int64_t num_ids{0};
+    /*! \brief A constant B of bananapi.matmul_gather in the [o, m] row layout, or nullptr. */
+    const float* gather_rows{nullptr};
+    /*!
+     * \brief Element strides of A, B and C over A_shape, B_shape and [batch, n, o] when the
+     * codegen fused a reshape / permute_dims view of the operand into the node; empty if dense.
+     */
+    std::vector<int64_t> a_strides, b_strides, c_strides;
+    /*! \brief Normalized shapes: A is [batch, n, m], B is [m, o] or [batch, m, o]. */
+    std::vector<int64_t> A_shape, B_shape;
+    /*! \brief Whether B is a constant of the partition, i.e. packable at Init. */
+    bool b_is_const{false};
+    /*! \brief B in the kernel's packed tile layout, or nullptr to pack on the fly. */
+    const float* packed_b{nullptr};
+    /*! \brief Block-sparse form of a constant B, selected by the codegen. */
+    std::shared_ptr<SparseWeight> sparse;
+    /*! \brief Enqueue the kernel and return without waiting (codegen option "async"). */
+    bool async{false};
+    /*! \brief Whether the node may keep its activations blocked (codegen option "blocked_layout"). */
+    bool blocked_ok{false};
+    /*! \brief kLayoutABlocked / kLayoutCBlocked for activations that stay inside the partition. */
+    int layout{0};
+    /*!
+     * \brief Whether B is an intermediate kept in the blocked layout, which packed_b points at:
+     * packed for the full K and columns, so the plan must not be windowed.
+     */
+    bool b_blocked{false};
+    /*! \brief Aggregation key, nominal FLOPs and minimum bytes moved, for BANANAPI_PERF. */
+    std::string perf_signature;
+    double flops{0}, bytes{0};
+  };
 
+  /*! \brief Layout flags of matmul_blocked, MATMUL_A_BLOCKED / MATMUL_C_BLOCKED in libmatmul_rvv.cpp. */
+  static constexpr int kLayoutABlocked = 1;
+  static constexpr int kLayoutCBlocked = 2;
 
-    //   // dtype
-    //   auto tmp = nodes_[i].GetOpDataType();
-    //   auto node_type = tmp[0].code;
-    //   auto node_type_byte = tmp[0].bits/8;
-    //   type_arr.push_back({node_type, node_type_byte});
+  /*! \brief Collapse every leading dimension of a matmul operand into one batch dimension. */
+  static std::vector<int64_t> CollapseBatch(const std::vector<int64_t>& shape, bool is_rhs) {
+    ICHECK_GE(shape.size(), 2U) << "bananapi.matmul expects operands of rank >= 2";
+    int64_t batch = 1;
+    for (size_t i = 0; i + 2 < shape.size(); ++i) batch *= shape[i];
+    int64_t rows = shape[shape.size() - 2];
+    int64_t cols = shape[shape.size() - 1];
+    // A broadcast rhs ([m, o] or [1, .., m, o]) is shared by every batch of A.
+    if (is_rhs && batch == 1) return {rows, cols};
+    return {batch, rows, cols};
+  }
 
+  /*!
+   * \brief Strides matching CollapseBatch(shape, is_rhs). The batch dimensions of a view must
+   * nest (every one of size > 1 steps over the next), so a single batch stride describes them.
+   */
+  static std::vector<int64_t> CollapseStrides(const std::vector<int64_t>& shape,
+                                              const std::vector<int64_t>& strides, bool is_rhs) {
+    ICHECK_EQ(shape.size(), strides.size());
+    size_t nd = shape.size();
+    int64_t batch = 1, batch_stride = 0, inner = -1;
+    for (size_t i = nd - 2; i-- > 0;) {
+      if (shape[i] == 1) continue;
+      ICHECK(inner < 0 || strides[i] == strides[inner] * shape[inner])
+          << "bananapi: the batch dimensions of a strided operand cannot be collapsed";
+      if (inner < 0) batch_stride = strides[i];
+      inner = i;
+      batch *= shape[i];
+    }
+    if (is_rhs && batch == 1) return {strides[nd - 2], strides[nd - 1]};
+    return {batch_stride, strides[nd - 2], strides[nd - 1]};
+  }
 
-    //   auto buffer = (float*)malloc(node_arg * node_type_byte);
-    //   buffer_arr.push_back(buffer);
-    // }
-    // for instance, we have matmul of [6, 1500, 384] multiply by [384, 384], they are equivalent with [x, n, m] multiply by [m, o]
-    // std::cout<<"Run() starts here"<<std::endl;
-
-    A_shape = nodes_[0].GetOpShape()[0]; // vector<int64_t>
-    //A_shape = data_entry_[0]->shape; // vector<int64_t>
-    B_shape = nodes_[1].GetOpShape()[0]; // vector<int64_t>
-    //B_shape = data_entry_[1]->shape; // vector<int64_t>
-    // std::cout<<A_shape<<std::endl;
-    // std::cout<<B_shape<<std::endl;
-    
-    int64_t x = A_shape[A_shape.size() - 3];
-    int64_t n = A_shape[A_shape.size() - 2];
-    int64_t m = A_shape[A_shape.size() - 1];
-    int64_t o = B_shape[B_shape.size() - 1];
-    //std::cout<<"X: "<<x<<" N: "<<n<<", M: "<<m<<", O: "<<o<<std::endl;
-    arg_arr.push_back(x);
-    arg_arr.push_back(n);
-    arg_arr.push_back(m);
-    arg_arr.push_back(o);
-    // for (size_t i = 0; i < input_nodes_.size(); ++i) {
-    //   auto nid = input_nodes_[i];
-    //   if (nodes_[nid].GetOpType() == "input") {
-    //     memcpy(buffer_arr[nid], data_entry_[nid]->data, arg_arr[nid] * type_arr[nid].second);// data_entry's 0 and 1 is input A and B
-    //   }
-    // }
+  /*! \brief The reshape / permute_dims view of operand name ("a", "b", "c") fused by the codegen. */
+  static void ReadView(const JSONGraphNode& node, const std::string& name,
+                       std::vector<int64_t>* shape, std::vector<int64_t>* strides) {
+    if (!node.HasAttr(name + "_view_shape")) return;
+    auto ints = [&node](const std::string& key) {
+      std::vector<int64_t> values;
+      for (const auto& v : node.GetAttr<std::vector<std::string>>(key)) values.push_back(std::stoll(v));
+      return values;
+    };
+    *shape = ints(name + "_view_shape");
+    *strides = ints(name + "_view_strides");
+  }
 
-    // for (size_t i = 0; i < outputs_.size(); ++i) {
-    //   auto tmp = outputs_[i];
-    //   auto nid = tmp.id_;
-    //   memcpy(buffer_arr[nid], data_entry_[nid]->data, arg_arr[nid] * type_arr[nid].second);
-    // }
+  static bool HasViews(const KernelPlan& plan) {
+    return !plan.a_strides.empty() || !plan.b_strides.empty() || !plan.c_strides.empty();
+  }
 
-    // for(size_t i=0; i<nodes_.size(); i++){
-    //   auto input = nodes_[i].GetInputs();
-    //   std::cout << "node: " << i << std::endl;
-    //   std::cout << "\top_type: " << nodes_[i].GetOpType() << std::endl;
-    //   std::cout << "\tname:    " << nodes_[i].GetOpName() << std::endl;
-    //   for(size_t j=0; j<input.size(); j++){
-    //     std::cout << "\tinput " << j << " : " << input[j].id_ << std::endl;
-    //   }
-    // }
+  std::vector<int64_t> EntryShape(const JSONGraphNodeEntry& entry) const {
+    return nodes_[entry.id_].GetOpShape()[entry.index_];
+  }
 
-    // for(int i=0; i<data_entry_[0]->ndim; i++)
-    //   std::cout << "shape " << i << " : " << *(data_entry_[0]->shape+i) << std::endl;
-    
-    for(size_t nid=0; nid<nodes_.size(); nid++){
-      if(nodes_[nid].GetOpType() == "kernel"){
-        if(nodes_[nid].GetOpName() == "bananapi.matmul")
-          bananapi_matmul(nid);
-        // 後續增加其他 OP
-        else;
+  void BuildKernelPlans() {
+    plans_.clear();
+    for (size_t nid = 0; nid < nodes_.size(); ++nid) {
+      const auto& node = nodes_[nid];
+      if (node.GetOpType() != "kernel") continue;
+      KernelPlan plan;
+      plan.nid = static_cast<uint32_t>(nid);
+      plan.op_name = node.GetOpName();
+      auto inputs = node.GetInputs();
+      ICHECK_GE(inputs.size(), 2U) << plan.op_name << " expects two inputs";
+      // With fused views the codegen names the inputs the views start from.
+      size_t ia = 0, ib = 1;
+      if (node.HasAttr("operand_inputs")) {
+        auto idx = node.GetAttr<std::vector<std::string>>("operand_inputs");
+        ia = std::stoul(idx[0]);
+        ib = std::stoul(idx[1]);
+        ICHECK(ia < inputs.size() && ib < inputs.size()) << plan.op_name << ": bad operand_inputs";
+      }
+      plan.a_eid = EntryID(inputs[ia]);
+      plan.b_eid = EntryID(inputs[ib]);
+      plan.c_eid = EntryID(plan.nid, 0);
+      for (uint32_t i = 0; i < node.GetNumOutput(); ++i) plan.out_eids.push_back(EntryID(plan.nid, i));
+      std::vector<int64_t> a_shape = EntryShape(inputs[ia]), b_shape = EntryShape(inputs[ib]);
+      std::vector<int64_t> c_shape = node.GetOpShape()[0];
+      std::vector<int64_t> a_view, b_view, c_view;
+      ReadView(node, "a", &a_shape, &a_view);
+      ReadView(node, "b", &b_shape, &b_view);
+      ReadView(node, "c", &c_shape, &c_view);
+      plan.A_shape = CollapseBatch(a_shape, /*is_rhs=*/false);
+      plan.B_shape = CollapseBatch(b_shape, /*is_rhs=*/true);
+      if (!a_view.empty()) plan.a_strides = CollapseStrides(a_shape, a_view, /*is_rhs=*/false);
+      if (!b_view.empty()) plan.b_strides = CollapseStrides(b_shape, b_view, /*is_rhs=*/true);
+      if (!c_view.empty()) plan.c_strides = CollapseStrides(c_shape, c_view, /*is_rhs=*/false);
+      plan.b_is_const = nodes_[inputs[ib].id_].GetOpType() == "const";
+      plan.async = node.HasAttr("async");
+      plan.blocked_ok = node.HasAttr("blocked_layout");
+      if (plan.op_name == "bananapi.matmul_argmax") {
+        plan.top_k = 1;
+      } else if (plan.op_name == "bananapi.matmul_topk") {
+        plan.top_k = std::stoi(node.GetAttr<std::vector<std::string>>("k")[0]);
+        ICHECK_EQ(plan.out_eids.size(), 2U) << "bananapi.matmul_topk must return (values, indices)";
+        if (node.HasAttr("largest")) {
+          auto largest = node.GetAttr<std::vector<std::string>>("largest")[0];
+          ICHECK(largest != "0" && largest != "false" && largest != "False")
+              << "bananapi.matmul_topk only supports largest=True";
+        }
+      }
+      if (plan.top_k > 0) {
+        ICHECK_EQ(plan.B_shape.size(), 2U) << plan.op_name << " expects a shared [m, o] weight";
+        ICHECK_LE(plan.top_k, plan.B_shape[1]) << plan.op_name << ": k exceeds the vocabulary";
+      }
+      if (plan.op_name == "bananapi.matmul_multi") {
+        ICHECK_EQ(plan.B_shape.size(), 2U) << plan.op_name << " expects a shared [m, o] weight";
+        int64_t total = 0;
+        for (uint32_t i = 0; i < node.GetNumOutput(); ++i) {
+          auto c_shape = CollapseBatch(node.GetOpShape()[i], /*is_rhs=*/false);
+          ICHECK(c_shape[0] == plan.A_shape[0] && c_shape[1] == plan.A_shape[1])
+              << plan.op_name << ": output " << i << " must keep the rows of A";
+          plan.out_widths.push_back(c_shape[2]);
+          total += c_shape[2];
+        }
+        ICHECK_EQ(total, plan.B_shape[1]) << plan.op_name << ": outputs must split B's columns";
+      }
+      if (plan.op_name == "bananapi.layernorm_matmul") {
+        ICHECK_EQ(plan.B_shape.size(), 2U) << plan.op_name << " expects a shared [m, o] weight";
+        ICHECK(node.HasAttr("layernorm_inputs") && node.HasAttr("layernorm_epsilon"))
+            << plan.op_name << ": the codegen did not describe the layer norm";
+        auto idx = node.GetAttr<std::vector<std::string>>("layernorm_inputs");
+        size_t ig = std::stoul(idx[0]), ibeta = std::stoul(idx[1]);
+        ICHECK(ig < inputs.size() && ibeta < inputs.size()) << plan.op_name << ": bad layernorm_inputs";
+        for (size_t i : {ig, ibeta}) {
+          ICHECK_EQ(NumElements(EntryShape(inputs[i])), plan.A_shape[2])
+              << plan.op_name << ": gamma and beta must match the normalized axis";
+        }
+        plan.gamma_eid = EntryID(inputs[ig]);
+        plan.beta_eid = EntryID(inputs[ibeta]);
+        plan.epsilon = std::stof(node.GetAttr<std::vector<std::string>>("layernorm_epsilon")[0]);
+      }
+      if (plan.op_name == "bananapi.matmul_gather") {
+        ICHECK_EQ(plan.B_shape.size(), 2U) << plan.op_name << " expects a shared [m, o] weight";
+        ICHECK(node.HasAttr("gather_inputs")) << plan.op_name << ": the codegen did not name the ids";
+        size_t iids = std::stoul(node.GetAttr<std::vector<std::string>>("gather_inputs")[0]);
+        ICHECK_LT(iids, inputs.size()) << plan.op_name << ": bad gather_inputs";
+        plan.ids_eid = EntryID(inputs[iids]);
+        plan.num_ids = NumElements(EntryShape(inputs[iids]));
+        auto c_shape = CollapseBatch(node.GetOpShape()[0], /*is_rhs=*/false);
+        ICHECK(c_shape[0] * c_shape[1] == plan.A_shape[0] * plan.A_shape[1] &&
+               c_shape[2] == plan.num_ids)
+            << plan.op_name << ": the output must hold one logit per row of A and id";
       }
+      plans_.push_back(plan);
     }
-    // if we directly write data to data_entry_'s [2], then buffer_arr is not necessary
+  }
 
-    // for (size_t i = 0; i < outputs_.size(); ++i) {  
-    //   auto tmp = outputs_[i];
-    //   auto nid = tmp.id_; // that constant is 2
-    //   memcpy(data_entry_[nid]->data, buffer_arr[nid], arg_arr[nid] * type_arr[nid].second); // put back answer to [2]
-    // }
+  // ---------------- arena ----------------
+  /*! \brief Bytes of output i of a node. */
+  static size_t EntryBytes(const JSONGraphNode& node, uint32_t i) {
+    const DLDataType& dtype = node.GetOpDataType()[i];
+    return NumElements(node.GetOpShape()[i]) * ((dtype.bits * dtype.lanes + 7) / 8);
+  }
+
+  /*!
+   * \brief Reserve this module's footprint in the arena in one piece, sized from the plans:
+   * intermediates, privately packed weights, gather row layouts and top-k scratch. Block-sparse weights are only
+   * sized once counted and take what is left of the slab or a new one. Also allocates the
+   * top-k scratch, so Run never allocates.
+   */
+  void ReserveArena() {
+    std::vector<bool> is_output(data_entry_.size(), false);
+    for (const auto& out : outputs_) is_output[EntryID(out)] = true;
+    const char* dir = std::getenv("BANANAPI_PACKED_DIR");
+    const char* prepack = std::getenv("BANANAPI_PREPACK");
+    bool private_pack = !(dir && *dir) && prepack && std::string(prepack) == "1";
+
+    size_t total = 0, topk_bytes = 0;
+    for (const auto& plan : plans_) {
+      const auto& node = nodes_[plan.nid];
+      for (uint32_t i = 0; i < plan.out_eids.size(); ++i) {
+        if (!is_output[plan.out_eids[i]]) total += EntryBytes(node, i) + 64;
+      }
+      if (private_pack && UsesDensePack(plan)) {
+        total += NumElements(plan.B_shape) * sizeof(float) + 64;
+      }
+      if (plan.num_ids > 0 && plan.b_is_const) {
+        total += NumElements(plan.B_shape) * sizeof(float) + 64;
+      }
+      if (plan.top_k > 0) {
+        topk_bytes = std::max<size_t>(topk_bytes, plan.A_shape[0] * plan.A_shape[1] * plan.top_k *
+                                                      sizeof(int64_t));
+      }
+    }
+    total += topk_bytes;
+    if (total == 0) return;
+    BananapiArena::Global()->Reserve(total);
+    if (topk_bytes > 0) topk_indices_ = ArenaBuffer(topk_bytes);
+  }
+
+  // ---------------- block-sparse 權重 ----------------
+  /*!
+   * \brief Compress the constant weights the codegen marked with "sparse_block". Falls back
+   * to the dense kernel when the library has no block-sparse entry points.
+   */
+  void PrepareSparseWeights() {
+    for (auto& plan : plans_) {
+      const auto& node = nodes_[plan.nid];
+      if (!plan.b_is_const || plan.B_shape.size() != 2 || !node.HasAttr("sparse_block")) continue;
+      EnsureMatmulLoaded();
+      if (!bsr_count_fp_ || !pack_b_bsr_fp_ || !matmul_bsr_fp_) {
+        LOG(WARNING) << "bananapi: matmul library has no block-sparse kernel, using dense matmul";
+        return;
+      }
+      auto block = node.GetAttr<std::vector<std::string>>("sparse_block");
+      ICHECK_EQ(block.size(), 2U) << "sparse_block must be [block_k, block_n]";
+      auto sparse = std::make_shared<SparseWeight>();
+      sparse->block_k = std::stoi(block[0]);
+      sparse->block_n = std::stoi(block[1]);
+      const float* B = ConstantB(plan);
+      int m = static_cast<int>(plan.B_shape[0]);
+      int o = static_cast<int>(plan.B_shape[1]);
+      int64_t nnzb = bsr_count_fp_(B, m, o, sparse->block_k, sparse->block_n);
+      sparse->nnzb = nnzb;
+      sparse->col_ptr = ArenaBuffer(((o + sparse->block_n - 1) / sparse->block_n + 1) * sizeof(int32_t));
+      sparse->k_idx = ArenaBuffer(nnzb * sizeof(int32_t));
+      sparse->vals = ArenaBuffer(nnzb * sparse->block_k * sparse->block_n * sizeof(float));
+      pack_b_bsr_fp_(B, m, o, sparse->block_k, sparse->block_n, sparse->col_ptr.data<int32_t>(),
+                     sparse->k_idx.data<int32_t>(), sparse->vals.data<float>());
+      VLOG(1) << "bananapi: node " << plan.nid << " uses block-sparse weight, " << nnzb
+              << " non-zero blocks";
+      plan.sparse = sparse;
+    }
+  }
+
+  // ---------------- vocabulary gather 權重 ----------------
+  /*!
+   * \brief Transpose the constant weight of every bananapi.matmul_gather into the [o, m] row
+   * layout of matmul_pack_B_rows, so each gathered vocabulary entry is one contiguous run. A
+   * weight that is a partition input, or a library without the entry point, is read through
+   * strided column loads instead.
+   */
+  void PrepareGatherWeights() {
+    for (auto& plan : plans_) {
+      if (plan.num_ids == 0 || !plan.b_is_const) continue;
+      EnsureMatmulLoaded();
+      if (!pack_b_rows_fp_) {
+        LOG(WARNING) << "bananapi: matmul library has no matmul_pack_B_rows, gathering columns";
+        return;
+      }
+      gather_storage_.emplace_back(NumElements(plan.B_shape) * sizeof(float));
+      pack_b_rows_fp_(ConstantB(plan), static_cast<int>(plan.B_shape[0]), static_cast<int>(plan.B_shape[1]),
+                      gather_storage_.back().data<float>());
+      plan.gather_rows = gather_storage_.back().data<float>();
+    }
+  }
+
+  // ---------------- partition 內部的中間結果 ----------------
+  /*!
+   * \brief Allocate the entries produced and consumed inside the partition, which TVM does not
+   * bind, and choose their layout.
+   *
+   * An intermediate produced by a dense bananapi.matmul and only read by dense bananapi.matmul
+   * nodes stays in the blocked activation layout of matmul_blocked: the producer writes its
+   * column panels directly, consumers read them as a pre-packed B or panel by panel as A. Only
+   * the partition outputs are written row-major.
+   */
+  void AllocateIntermediates() {
+    std::vector<bool> is_output(data_entry_.size(), false);
+    for (const auto& out : outputs_) is_output[EntryID(out)] = true;
+
+    intermediates_.clear();
+    std::vector<std::pair<KernelPlan*, uint32_t>> produced;
+    for (auto& plan : plans_) {
+      const auto& node = nodes_[plan.nid];
+      for (uint32_t i = 0; i < plan.out_eids.size(); ++i) {
+        uint32_t eid = plan.out_eids[i];
+        if (is_output[eid]) continue;
+        auto t = std::make_unique<ArenaTensor>();
+        t->shape = node.GetOpShape()[i];
+        t->buffer = ArenaBuffer(EntryBytes(node, i));
+        t->tensor.data = t->buffer.data<void>();
+        t->tensor.device = {kDLCPU, 0};
+        t->tensor.ndim = static_cast<int32_t>(t->shape.size());
+        t->tensor.dtype = node.GetOpDataType()[i];
+        t->tensor.shape = t->shape.data();
+        t->tensor.strides = nullptr;
+        t->tensor.byte_offset = 0;
+        data_entry_[eid] = &t->tensor;
+        intermediates_.push_back(std::move(t));
+        produced.emplace_back(&plan, eid);
+      }
+    }
+    if (produced.empty()) return;
+
+    EnsureMatmulLoaded();
+    if (!matmul_blocked_fp_) return;
+    auto chainable = [](const KernelPlan& plan) {
+      return plan.op_name == "bananapi.matmul" && plan.blocked_ok && !plan.sparse && !HasViews(plan);
+    };
+    int num_blocked = 0;
+    for (const auto& it : produced) {
+      KernelPlan* producer = it.first;
+      uint32_t eid = it.second;
+      if (!chainable(*producer) || eid != producer->c_eid) continue;
+      std::vector<KernelPlan*> consumers;
+      bool ok = true;
+      for (auto& plan : plans_) {
+        if (plan.a_eid != eid && plan.b_eid != eid) continue;
+        ok = ok && chainable(plan);
+        consumers.push_back(&plan);
+      }
+      if (!ok || consumers.empty()) continue;
+      producer->layout |= kLayoutCBlocked;
+      for (KernelPlan* plan : consumers) {
+        if (plan->a_eid == eid) plan->layout |= kLayoutABlocked;
+        // The blocked layout is exactly the packed B layout.
+        if (plan->b_eid == eid) {
+          plan->packed_b = TensorData<const float>(data_entry_[eid]);
+          plan->b_blocked = true;
+        }
+      }
+      ++num_blocked;
+    }
+    VLOG(1) << "bananapi: " << symbol_name_ << " keeps " << num_blocked << " of " << produced.size()
+            << " intermediates in the blocked layout";
+  }
+
+  // ---------------- BANANAPI_PERF ----------------
+  /*!
+   * \brief Name every plan by op, shapes and kernel variant for the counter report, and
+   * compute its roofline coordinates: 2*batch*n*m*o FLOPs over the bytes of A, B and C.
+   */
+  void DescribePlansForPerf() {
+    auto dims = [](const std::vector<int64_t>& shape) {
+      std::ostringstream os;
+      for (size_t i = 0; i < shape.size(); ++i) os << (i ? "," : "[") << shape[i];
+      os << "]";
+      return os.str();
+    };
+    for (auto& plan : plans_) {
+      const auto& a = plan.A_shape;
+      int64_t o = plan.B_shape.back();
+      double b_elems = plan.sparse ? static_cast<double>(plan.sparse->nnzb * plan.sparse->block_k *
+                                                         plan.sparse->block_n)
+                                   : static_cast<double>(NumElements(plan.B_shape));
+      if (plan.num_ids > 0) {
+        // Only the gathered columns are read and computed.
+        o = plan.num_ids;
+        b_elems = static_cast<double>(a[2] * o);
+      }
+      double c_elems = plan.top_k > 0 ? static_cast<double>(a[0] * a[1] * plan.top_k)
+                                      : static_cast<double>(a[0] * a[1] * o);
+      plan.flops = 2.0 * a[0] * a[1] * a[2] * o;
+      plan.bytes = sizeof(float) * (NumElements(a) + b_elems + c_elems);
+      std::string variant = plan.num_ids > 0 ? " ids=" + std::to_string(plan.num_ids)
+                            : plan.sparse      ? " bsr"
+                            : plan.layout      ? " blocked"
+                            : HasViews(plan)   ? " strided"
+                            : plan.packed_b    ? " prepacked"
+                                               : "";
+      plan.perf_signature = plan.op_name + " " + dims(a) + "x" + dims(plan.B_shape) + variant;
+    }
+  }
+
+  // ---------------- 預先 pack 權重 (optional, 可 mmap 共用) ----------------
+  /*! \brief Header of a packed-weight sidecar file, followed by one PackedEntry per weight. */
+  struct PackedHeader {
+    char magic[8];
+    int32_t mc, kc, nc;
+    uint32_t num_entries;
+    uint64_t fingerprint;
+  };
+
+  /*! \brief Location of one packed weight inside a sidecar file. */
+  struct PackedEntry {
+    uint32_t nid;
+    int32_t batch, m, o;
+    uint64_t offset;
+  };
+
+  static constexpr const char* kPackedMagic = "BNPKv01";
+
+  /*!
+   * \brief Whether the plan's B is packed densely at Init (block-sparse weights and the row
+   * layout of bananapi.matmul_gather are not).
+   */
+  static bool UsesDensePack(const KernelPlan& plan) {
+    return plan.b_is_const && !plan.sparse && plan.b_strides.empty() && plan.num_ids == 0;
+  }
+
+  static int64_t NumElements(const std::vector<int64_t>& shape) {
+    int64_t size = 1;
+    for (int64_t dim : shape) size *= dim;
+    return size;
+  }
+
+  /*!
+   * \brief Identity of the weights: shapes, tile sizes and every byte of the data, so weights
+   * retrained with the same shapes never map a stale sidecar. The data goes through four
+   * independent 64-bit lanes, which keeps hashing well below the cost of packing.
+   */
+  uint64_t WeightFingerprint(const int tile[3]) const {
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&h](const void* p, size_t len) {
+      const uint8_t* b = static_cast<const uint8_t*>(p);
+      for (size_t i = 0; i < len; ++i) h = (h ^ b[i]) * 1099511628211ULL;
+    };
+    auto mix_data = [&mix](const void* p, size_t len) {
+      const uint8_t* b = static_cast<const uint8_t*>(p);
+      uint64_t lane[4] = {0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL,
+                          0x082efa98ec4e6c89ULL};
+      size_t words = len / sizeof(uint64_t), i = 0;
+      for (; i + 4 <= words; i += 4) {
+        for (int l = 0; l < 4; ++l) {
+          uint64_t w;
+          std::memcpy(&w, b + (i + l) * sizeof(uint64_t), sizeof(w));
+          lane[l] = (lane[l] ^ w) * 0x9e3779b97f4a7c15ULL;
+          lane[l] ^= lane[l] >> 29;
+        }
+      }
+      mix(lane, sizeof(lane));
+      mix(b + i * sizeof(uint64_t), len - i * sizeof(uint64_t));
+    };
+    mix(tile, 3 * sizeof(int));
+    for (const auto& plan : plans_) {
+      if (!UsesDensePack(plan)) continue;
+      mix(plan.B_shape.data(), plan.B_shape.size() * sizeof(int64_t));
+      mix(plan.out_widths.data(), plan.out_widths.size() * sizeof(int64_t));
+      mix_data(ConstantB(plan), NumElements(plan.B_shape) * sizeof(float));
+    }
+    return h;
+  }
+
+  /*!
+   * \brief Pack every constant B once at Init.
+   *
+   * Enabled by BANANAPI_PACKED_DIR (packed weights are serialized to
+   * <dir>/<symbol>_<fingerprint>.bnpk and memory-mapped read-only, so every process
+   * loading the same model shares one physical copy through the page cache) or by
+   * BANANAPI_PREPACK=1 (packed into private memory). Libraries without the packing
+   * entry points keep packing on the fly.
+   */
+  void PrepackConstantWeights() {
+    const char* dir = std::getenv("BANANAPI_PACKED_DIR");
+    const char* prepack = std::getenv("BANANAPI_PREPACK");
+    bool use_file = dir != nullptr && *dir;
+    if (!use_file && !(prepack && std::string(prepack) == "1")) return;
+
+    bool has_const = false;
+    for (const auto& plan : plans_) has_const |= UsesDensePack(plan);
+    if (!has_const) return;
+
+    EnsureMatmulLoaded();
+    if (!pack_b_fp_ || !matmul_prepacked_fp_ || !tile_config_fp_) {
+      LOG(WARNING) << "bananapi: matmul library has no packing entry points, weights stay unpacked";
+      return;
+    }
+    int tile[3];
+    tile_config_fp_(&tile[0], &tile[1], &tile[2]);
+
+    if (use_file) {
+      uint64_t fingerprint = WeightFingerprint(tile);
+      char suffix[32];
+      snprintf(suffix, sizeof(suffix), "_%016llx.bnpk", static_cast<unsigned long long>(fingerprint));
+      std::string path = std::string(dir) + "/" + symbol_name_ + suffix;
+      if (MapPackedFile(path, tile, fingerprint)) return;
+      if (WritePackedFile(path, tile, fingerprint) && MapPackedFile(path, tile, fingerprint)) return;
+      LOG(WARNING) << "bananapi: cannot use packed weights file " << path
+                   << ", packing into private memory";
+    }
+
+    packed_storage_.clear();
+    for (auto& plan : plans_) {
+      if (!UsesDensePack(plan)) continue;
+      packed_storage_.emplace_back(NumElements(plan.B_shape) * sizeof(float));
+      PackWeight(plan, packed_storage_.back().data<float>());
+      plan.packed_b = packed_storage_.back().data<float>();
+    }
+  }
+
+  void PackWeight(const KernelPlan& plan, float* dst) {
+    const auto& b = plan.B_shape;
+    if (!plan.out_widths.empty()) {
+      ICHECK(pack_b_multi_fp_ != nullptr)
+          << plan.op_name << " needs matmul_pack_B_multi, which this matmul library does not export";
+      pack_b_multi_fp_(ConstantB(plan), static_cast<int>(b[0]), static_cast<int>(b[1]), plan.out_widths.data(),
+                       static_cast<int>(plan.out_widths.size()), dst);
+      return;
+    }
+    int batch = b.size() == 3 ? static_cast<int>(b[0]) : 1;
+    pack_b_fp_(ConstantB(plan), batch, static_cast<int>(b[b.size() - 2]),
+               static_cast<int>(b[b.size() - 1]), dst);
+  }
+
+  /*! \brief Map an existing sidecar file and point the plans at it; false if absent or stale. */
+  bool MapPackedFile(const std::string& path, const int tile[3], uint64_t fingerprint) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(PackedHeader)) {
+      base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return false;
+    size_t size = st.st_size;
+
+    const auto* header = static_cast<const PackedHeader*>(base);
+    const auto* entries = reinterpret_cast<const PackedEntry*>(header + 1);
+    bool valid = std::strncmp(header->magic, kPackedMagic, sizeof(header->magic)) == 0 &&
+                 header->mc == tile[0] && header->kc == tile[1] && header->nc == tile[2] &&
+                 header->fingerprint == fingerprint &&
+                 sizeof(PackedHeader) + header->num_entries * sizeof(PackedEntry) <= size;
+    std::vector<std::pair<KernelPlan*, const float*>> resolved;
+    for (auto& plan : plans_) {
+      if (!valid || !UsesDensePack(plan)) continue;
+      const PackedEntry* found = nullptr;
+      for (uint32_t i = 0; i < header->num_entries; ++i) {
+        if (entries[i].nid == plan.nid) found = &entries[i];
+      }
+      int64_t bytes = NumElements(plan.B_shape) * static_cast<int64_t>(sizeof(float));
+      valid = found != nullptr && found->offset + bytes <= size;
+      if (valid) {
+        resolved.emplace_back(&plan, reinterpret_cast<const float*>(
+                                         static_cast<const char*>(base) + found->offset));
+      }
+    }
+    if (!valid) {
+      munmap(base, size);
+      return false;
+    }
+    for (auto& it : resolved) it.first->packed_b = it.second;
+    packed_map_ = base;
+    packed_map_size_ = size;
+    VLOG(1) << "bananapi: mapped packed weights from " << path;
+    return true;
+  }
+
+  /*! \brief Pack the constant weights and publish them atomically as a sidecar file. */
+  bool WritePackedFile(const std::string& path, const int tile[3], uint64_t fingerprint) {
+    PackedHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, kPackedMagic, sizeof(header.magic));
+    header.mc = tile[0];
+    header.kc = tile[1];
+    header.nc = tile[2];
+    header.fingerprint = fingerprint;
+
+    std::vector<PackedEntry> entries;
+    for (const auto& plan : plans_) {
+      if (UsesDensePack(plan)) entries.push_back(PackedEntry{plan.nid, 0, 0, 0, 0});
+    }
+    header.num_entries = static_cast<uint32_t>(entries.size());
+    // Keep every packed matrix 64-byte aligned so the mapped data is vector friendly.
+    uint64_t offset = (sizeof(PackedHeader) + entries.size() * sizeof(PackedEntry) + 63) & ~63ULL;
+    size_t k = 0;
+    for (const auto& plan : plans_) {
+      if (!UsesDensePack(plan)) continue;
+      const auto& b = plan.B_shape;
+      entries[k].batch = b.size() == 3 ? static_cast<int32_t>(b[0]) : 1;
+      entries[k].m = static_cast<int32_t>(b[b.size() - 2]);
+      entries[k].o = static_cast<int32_t>(b[b.size() - 1]);
+      entries[k].offset = offset;
+      offset = (offset + NumElements(b) * sizeof(float) + 63) & ~63ULL;
+      ++k;
+    }
+
+    // Write under a private name and rename, so concurrent processes never map a partial file.
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+    std::ofstream out(tmp_path, std::ios::binary);
+    if (!out) return false;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(PackedEntry));
+    std::vector<float> packed;
+    k = 0;
+    for (const auto& plan : plans_) {
+      if (!UsesDensePack(plan)) continue;
+      packed.resize(NumElements(plan.B_shape));
+      PackWeight(plan, packed.data());
+      out.seekp(entries[k++].offset);
+      out.write(reinterpret_cast<const char*>(packed.data()), packed.size() * sizeof(float));
+    }
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    LOG(INFO) << "bananapi: wrote packed weights to " << path;
+    return true;
   }
 
- private:
- 
   using MatmulFn =
       void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&, std::vector<int64_t>&);
+  using MatmulPrepackedFn = void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                                     std::vector<int64_t>&, const float*);
+  using PackBFn = void (*)(const float*, int, int, int, float*);
+  using TileConfigFn = void (*)(int*, int*, int*);
+  using MatmulBlockedFn = void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                                   std::vector<int64_t>&, const float*, int);
+  using MatmulAsyncFn = uint64_t (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                                     std::vector<int64_t>&, const float*);
+  using MatmulTopkFn = void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                                std::vector<int64_t>&, const float*, int, float*, int64_t*);
+  using BsrCountFn = int64_t (*)(const float*, int, int, int, int);
+  using PackBBsrFn = void (*)(const float*, int, int, int, int, int32_t*, int32_t*, float*);
+  using MatmulBsrFn = void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                               std::vector<int64_t>&, int, int, const int32_t*, const int32_t*,
+                               const float*);
+  using MatmulStridedFn = MatmulPrepackedFn;
+  using PackBMultiFn = void (*)(const float*, int, int, const int64_t*, int, float*);
+  using MatmulMultiFn = void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                                 std::vector<int64_t>&, const float*, const std::vector<int64_t>&);
+  using MatmulLayernormFn = void (*)(std::vector<const DLTensor*>&, std::vector<int64_t>&,
+                                     std::vector<int64_t>&, const float*, float);
+  using PackBStridedFn = void (*)(const DLTensor*, float*);
+  using PackBRowsFn = void (*)(const float*, int, int, float*);
+  using MatmulGatherFn = MatmulPrepackedFn;
+  using WorkerTidsFn = int (*)(int64_t*, int);
   // 一定要宣告成 class 成員
   void* so_handle_{nullptr};
   MatmulFn matmul_fp_{nullptr};
+  // Optional entry points, absent from libmatmul_classic.cpp
+  MatmulPrepackedFn matmul_prepacked_fp_{nullptr};
+  PackBFn pack_b_fp_{nullptr};
+  TileConfigFn tile_config_fp_{nullptr};
+  MatmulBlockedFn matmul_blocked_fp_{nullptr};
+  MatmulAsyncFn matmul_async_fp_{nullptr};
+  PendingKernels::WaitFn matmul_wait_fp_{nullptr};
+  MatmulTopkFn matmul_topk_fp_{nullptr};
+  BsrCountFn bsr_count_fp_{nullptr};
+  PackBBsrFn pack_b_bsr_fp_{nullptr};
+  MatmulBsrFn matmul_bsr_fp_{nullptr};
+  PackBMultiFn pack_b_multi_fp_{nullptr};
+  MatmulMultiFn matmul_multi_fp_{nullptr};
+  MatmulStridedFn matmul_strided_fp_{nullptr};
+  MatmulLayernormFn matmul_layernorm_fp_{nullptr};
+  PackBStridedFn pack_b_strided_fp_{nullptr};
+  PackBRowsFn pack_b_rows_fp_{nullptr};
+  MatmulGatherFn matmul_gather_fp_{nullptr};
   
   void EnsureMatmulLoaded() {
     if (matmul_fp_) return;
@@ -218,15 +1001,453 @@ class bananapi_Runtime : public JSONRuntimeBase {
         << "Failed to load symbol 'matmul' from shared library. "
         << "Set BANANAPI_MATMUL_SO to the absolute path of your RVV matmul .so. "
         << "dlerror: " << dlerror();
+
+    matmul_prepacked_fp_ = reinterpret_cast<MatmulPrepackedFn>(dlsym(so_handle_, "matmul_prepacked"));
+    pack_b_fp_ = reinterpret_cast<PackBFn>(dlsym(so_handle_, "matmul_pack_B"));
+    tile_config_fp_ = reinterpret_cast<TileConfigFn>(dlsym(so_handle_, "matmul_tile_config"));
+    matmul_blocked_fp_ = reinterpret_cast<MatmulBlockedFn>(dlsym(so_handle_, "matmul_blocked"));
+    matmul_async_fp_ = reinterpret_cast<MatmulAsyncFn>(dlsym(so_handle_, "matmul_async"));
+    matmul_wait_fp_ = reinterpret_cast<PendingKernels::WaitFn>(dlsym(so_handle_, "matmul_wait"));
+    matmul_topk_fp_ = reinterpret_cast<MatmulTopkFn>(dlsym(so_handle_, "matmul_topk"));
+    bsr_count_fp_ = reinterpret_cast<BsrCountFn>(dlsym(so_handle_, "matmul_bsr_count"));
+    pack_b_bsr_fp_ = reinterpret_cast<PackBBsrFn>(dlsym(so_handle_, "matmul_pack_B_bsr"));
+    matmul_bsr_fp_ = reinterpret_cast<MatmulBsrFn>(dlsym(so_handle_, "matmul_bsr"));
+    pack_b_multi_fp_ = reinterpret_cast<PackBMultiFn>(dlsym(so_handle_, "matmul_pack_B_multi"));
+    matmul_multi_fp_ = reinterpret_cast<MatmulMultiFn>(dlsym(so_handle_, "matmul_multi"));
+    matmul_strided_fp_ = reinterpret_cast<MatmulStridedFn>(dlsym(so_handle_, "matmul_strided"));
+    matmul_layernorm_fp_ =
+        reinterpret_cast<MatmulLayernormFn>(dlsym(so_handle_, "matmul_layernorm"));
+    pack_b_strided_fp_ = reinterpret_cast<PackBStridedFn>(dlsym(so_handle_, "matmul_pack_B_strided"));
+    pack_b_rows_fp_ = reinterpret_cast<PackBRowsFn>(dlsym(so_handle_, "matmul_pack_B_rows"));
+    matmul_gather_fp_ = reinterpret_cast<MatmulGatherFn>(dlsym(so_handle_, "matmul_gather"));
+    if (PerfCollector* perf = PerfCollector::Global()) {
+      // Most of a parallel kernel runs on the library's workers; count them too.
+      perf->AttachWorkers(
+          reinterpret_cast<WorkerTidsFn>(dlsym(so_handle_, "matmul_worker_tids")));
+    }
+  }
+
+  /*! \brief A normalized [batch, rows, cols] / [rows, cols] view handed to matmul_strided. */
+  struct StridedOperand {
+    DLTensor tensor;
+    std::vector<int64_t> shape, strides;
+  };
+
+  /*! \brief First element of t, honouring byte_offset like tensor_data in libmatmul_rvv.cpp. */
+  template <typename T>
+  static T* TensorData(const DLTensor* t) {
+    return reinterpret_cast<T*>(static_cast<char*>(t->data) + t->byte_offset);
+  }
+
+  /*! \brief The constant B of plan as read by the Init-time packing, BSR and fingerprint code. */
+  const float* ConstantB(const KernelPlan& plan) const {
+    const DLTensor* b = data_entry_[plan.b_eid];
+    ICHECK(IsCompact(b)) << plan.op_name << ": a constant B must be compact to be packed";
+    return TensorData<const float>(b);
+  }
+
+  /*! \brief Whether t is row-major; strides of size-1 dimensions do not matter. */
+  static bool IsCompact(const DLTensor* t) {
+    if (t->strides == nullptr) return true;
+    int64_t expected = 1;
+    for (int i = t->ndim - 1; i >= 0; --i) {
+      if (t->shape[i] != 1 && t->strides[i] != expected) return false;
+      expected *= t->shape[i];
+    }
+    return true;
+  }
+
+  /*!
+   * \brief Describe t with the normalized shape: through the fused view strides if any, else
+   * through t's own strides. Returns false when t is plainly row-major (a byte_offset alone is
+   * honoured by every kernel), in which case out still holds its dense description.
+   */
+  static bool MakeStridedOperand(const DLTensor* t, const std::vector<int64_t>& shape,
+                                 const std::vector<int64_t>& view_strides, bool is_rhs,
+                                 StridedOperand* out) {
+    bool strided = true;
+    out->shape = shape;
+    if (!view_strides.empty()) {
+      ICHECK(IsCompact(t)) << "bananapi: a fused view needs a compact input tensor";
+      out->strides = view_strides;
+    } else if (!IsCompact(t)) {
+      std::vector<int64_t> t_shape(t->shape, t->shape + t->ndim);
+      std::vector<int64_t> t_strides(t->strides, t->strides + t->ndim);
+      out->strides = CollapseStrides(t_shape, t_strides, is_rhs);
+    } else {
+      strided = false;
+      out->strides.assign(shape.size(), 1);
+      for (size_t i = shape.size() - 1; i > 0; --i) out->strides[i - 1] = out->strides[i] * shape[i];
+    }
+    out->tensor = *t;
+    out->tensor.ndim = static_cast<int32_t>(out->shape.size());
+    out->tensor.shape = out->shape.data();
+    out->tensor.strides = out->strides.data();
+    return strided;
   }
 
   // ---------------- 改寫這個：用 dlsym 叫進來 ----------------
-  void bananapi_matmul(size_t idx) {
-    (void)idx;  // 目前用不到，但保留介面
+  /*!
+   * \brief The rows of A, the K and the columns of B a kernel computes. Under an active valid
+   * length, every one of them equal to the full length shrinks to the valid length, except that
+   * the K and columns of a constant B are weights, never sequence positions. Blocked plans and
+   * plans reading a blocked B compute everything, as their producers did.
+   */
+  struct Extents {
+    int64_t n, m, o;
+  };
+
+  static Extents FullExtents(const KernelPlan& plan) {
+    return Extents{plan.A_shape[1], plan.A_shape[2], plan.B_shape.back()};
+  }
+
+  static Extents WindowExtents(const KernelPlan& plan, const SequenceWindow::Length& window) {
+    Extents e = FullExtents(plan);
+    if (!window.active() || plan.layout != 0 || plan.b_blocked || plan.sparse) return e;
+    if (e.n == window.full) e.n = window.valid;
+    if (!plan.b_is_const && e.m == window.full) e.m = window.valid;
+    if (!plan.b_is_const && e.o == window.full) e.o = window.valid;
+    return e;
+  }
+
+  /*!
+   * \brief Fill the part of the [batch, n, o] output c that a windowed kernel left out: rows from
+   * rows on are 0, the columns from cols on of the other rows are -inf. The masked columns are
+   * attention scores against padded keys, so the softmax gives them no weight and the next
+   * matmul may skip that K range; the zero rows are queries on padded frames.
+   */
+  static void FillOutsideWindow(const StridedOperand& c, int64_t rows, int64_t cols) {
+    const float mask = -std::numeric_limits<float>::infinity();
+    float* base = TensorData<float>(&c.tensor);
+    for (int64_t b = 0; b < c.shape[0]; ++b) {
+      for (int64_t i = 0; i < c.shape[1]; ++i) {
+        float* row = base + b * c.strides[0] + i * c.strides[1];
+        float value = i < rows ? mask : 0.0f;
+        for (int64_t j = i < rows ? cols : 0; j < c.shape[2]; ++j) row[j * c.strides[2]] = value;
+      }
+    }
+  }
+
+  /*!
+   * \brief Start tracing the library call about to be made when BANANAPI_TRACE is set; the call
+   * is labelled with its perf signature and the scope times it until it goes away.
+   */
+  static void Trace(TraceRecorder::Scope* scope, TraceKernel kernel, const KernelPlan& plan,
+                    const std::vector<const DLTensor*>& operands, size_t num_written,
+                    const std::vector<int64_t>& a_shape, const std::vector<int64_t>& b_shape,
+                    const float* bp, std::vector<int64_t> params = {}, double real = 0) {
+    TraceRecorder* recorder = TraceRecorder::Global();
+    if (recorder == nullptr) return;
+    TraceCall call;
+    call.kernel = kernel;
+    call.label = plan.perf_signature;
+    call.operands = operands;
+    call.num_written = num_written;
+    call.a_shape = a_shape;
+    call.b_shape = b_shape;
+    call.bp_data = bp;
+    if (bp == nullptr) {
+      call.bp = TraceBp::kNone;
+    } else if (kernel == TraceKernel::kMulti) {
+      call.bp = TraceBp::kPackedMulti;
+    } else if (kernel == TraceKernel::kGather) {
+      call.bp = TraceBp::kRows;
+    } else if (bp == operands[1]->data) {
+      call.bp = TraceBp::kOperand;
+    } else {
+      call.bp = plan.b_is_const ? TraceBp::kPacked : TraceBp::kPackedView;
+    }
+    call.params = std::move(params);
+    call.real = real;
+    scope->Begin(recorder, call);
+  }
+
+  /*! \brief Packed form of a B read from a pinned tensor, valid for one B view. */
+  struct PinnedPack {
+    const void* data{nullptr};
+    uint64_t byte_offset{0};
+    std::vector<int64_t> shape, strides;
+    ArenaBuffer buffer;
+  };
+
+  /*! \brief Release the packed forms of an older pin generation. */
+  void DropStalePinnedPacks() {
+    uint64_t generation = PinnedOperands::Global()->Generation();
+    if (generation == pinned_generation_) return;
+    // An asynchronous kernel of this module may still read one of them.
+    if (last_token_ != 0) matmul_wait_fp_(last_token_);
+    pinned_packs_.clear();
+    pinned_generation_ = generation;
+  }
+
+  /*!
+   * \brief B of plan in the packed tile layout when it is an activation read from a pinned tensor:
+   * packed by the first call of the pin generation and reused while the same view (data, offset,
+   * shape and strides, so also the valid length) comes back; nullptr if B is not pinned.
+   */
+  const float* PinnedPackedB(const KernelPlan& plan, const StridedOperand& b,
+                             const std::vector<int64_t>& b_shape) {
+    if (plan.b_is_const || plan.sparse || plan.layout != 0 || pack_b_strided_fp_ == nullptr ||
+        matmul_strided_fp_ == nullptr || matmul_prepacked_fp_ == nullptr ||
+        !PinnedOperands::Global()->Contains(b.tensor.data)) {
+      return nullptr;
+    }
+    PinnedPack& pack = pinned_packs_[&plan];
+    if (pack.data == b.tensor.data && pack.byte_offset == b.tensor.byte_offset &&
+        pack.shape == b_shape && pack.strides == b.strides) {
+      PinnedOperands::Global()->NotePack(true);
+      return pack.buffer.data<float>();
+    }
+    PinnedOperands::Global()->NotePack(false);
+    size_t bytes = sizeof(float);
+    for (int64_t d : b_shape) bytes *= static_cast<size_t>(d);
+    if (last_token_ != 0) matmul_wait_fp_(last_token_);
+    PendingKernels::Global()->WaitFor(b.tensor.data);
+    if (pack.buffer.size() < bytes) pack.buffer = ArenaBuffer(bytes);
+    pack.data = b.tensor.data;
+    pack.byte_offset = b.tensor.byte_offset;
+    pack.shape = b_shape;
+    pack.strides = b.strides;
+    DLTensor view = b.tensor;
+    view.shape = pack.shape.data();
+    view.strides = pack.strides.data();
+    pack_b_strided_fp_(&view, pack.buffer.data<float>());
+    return pack.buffer.data<float>();
+  }
+
+  void bananapi_matmul(KernelPlan& plan, const SequenceWindow::Length& window) {
+    EnsureMatmulLoaded();
+    // 外部 .so 的 matmul 固定吃 [A, B, C] 三個 entry
+    std::vector<const DLTensor*> operands = {data_entry_[plan.a_eid], data_entry_[plan.b_eid],
+                                             data_entry_[plan.c_eid]};
+    // Fused views and non-compact inputs are read in place by matmul_strided.
+    StridedOperand views[3];
+    std::vector<int64_t> c_shape = {plan.A_shape[0], plan.A_shape[1], plan.B_shape.back()};
+    bool strided = MakeStridedOperand(operands[0], plan.A_shape, plan.a_strides, false, &views[0]);
+    strided |= MakeStridedOperand(operands[1], plan.B_shape, plan.b_strides, true, &views[1]);
+    strided |= MakeStridedOperand(operands[2], c_shape, plan.c_strides, false, &views[2]);
+
+    // Valid length: a single batch of row-major rows just has fewer rows; anything else
+    // (heads, a shorter K or fewer columns) is described to matmul_strided as sub-views.
+    Extents full = FullExtents(plan), cut = WindowExtents(plan, window);
+    bool windowed = cut.n != full.n || cut.m != full.m || cut.o != full.o;
+    bool fewer_rows = windowed && !strided && plan.A_shape[0] == 1 && cut.m == full.m &&
+                      cut.o == full.o;
+    if (windowed && !fewer_rows && matmul_strided_fp_ == nullptr) windowed = false;
+    StridedOperand c_full = views[2];
+    std::vector<int64_t> a_shape = plan.A_shape, b_shape = plan.B_shape;
+    if (windowed) {
+      a_shape[1] = cut.n;
+      a_shape[2] = cut.m;
+      b_shape[b_shape.size() - 2] = cut.m;
+      b_shape.back() = cut.o;
+    }
+    // A packed_b of the plan (constant weight, blocked intermediate) holds the full K and columns.
+    ICHECK(plan.packed_b == nullptr || (cut.m == full.m && cut.o == full.o))
+        << plan.op_name << ": windowed K or columns with a B packed for the full shape";
+    const float* packed_b = plan.packed_b;
+    if (packed_b == nullptr) packed_b = PinnedPackedB(plan, views[1], b_shape);
+
+    if (strided || (windowed && !fewer_rows)) {
+      ICHECK(matmul_strided_fp_ != nullptr)
+          << plan.op_name << " has strided operands but the matmul library has no matmul_strided";
+      ICHECK(!plan.sparse && plan.layout == 0)
+          << plan.op_name << ": strided operands are not supported by the bsr / blocked kernels";
+      WaitForOperands(operands);
+      PerfCollector::Scope perf_scope(PerfCollector::Global(), plan.perf_signature, plan.flops,
+                                      plan.bytes);
+      if (windowed) {
+        views[0].shape = a_shape;
+        views[1].shape = b_shape;
+        views[2].shape = {a_shape[0], cut.n, cut.o};
+        for (auto& v : views) v.tensor.shape = v.shape.data();
+      }
+      std::vector<const DLTensor*> view_ptrs = {&views[0].tensor, &views[1].tensor, &views[2].tensor};
+      TraceRecorder::Scope trace;
+      Trace(&trace, TraceKernel::kStrided, plan, view_ptrs, 1, a_shape, b_shape, packed_b);
+      matmul_strided_fp_(view_ptrs, a_shape, b_shape, packed_b);
+      if (windowed) FillOutsideWindow(c_full, cut.n, cut.o);
+      return;
+    }
+    PerfCollector* perf = PerfCollector::Global();
+    TraceRecorder* recorder = TraceRecorder::Global();
+    TraceRecorder::Scope trace;
+    // Counters only see the calling thread, so measured kernels run synchronously; so do traced
+    // kernels whose inputs are stored, which must not be read while still being written.
+    if (plan.async && !plan.sparse && plan.layout == 0 && perf == nullptr && !windowed &&
+        (recorder == nullptr || !recorder->records_data()) && matmul_async_fp_ && matmul_wait_fp_) {
+      // Ordered after earlier async kernels by the library's FIFO; the consumers of C wait
+      // through runtime.bananapi_wait.
+      Trace(&trace, TraceKernel::kAsync, plan, operands, 1, plan.A_shape, plan.B_shape, packed_b);
+      last_token_ = matmul_async_fp_(operands, plan.A_shape, plan.B_shape, packed_b);
+      PendingKernels::Global()->Add({operands[0]->data, operands[1]->data, operands[2]->data},
+                                    last_token_, matmul_wait_fp_);
+      return;
+    }
+    WaitForOperands(operands);
+    PerfCollector::Scope perf_scope(perf, plan.perf_signature, plan.flops, plan.bytes);
+    if (plan.sparse) {
+      const SparseWeight& w = *plan.sparse;
+      Trace(&trace, TraceKernel::kBsr, plan, operands, 1, plan.A_shape, plan.B_shape, nullptr,
+            {w.block_k, w.block_n});
+      matmul_bsr_fp_(operands, plan.A_shape, plan.B_shape, w.block_k, w.block_n,
+                     w.col_ptr.data<int32_t>(), w.k_idx.data<int32_t>(), w.vals.data<float>());
+    } else if (plan.layout != 0) {
+      Trace(&trace, TraceKernel::kBlocked, plan, operands, 1, plan.A_shape, plan.B_shape,
+            plan.packed_b, {plan.layout});
+      matmul_blocked_fp_(operands, plan.A_shape, plan.B_shape, plan.packed_b, plan.layout);
+    } else if (packed_b != nullptr) {
+      Trace(&trace, TraceKernel::kPrepacked, plan, operands, 1, a_shape, b_shape, packed_b);
+      matmul_prepacked_fp_(operands, a_shape, b_shape, packed_b);
+    } else {
+      Trace(&trace, TraceKernel::kMatmul, plan, operands, 1, a_shape, b_shape, nullptr);
+      matmul_fp_(operands, a_shape, b_shape);
+    }
+    if (windowed) FillOutsideWindow(c_full, cut.n, cut.o);
+  }
+
+  /*!
+   * \brief Rows of A the single-batch kernels (matmul_multi, matmul_layernorm) compute under the
+   * valid length; their weights are constant, so only the rows can shrink.
+   */
+  static int64_t WindowRows(const KernelPlan& plan, const SequenceWindow::Length& window) {
+    return plan.A_shape[0] == 1 ? WindowExtents(plan, window).n : plan.A_shape[1];
+  }
+
+  /*! \brief Zero rows [rows, n) of the compact [1, n, cols] output t. */
+  static void ZeroRowsFrom(const DLTensor* t, int64_t rows, int64_t n, int64_t cols) {
+    StridedOperand c;
+    MakeStridedOperand(t, {1, n, cols}, {}, false, &c);
+    FillOutsideWindow(c, rows, cols);
+  }
+
+  /*! \brief A synchronous kernel must not race with in-flight kernels on the same buffers. */
+  static void WaitForOperands(const std::vector<const DLTensor*>& operands) {
+    for (const DLTensor* t : operands) PendingKernels::Global()->WaitFor(t->data);
+  }
+
+  /*!
+   * \brief Logits projection fused with argmax / top-k: the [rows, vocab] logits are never
+   * written, only the winning scores and indices of every row.
+   */
+  void bananapi_matmul_topk(KernelPlan& plan) {
+    EnsureMatmulLoaded();
+    ICHECK(matmul_topk_fp_ != nullptr)
+        << plan.op_name << " needs matmul_topk, which this matmul library does not export";
+    std::vector<const DLTensor*> operands = {data_entry_[plan.a_eid], data_entry_[plan.b_eid]};
+    for (const DLTensor* t : operands) ICHECK(IsCompact(t)) << plan.op_name << " needs compact inputs";
+    WaitForOperands(operands);
+    for (uint32_t eid : plan.out_eids) PendingKernels::Global()->WaitFor(data_entry_[eid]->data);
+    PerfCollector::Scope perf_scope(PerfCollector::Global(), plan.perf_signature, plan.flops,
+                                    plan.bytes);
+    int64_t rows = plan.A_shape[0] * plan.A_shape[1];
+    const DLTensor* idx_out = data_entry_[plan.out_eids.back()];
+    float* values = plan.out_eids.size() == 2
+                        ? TensorData<float>(data_entry_[plan.out_eids[0]])
+                        : nullptr;
+    TraceRecorder::Scope trace;
+    Trace(&trace, TraceKernel::kTopk, plan, operands, 0, plan.A_shape, plan.B_shape, plan.packed_b,
+          {plan.top_k, values != nullptr});
+    if (idx_out->dtype.bits == 64) {
+      matmul_topk_fp_(operands, plan.A_shape, plan.B_shape, plan.packed_b, plan.top_k, values,
+                      TensorData<int64_t>(idx_out));
+      return;
+    }
+    ICHECK_EQ(idx_out->dtype.bits, 32) << plan.op_name << ": unsupported index dtype";
+    ICHECK_LE(rows * plan.top_k * sizeof(int64_t), topk_indices_.size());
+    const int64_t* idx = topk_indices_.data<int64_t>();
+    matmul_topk_fp_(operands, plan.A_shape, plan.B_shape, plan.packed_b, plan.top_k, values,
+                    topk_indices_.data<int64_t>());
+    int32_t* dst = TensorData<int32_t>(idx_out);
+    for (int64_t i = 0; i < rows * plan.top_k; ++i) dst[i] = static_cast<int32_t>(idx[i]);
+  }
+
+  /*!
+   * \brief Horizontally fused matmuls sharing A (e.g. Q/K/V): one kernel reads A once and writes
+   * each column slice of the concatenated B straight into its own output.
+   */
+  void bananapi_matmul_multi(KernelPlan& plan, const SequenceWindow::Length& window) {
     EnsureMatmulLoaded();
-    // 直接用外部 .so 的 matmul 實作：就吃 data_entry_ / A_shape / B_shape
-    matmul_fp_(data_entry_, A_shape, B_shape);
+    ICHECK(matmul_multi_fp_ != nullptr)
+        << plan.op_name << " needs matmul_multi, which this matmul library does not export";
+    std::vector<const DLTensor*> operands = {data_entry_[plan.a_eid], data_entry_[plan.b_eid]};
+    for (uint32_t eid : plan.out_eids) operands.push_back(data_entry_[eid]);
+    for (const DLTensor* t : operands) ICHECK(IsCompact(t)) << plan.op_name << " needs compact tensors";
+    WaitForOperands(operands);
+    PerfCollector::Scope perf_scope(PerfCollector::Global(), plan.perf_signature, plan.flops,
+                                    plan.bytes);
+    std::vector<int64_t> a_shape = plan.A_shape;
+    a_shape[1] = WindowRows(plan, window);
+    {
+      TraceRecorder::Scope trace;
+      Trace(&trace, TraceKernel::kMulti, plan, operands, plan.out_widths.size(), a_shape,
+            plan.B_shape, plan.packed_b, plan.out_widths);
+      matmul_multi_fp_(operands, a_shape, plan.B_shape, plan.packed_b, plan.out_widths);
+    }
+    for (size_t i = 0; i < plan.out_widths.size() && a_shape[1] < plan.A_shape[1]; ++i) {
+      ZeroRowsFrom(operands[2 + i], a_shape[1], plan.A_shape[1], plan.out_widths[i]);
+    }
   }
+
+  /*!
+   * \brief Layer norm fused into the following matmul: the kernel normalizes each row tile of
+   * A into its packing buffer, so the normalized activation is never written out.
+   */
+  void bananapi_layernorm_matmul(KernelPlan& plan, const SequenceWindow::Length& window) {
+    EnsureMatmulLoaded();
+    ICHECK(matmul_layernorm_fp_ != nullptr)
+        << plan.op_name << " needs matmul_layernorm, which this matmul library does not export";
+    std::vector<const DLTensor*> operands = {data_entry_[plan.a_eid], data_entry_[plan.b_eid],
+                                             data_entry_[plan.gamma_eid], data_entry_[plan.beta_eid],
+                                             data_entry_[plan.c_eid]};
+    for (const DLTensor* t : operands) ICHECK(IsCompact(t)) << plan.op_name << " needs compact tensors";
+    WaitForOperands(operands);
+    PerfCollector::Scope perf_scope(PerfCollector::Global(), plan.perf_signature, plan.flops,
+                                    plan.bytes);
+    std::vector<int64_t> a_shape = plan.A_shape;
+    a_shape[1] = WindowRows(plan, window);
+    {
+      TraceRecorder::Scope trace;
+      Trace(&trace, TraceKernel::kLayernorm, plan, operands, 1, a_shape, plan.B_shape,
+            plan.packed_b, {}, plan.epsilon);
+      matmul_layernorm_fp_(operands, a_shape, plan.B_shape, plan.packed_b, plan.epsilon);
+    }
+    if (a_shape[1] < plan.A_shape[1]) {
+      ZeroRowsFrom(operands[4], a_shape[1], plan.A_shape[1], plan.B_shape[1]);
+    }
+  }
+
+  /*!
+   * \brief Logits of a subset of the vocabulary: only the columns of B listed in the ids input
+   * are read and computed, so constrained decoding pays for the allowed tokens only. The ids
+   * are a graph input and may change on every call.
+   */
+  void bananapi_matmul_gather(KernelPlan& plan) {
+    EnsureMatmulLoaded();
+    ICHECK(matmul_gather_fp_ != nullptr)
+        << plan.op_name << " needs matmul_gather, which this matmul library does not export";
+    std::vector<const DLTensor*> operands = {data_entry_[plan.a_eid], data_entry_[plan.b_eid],
+                                             data_entry_[plan.ids_eid], data_entry_[plan.c_eid]};
+    for (const DLTensor* t : operands) ICHECK(IsCompact(t)) << plan.op_name << " needs compact tensors";
+    const DLTensor* ids = operands[2];
+    ICHECK(ids->dtype.code == kDLInt && (ids->dtype.bits == 64 || ids->dtype.bits == 32))
+        << plan.op_name << ": ids must be int32 or int64";
+    WaitForOperands(operands);
+    const char* ids_data = TensorData<const char>(ids);
+    int64_t vocab = plan.B_shape[1];
+    for (int64_t i = 0; i < plan.num_ids; ++i) {
+      int64_t id = ids->dtype.bits == 64 ? reinterpret_cast<const int64_t*>(ids_data)[i]
+                                         : reinterpret_cast<const int32_t*>(ids_data)[i];
+      ICHECK(id >= 0 && id < vocab) << plan.op_name << ": id " << id << " is outside the vocabulary";
+    }
+    PerfCollector::Scope perf_scope(PerfCollector::Global(), plan.perf_signature, plan.flops,
+                                    plan.bytes);
+    TraceRecorder::Scope trace;
+    Trace(&trace, TraceKernel::kGather, plan, operands, 1, plan.A_shape, plan.B_shape,
+          plan.gather_rows);
+    matmul_gather_fp_(operands, plan.A_shape, plan.B_shape, plan.gather_rows);
+  }
+
   //void bananapi_matmul(size_t idx){
     // open shared library
 
@@ -293,11 +1514,24 @@ class bananapi_Runtime : public JSONRuntimeBase {
       //dlclose(handle);
     //}
 
-    std::vector<int64_t> arg_arr;
-    std::vector<std::pair<uint8_t, uint8_t>> type_arr;
-    std::vector<void*> buffer_arr;
-    std::vector<int64_t> A_shape;
-    std::vector<int64_t> B_shape;
+    /*! \brief One plan per kernel node, in graph order. */
+    std::vector<KernelPlan> plans_;
+    /*! \brief Token of the newest kernel this module enqueued, 0 if none. */
+    uint64_t last_token_{0};
+    /*! \brief Packed pinned B operands per plan, for PinnedOperands generation pinned_generation_. */
+    std::unordered_map<const KernelPlan*, PinnedPack> pinned_packs_;
+    uint64_t pinned_generation_{0};
+    /*! \brief Scratch for int32 top-k indices, sized at Init for the largest top-k node. */
+    ArenaBuffer topk_indices_;
+    /*! \brief Privately packed weights when no sidecar file is used. */
+    std::vector<ArenaBuffer> packed_storage_;
+    /*! \brief Row layouts of the constant weights of bananapi.matmul_gather. */
+    std::vector<ArenaBuffer> gather_storage_;
+    /*! \brief Buffers of the entries that never leave the partition. */
+    std::vector<std::unique_ptr<ArenaTensor>> intermediates_;
+    /*! \brief Read-only mapping of the packed weights sidecar file. */
+    void* packed_map_{nullptr};
+    size_t packed_map_size_{0};
 };
 
 runtime::Module bananapiRuntimeCreate(const String& symbol_name, const String& graph_json,
@@ -308,6 +1542,55 @@ runtime::Module bananapiRuntimeCreate(const String& symbol_name, const String& g
 
 TVM_REGISTER_GLOBAL("runtime.bananapi_runtime_create").set_body_typed(bananapiRuntimeCreate);
 
+/*!
+ * \brief runtime.bananapi_wait(out, inputs...): block until the asynchronous bananapi kernels
+ * using any of the given tensors have finished, then return out. Inserted before the first
+ * consumer of every asynchronous kernel; passing the inputs keeps them alive until then.
+ */
+TVM_REGISTER_GLOBAL("runtime.bananapi_wait").set_body([](TVMArgs args, TVMRetValue* rv) {
+  for (int i = 0; i < args.size(); ++i) {
+    DLTensor* tensor = args[i];
+    PendingKernels::Global()->WaitFor(tensor->data);
+  }
+  *rv = args[0];
+});
+
+/*!
+ * \brief runtime.bananapi_set_valid_length(valid, full): from the next Run on, compute only the
+ * first valid positions of every sequence axis of length full (e.g. the 1500 encoder frames of
+ * a clip that is mostly padding). Outputs are still full size: rows of padded positions are 0
+ * and attention scores against padded keys are -inf. valid = 0 or valid >= full computes
+ * everything again.
+ */
+TVM_REGISTER_GLOBAL("runtime.bananapi_set_valid_length").set_body_typed([](int64_t valid, int64_t full) {
+  SequenceWindow::Global()->Set(valid, full);
+});
+
+/*!
+ * \brief runtime.bananapi_pin_operands(tensors...): promise that the given tensors stay alive and
+ * unchanged until the next call, e.g. the cross-attention K/V of one utterance. Matmuls reading
+ * B from one of them pack it once and reuse the packed form; call it without arguments when the
+ * tensors are released or about to be rewritten.
+ */
+TVM_REGISTER_GLOBAL("runtime.bananapi_pin_operands").set_body([](TVMArgs args, TVMRetValue* rv) {
+  std::vector<const void*> ptrs;
+  for (int i = 0; i < args.size(); ++i) {
+    DLTensor* tensor = args[i];
+    ptrs.push_back(tensor->data);
+  }
+  PinnedOperands::Global()->Pin(ptrs);
+});
+
+/*!
+ * \brief runtime.bananapi_pinned_pack_counts() -> (packs, reuses): how often a B read from a pinned
+ * tensor was packed and how often its packed form was reused, since the process started. With the
+ * cross-attention K/V pinned, packs grow only at the first decode step of each utterance.
+ */
+TVM_REGISTER_GLOBAL("runtime.bananapi_pinned_pack_counts").set_body([](TVMArgs args, TVMRetValue* rv) {
+  std::pair<int64_t, int64_t> counts = PinnedOperands::Global()->Counts();
+  *rv = ShapeTuple({counts.first, counts.second});
+});
+
 TVM_REGISTER_GLOBAL("runtime.module.loadbinary_bananapi")
     .set_body_typed(JSONRuntimeBase::LoadFromBinary<bananapi_Runtime>);
 
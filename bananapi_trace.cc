@@ -0,0 +1,160 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*!
+ * \file src/runtime/contrib/bananapi/bananapi_trace.cc
+ * \brief Binary trace of the library calls of the bananapi runtime.
+ */
+#include "bananapi_trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace tvm {
+namespace runtime {
+namespace contrib {
+
+namespace {
+
+template <typename T>
+void Put(std::string* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void PutVec(std::string* out, const int64_t* v, size_t n) {
+  Put<uint8_t>(out, static_cast<uint8_t>(n));
+  out->append(reinterpret_cast<const char*>(v), n * sizeof(int64_t));
+}
+
+void PutVec(std::string* out, const std::vector<int64_t>& v) { PutVec(out, v.data(), v.size()); }
+
+/*! \brief Bytes from the first to one past the last element t addresses, from its byte_offset. */
+size_t SpanBytes(const DLTensor* t) {
+  int64_t last = 0, dense = 1;
+  for (int i = t->ndim - 1; i >= 0; --i) {
+    if (t->shape[i] == 0) return 0;
+    int64_t stride = t->strides ? t->strides[i] : dense;
+    last += (t->shape[i] - 1) * stride;
+    dense *= t->shape[i];
+  }
+  size_t elem = (t->dtype.bits * t->dtype.lanes + 7) / 8;
+  return static_cast<size_t>(last + 1) * elem;
+}
+
+}  // namespace
+
+TraceRecorder* TraceRecorder::Global() {
+  static TraceRecorder* inst = []() -> TraceRecorder* {
+    const char* path = std::getenv("BANANAPI_TRACE");
+    if (path == nullptr || *path == '\0') return nullptr;
+    static TraceRecorder recorder(path);
+    return recorder.file_ ? &recorder : nullptr;
+  }();
+  return inst;
+}
+
+TraceRecorder::TraceRecorder(const char* path) {
+  file_ = std::fopen(path, "wb");
+  if (file_ == nullptr) {
+    std::cerr << "bananapi: cannot open BANANAPI_TRACE=" << path << ", not tracing\n";
+    return;
+  }
+  const char* data = std::getenv("BANANAPI_TRACE_DATA");
+  with_data_ = data && std::string(data) == "1";
+  const char* threads = std::getenv("BANANAPI_NUM_THREADS");
+  std::string header(kTraceMagic, sizeof(kTraceMagic));
+  Put<uint32_t>(&header, kTraceVersion);
+  Put<uint32_t>(&header, with_data_ ? kTraceData : 0);
+  Put<int32_t>(&header, threads ? std::atoi(threads) : 0);
+  std::fwrite(header.data(), 1, header.size(), file_);
+}
+
+TraceRecorder::~TraceRecorder() {
+  if (file_) std::fclose(file_);
+}
+
+uint32_t TraceRecorder::BufferId(const void* data) {
+  auto it = buffers_.emplace(data, static_cast<uint32_t>(buffers_.size())).first;
+  return it->second;
+}
+
+void TraceRecorder::Serialize(const TraceCall& call, std::string* out, size_t* time_at) {
+  Put<uint8_t>(out, kTagCall);
+  Put<uint8_t>(out, static_cast<uint8_t>(call.kernel));
+  Put<uint16_t>(out, static_cast<uint16_t>(call.label.size()));
+  out->append(call.label);
+  Put<uint8_t>(out, static_cast<uint8_t>(call.bp));
+  Put<uint32_t>(out, call.bp_data ? BufferId(call.bp_data) : 0);
+  PutVec(out, call.a_shape);
+  PutVec(out, call.b_shape);
+  PutVec(out, call.params);
+  Put<double>(out, call.real);
+  *time_at = out->size();
+  Put<double>(out, 0.0);
+  Put<uint8_t>(out, static_cast<uint8_t>(call.operands.size()));
+  Put<uint8_t>(out, static_cast<uint8_t>(call.num_written));
+  for (size_t i = 0; i < call.operands.size(); ++i) {
+    const DLTensor* t = call.operands[i];
+    Put<uint32_t>(out, BufferId(t->data));
+    Put<uint64_t>(out, t->byte_offset);
+    Put<uint8_t>(out, t->dtype.code);
+    Put<uint8_t>(out, t->dtype.bits);
+    Put<uint16_t>(out, t->dtype.lanes);
+    PutVec(out, t->shape, t->ndim);
+    Put<uint8_t>(out, t->strides != nullptr);
+    if (t->strides) PutVec(out, t->strides, t->ndim);
+    if (with_data_ && i + call.num_written < call.operands.size()) {
+      size_t bytes = SpanBytes(t);
+      Put<uint64_t>(out, bytes);
+      out->append(static_cast<const char*>(t->data) + t->byte_offset, bytes);
+    }
+  }
+}
+
+void TraceRecorder::Scope::Begin(TraceRecorder* recorder, const TraceCall& call) {
+  recorder_ = recorder;
+  {
+    std::lock_guard<std::mutex> lock(recorder_->mu_);
+    recorder_->Serialize(call, &record_, &time_at_);
+  }
+  begin_ = std::chrono::steady_clock::now();
+}
+
+TraceRecorder::Scope::~Scope() {
+  if (!recorder_) return;
+  double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin_)
+                  .count();
+  std::memcpy(&record_[time_at_], &us, sizeof(us));
+  std::lock_guard<std::mutex> lock(recorder_->mu_);
+  std::fwrite(record_.data(), 1, record_.size(), recorder_->file_);
+}
+
+void TraceRecorder::RecordWait(const void* data) {
+  std::string record;
+  std::lock_guard<std::mutex> lock(mu_);
+  Put<uint8_t>(&record, kTagWait);
+  Put<uint32_t>(&record, BufferId(data));
+  std::fwrite(record.data(), 1, record.size(), file_);
+}
+
+}  // namespace contrib
+}  // namespace runtime
+}  // namespace tvm
@@ -0,0 +1,154 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*!
+ * \file src/runtime/contrib/bananapi/bananapi_trace.h
+ * \brief Binary trace of the library calls of the bananapi runtime, replayed by bananapi_replay.cc.
+ *
+ * File layout, native byte order; vec is a u8 count and that many i64, str a u16 length and bytes:
+ *
+ *   header  "BNPTRACE", u32 version, u32 flags (kTraceData), i32 BANANAPI_NUM_THREADS (0 = unset)
+ *   call    u8 kTagCall, u8 TraceKernel, str label, u8 TraceBp, u32 Bp buffer,
+ *           vec shapeA, vec shapeB, vec params, f64 real, f64 recorded microseconds,
+ *           u8 operands, u8 written (the last ones), then per operand:
+ *             u32 buffer, u64 byte_offset, u8 dtype code, u8 bits, u16 lanes, vec shape,
+ *             u8 has_strides, [vec strides], [u64 bytes, data: with kTraceData, unwritten only]
+ *   wait    u8 kTagWait, u32 buffer
+ *
+ * Buffers are numbered in order of first appearance of their data pointer, so the replayer can
+ * give every distinct buffer one allocation and keep the aliasing of the recorded run.
+ */
+#ifndef TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_TRACE_H_
+#define TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_TRACE_H_
+
+#include <dlpack/dlpack.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace tvm {
+namespace runtime {
+namespace contrib {
+
+constexpr char kTraceMagic[8] = {'B', 'N', 'P', 'T', 'R', 'A', 'C', 'E'};
+constexpr uint32_t kTraceVersion = 1;
+/*! \brief Header flag: every call carries the contents of the operands it reads. */
+constexpr uint32_t kTraceData = 1;
+constexpr uint8_t kTagCall = 1;
+constexpr uint8_t kTagWait = 2;
+
+/*! \brief Library entry point of a traced call. */
+enum class TraceKernel : uint8_t {
+  kMatmul = 0,     // matmul
+  kPrepacked = 1,  // matmul_prepacked
+  kStrided = 2,    // matmul_strided
+  kBlocked = 3,    // matmul_blocked, params = {layout}
+  kAsync = 4,      // matmul_async
+  kBsr = 5,        // matmul_bsr, params = {block_k, block_n}
+  kTopk = 6,       // matmul_topk, params = {top_k, writes values}
+  kMulti = 7,      // matmul_multi, params = out_widths
+  kLayernorm = 8,  // matmul_layernorm, real = epsilon
+  kGather = 9,     // matmul_gather
+};
+
+/*! \brief What the Bp of a call is; the replayer rebuilds it from the recorded B operand. */
+enum class TraceBp : uint8_t {
+  kNone = 0,
+  kPacked = 1,       // matmul_pack_B of the constant B
+  kPackedMulti = 2,  // matmul_pack_B_multi of the constant B, with params as out_widths
+  kPackedView = 3,   // matmul_pack_B_strided of the B view (a pinned operand)
+  kOperand = 4,      // the B operand itself (an intermediate in the blocked layout)
+  kRows = 5,         // matmul_pack_B_rows of the constant B
+};
+
+/*! \brief One library call, operands in the order the entry point takes them. */
+struct TraceCall {
+  TraceKernel kernel{TraceKernel::kMatmul};
+  std::string label;
+  std::vector<const DLTensor*> operands;
+  /*! \brief The last num_written operands are written by the call, the others only read. */
+  size_t num_written{1};
+  std::vector<int64_t> a_shape, b_shape;
+  TraceBp bp{TraceBp::kNone};
+  const void* bp_data{nullptr};
+  std::vector<int64_t> params;
+  double real{0};
+};
+
+/*!
+ * \brief Process-wide recorder enabled by BANANAPI_TRACE=<file>.
+ *
+ * Every library call of every bananapi module is appended to the file, in call order, with the
+ * shapes, strides, offsets and dtypes of its operands, and the waits for asynchronous kernels.
+ * With BANANAPI_TRACE_DATA=1 the bytes of every operand a call reads are stored as well, which
+ * makes the trace as large as the activations and weights it touches.
+ */
+class TraceRecorder {
+ public:
+  /*! \brief The recorder, or nullptr when BANANAPI_TRACE is not set. */
+  static TraceRecorder* Global();
+
+  /*! \brief Records one call, timed from Begin to destruction. */
+  class Scope {
+   public:
+    Scope() = default;
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+    ~Scope();
+
+    /*! \brief Serialize call now (its inputs are read before the kernel runs) and start timing. */
+    void Begin(TraceRecorder* recorder, const TraceCall& call);
+
+   private:
+    TraceRecorder* recorder_{nullptr};
+    std::string record_;
+    /*! \brief Position of the recorded microseconds in record_, filled in at destruction. */
+    size_t time_at_{0};
+    std::chrono::steady_clock::time_point begin_;
+  };
+
+  /*! \brief A wait for the asynchronous kernels using the buffer at data. */
+  void RecordWait(const void* data);
+
+  bool records_data() const { return with_data_; }
+
+  ~TraceRecorder();
+
+ private:
+  explicit TraceRecorder(const char* path);
+  /*! \brief Buffer number of data; call with mu_ held. */
+  uint32_t BufferId(const void* data);
+  void Serialize(const TraceCall& call, std::string* out, size_t* time_at);
+
+  std::mutex mu_;
+  FILE* file_{nullptr};
+  bool with_data_{false};
+  std::unordered_map<const void*, uint32_t> buffers_;
+};
+
+}  // namespace contrib
+}  // namespace runtime
+}  // namespace tvm
+
+#endif  // TVM_RUNTIME_CONTRIB_BANANAPI_BANANAPI_TRACE_H_
@@ -1,9 +1,11 @@
+import os
 import onnx
 import tvm
 from tvm import relax
 from tvm.relax.frontend.onnx import from_onnx  # Correct import path
 from tvm.relax.dpl import is_op, wildcard
 from tvm.contrib import cc
+from bananapi_relax import BananapiCostModel, bananapi_patterns, fuse_logits_reduction, insert_bananapi_waits, restrict_vocabulary
 
 def riscv_fcompile(file_name, files, options=None, **kwargs):
     if options is None:
@@ -21,7 +23,7 @@ def riscv_fcompile(file_name, files, options=None, **kwargs):
         **kwargs
     )
 
-def compile_model(onnx_path, target="llvm"):
+def compile_model(onnx_path, target="llvm", bind_weights=False, fuse_logits=None, async_offload=False, cost_model=None, merge_partitions=False, num_allowed_ids=0):
 	# 1. Load ONNX model
 	onnx_model = onnx.load(onnx_path) 
 	# 2. Convert to Relax IR (updated API)
@@ -31,11 +33,25 @@ def compile_model(onnx_path, target="llvm"):
 	#mod = from_onnx(onnx_model, {"input_ids": (1, 1), "encoder_hidden_states": (1, 1500, 384)})# give input shape of both encoder and decoder, make them static. Somer op does not support dynamic shape
 	
 	mod = from_onnx(onnx_model)
-	mod=tvm.relax.transform.BindSymbolicVars({"batch_size":1, "encoder_sequence_length_out": 1500})(mod)
+	# decoder_sequence_length: 每一步只餵 1 個 token，固定成 1 之後 projection / cross-attention / logits 的 matmul 都是靜態 shape
+	mod=tvm.relax.transform.BindSymbolicVars({"batch_size":1, "encoder_sequence_length_out": 1500, "decoder_sequence_length": 1})(mod)
 
 
 
-	#patterns = [("bananapi.matmul", is_op("relax.matmul")(wildcard(), wildcard()))]
+	# fuse_logits="argmax"/"topk": out[0] 變成 token id (或 top-k)，不再輸出完整 logits
+	if fuse_logits:
+		mod = fuse_logits_reduction(mod, fuse_logits)
+	# num_allowed_ids: 受限解碼只算 allowed_ids (main 多一個 int64 [num_allowed_ids] 輸入) 的 logits (bananapi.matmul_gather)，
+	#                  out[0] 變成 [1, 1, num_allowed_ids]，見 compile_decoder.py (不能和 fuse_logits 一起用)
+	if num_allowed_ids:
+		assert not fuse_logits, "num_allowed_ids replaces the logits reduction"
+		mod = restrict_vocabulary(mod, num_allowed_ids)
+	# cost_model: 只 offload 估計比 TVM 快的 matmul (BananapiCostModel)
+	# static_shapes: past_sequence_length 是動態的，self-attention 的 matmul 留給 TVM；
+	#                bananapi runtime 只吃靜態 shape (projection、cross-attention、logits)
+	# fuse_views: cross-attention 的 q x K^T 直接讀 pinned 的 K (不另外 materialize permute_dims)，
+	#             inference.py pin 住 cross K/V 之後只有第一步 pack，後面每一步重用
+	patterns = bananapi_patterns(fuse_logits, cost_model, fuse_views=True, fuse_gather=bool(num_allowed_ids), static_shapes=True)
 
 
 	#patterns = [("tensorrt.add", is_op("relax.add")(wildcard(), wildcard()))]
@@ -44,20 +60,32 @@ def compile_model(onnx_path, target="llvm"):
 	annotate_codegen: 不要 Merge 相鄰的 OP，一個 OP 一個 Relax function
 	bind_constants: 綁定常數，如果前面 from_onnx 的 keep_params_in_input=False(預設) 這裡要設成 bind_constants=False
 						 如果前面 from_onnx 的 keep_params_in_input=True		這裡要設成 bind_constants=True(預設)
+	bind_weights: 設成 True 時權重會變成 bananapi partition 的常數，runtime 才能在 Init 預先 pack
+	              (BANANAPI_PREPACK=1 或 BANANAPI_PACKED_DIR=<dir>，見 set_up_bananapi_rutime_and_codegen.md)
 	'''
-	#mod = relax.transform.FuseOpsByPattern(patterns, bind_constants=False, annotate_codegen=True)(mod)
+	mod = relax.transform.FuseOpsByPattern(patterns, bind_constants=bind_weights, annotate_codegen=not merge_partitions)(mod)
 	#mod = relax.transform.FuseOpsByPattern(patterns, bind_constants=False)(mod)
 	#mod = relax.transform.FuseOpsByPattern(patterns)(mod)
 	#mod.show()
 
 
 
-	#mod = relax.transform.MergeCompositeFunctions()(mod)
+	# merge_partitions: 相鄰的 bananapi OP 合成一個 partition，partition 內的中間結果保持 blocked layout，
+	#                   只有 partition 的輸出轉回 row-major
+	if merge_partitions:
+		mod = relax.transform.MergeCompositeFunctions()(mod)
+	if cost_model is not None:
+		cost_model.report(mod)
 	#mod.show()
 
 
 
-	#mod = relax.transform.RunCodegen()(mod)
+	# async_offload: bananapi kernel 丟到背景執行，runtime.bananapi_wait 放在第一個用到輸出的地方
+	if async_offload:
+		mod = relax.transform.RunCodegen({"bananapi": {"async": True}})(mod)
+		mod = insert_bananapi_waits(mod)
+	else:
+		mod = relax.transform.RunCodegen()(mod)
 	#mod.show()
 
 	# 3. Apply mandatory passes
@@ -81,4 +109,5 @@ def compile_model(onnx_path, target="llvm"):
 # Compile both encoder and decoder
 #encoder_so = compile_model("encoder_model.onnx", target="llvm")
 #decoder_so = compile_model("decoder_model.onnx", target="llvm")
-decoder_so = compile_model("decoder_with_past_model.onnx", target="llvm -mtriple=riscv64-unknown-linux-gnu -mattr=+m,+a,+f,+d,+c")
\ No newline at end of file
+# BANANAPI_NUM_ALLOWED_IDS=K: 受限解碼，decoder_model 和 decoder_with_past_model 要用同一個 K 編譯 (inference.py 也讀這個變數)
+decoder_so = compile_model("decoder_with_past_model.onnx", target="llvm -mtriple=riscv64-unknown-linux-gnu -mattr=+m,+a,+f,+d,+c", cost_model=BananapiCostModel.from_profile_data(), num_allowed_ids=int(os.environ.get("BANANAPI_NUM_ALLOWED_IDS", 0)))
\ No newline at end of file
@@ -4,6 +4,7 @@ from tvm import relax
 from tvm.relax.frontend.onnx import from_onnx  # Correct import path
 from tvm.relax.dpl import is_op, wildcard
 from tvm.contrib import cc
+from bananapi_relax import BananapiCostModel, bananapi_patterns, fuse_sibling_matmuls, insert_bananapi_waits
 
 def riscv_fcompile(file_name, files, options=None, **kwargs):
     if options is None:
@@ -20,7 +21,7 @@ def riscv_fcompile(file_name, files, options=None, **kwargs):
 
         **kwargs
     )
-def compile_model(onnx_path, target="llvm"):
+def compile_model(onnx_path, target="llvm", bind_weights=False, async_offload=False, cost_model=None, merge_partitions=False, fuse_siblings=False, fuse_views=False, fuse_layernorm=False):
 	# 1. Load ONNX model
 	onnx_model = onnx.load(onnx_path) 
 	# 2. Convert to Relax IR (updated API)
@@ -34,27 +35,45 @@ def compile_model(onnx_path, target="llvm"):
 
 
 
-	patterns = [("bananapi.matmul", is_op("relax.matmul")(wildcard(), wildcard()))]
+	# fuse_siblings: 共用同一個輸入的 matmul (Q/K/V) 合成一個 bananapi.matmul_multi，輸入只讀一次
+	if fuse_siblings:
+		mod = fuse_sibling_matmuls(mod)
+	# cost_model: 只 offload 估計比 TVM 快的 matmul (BananapiCostModel)
+	# fuse_layernorm: matmul 前面的 layer_norm 併進 bananapi.layernorm_matmul，kernel pack A 時順便 normalize，不再寫出 normalize 後的 tensor
+	# fuse_views: per-head 的 reshape / permute_dims 併進 bananapi.matmul，kernel 直接用 stride 讀寫，不再複製
+	patterns = bananapi_patterns(cost_model=cost_model, fuse_siblings=fuse_siblings, fuse_views=fuse_views, fuse_layernorm=fuse_layernorm)
 	#patterns = [("tensorrt.add", is_op("relax.add")(wildcard(), wildcard()))]
 
 	'''
 	annotate_codegen: 不要 Merge 相鄰的 OP，一個 OP 一個 Relax function
 	bind_constants: 綁定常數，如果前面 from_onnx 的 keep_params_in_input=False(預設) 這裡要設成 bind_constants=False
 						 如果前面 from_onnx 的 keep_params_in_input=True		這裡要設成 bind_constants=True(預設)
+	bind_weights: 設成 True 時權重會變成 bananapi partition 的常數，runtime 才能在 Init 預先 pack
+	              (BANANAPI_PREPACK=1 或 BANANAPI_PACKED_DIR=<dir>，見 set_up_bananapi_rutime_and_codegen.md)
 	'''
-	mod = relax.transform.FuseOpsByPattern(patterns, bind_constants=False, annotate_codegen=True)(mod)
+	mod = relax.transform.FuseOpsByPattern(patterns, bind_constants=bind_weights, annotate_codegen=not merge_partitions)(mod)
 	#mod = relax.transform.FuseOpsByPattern(patterns, bind_constants=False)(mod)
 	#mod = relax.transform.FuseOpsByPattern(patterns)(mod)
 	#mod.show()
 
 
 
-	#mod = relax.transform.MergeCompositeFunctions()(mod)
+	# merge_partitions: 相鄰的 bananapi OP 合成一個 partition，partition 內的中間結果保持 blocked layout，
+	#                   只有 partition 的輸出轉回 row-major
+	if merge_partitions:
+		mod = relax.transform.MergeCompositeFunctions()(mod)
+	if cost_model is not None:
+		cost_model.report(mod)
 	#mod.show()
 
 
 
-	mod = relax.transform.RunCodegen()(mod)
+	# async_offload: bananapi kernel 丟到背景執行，runtime.bananapi_wait 放在第一個用到輸出的地方
+	if async_offload:
+		mod = relax.transform.RunCodegen({"bananapi": {"async": True}})(mod)
+		mod = insert_bananapi_waits(mod)
+	else:
+		mod = relax.transform.RunCodegen()(mod)
 	#mod.show()
 
 	# 3. Apply mandatory passes
@@ -76,5 +95,5 @@ def compile_model(onnx_path, target="llvm"):
 	return output_path
 
 # Compile both encoder and decoder
-encoder_so = compile_model("encoder_model.onnx", target="llvm -mtriple=riscv64-unknown-linux-gnu -mattr=+m,+a,+f,+d,+c -vector-width=128")
+encoder_so = compile_model("encoder_model.onnx", target="llvm -mtriple=riscv64-unknown-linux-gnu -mattr=+m,+a,+f,+d,+c -vector-width=128", cost_model=BananapiCostModel.from_profile_data())
 #decoder_so = compile_model("decoder_model.onnx", target="llvm -mtriple=riscv64-unknown-linux-gnu -mattr=+m,+a,+f,+d,+c -vector-width=128")
\ No newline at end of file
@@ -1,8 +1,11 @@
+import os
+
 import numpy as np
 import tvm
 from tvm import relax, runtime
 from tvm.relax import VirtualMachine
 from transformers import WhisperProcessor, WhisperTokenizer
+from bananapi_relax import pad_allowed_ids
 
 from datetime import datetime
 import csv
@@ -31,6 +34,22 @@ def init_zero_past_kv(num_layers=4, num_heads=6, head_dim=64,
         ]
     return kvs
 
+def pick_next_token(out0, allowed_ids=None):
+    """Greedy token from output 0: logits, or token ids already reduced by bananapi.matmul_argmax.
+    With allowed_ids, the logits only cover those tokens (restrict_vocabulary in bananapi_relax.py)."""
+    arr = out0.numpy()
+    if arr.dtype.kind in "iu":
+        return int(arr.reshape(-1)[-1])
+    assert arr.ndim == 2 or arr.ndim == 3, "logits 維度不符"
+    if allowed_ids is not None:
+        return int(allowed_ids[np.argmax(arr[0, -1])])
+    return int(np.argmax(arr[0, -1]))
+
+def takes_allowed_ids(vm):
+    """Whether main has the allowed_ids input added by restrict_vocabulary (num_allowed_ids)."""
+    return any(vm._get_function_param_name("main", i) == "allowed_ids"
+               for i in range(vm._get_function_arity("main")))
+
 def insert_profile_report(csv_str):
     """Insert one profile report (CSV string format) into the global aggregator."""
     reader = csv.DictReader(csv_str.strip().splitlines())
@@ -70,6 +89,14 @@ mel = inputs.input_features.astype("float32")
 
 print("Mel shape:", mel.shape)
 
+# === 只算有效的 encoder frame：30 秒 padding 的部分 bananapi kernel 不計算 (BANANAPI_SKIP_PADDING=0 關掉) ===
+# 一個 encoder frame = 2 個 mel frame (hop 160) = 320 個 sample；padding 的 row 輸出 0，對 padding 的 attention score 是 -inf
+valid_frames = min(1500, -(-len(waveform) // 320))
+set_valid_length = tvm.get_global_func("runtime.bananapi_set_valid_length", allow_missing=True)
+if set_valid_length is not None and os.environ.get("BANANAPI_SKIP_PADDING", "1") != "0":
+    set_valid_length(valid_frames, 1500)
+    print("Valid encoder frames:", valid_frames)
+
 
 # === Encoder ===
 encoder_vm = VirtualMachine(runtime.load_module("./onnx/encoder_model.so"), tvm.cpu(), profile=True)
@@ -109,6 +136,16 @@ decoder_prefill_vm = VirtualMachine(
     profile=True
 )
 
+# === 受限解碼：decoder_model 和 decoder_with_past_model 都用 num_allowed_ids 編譯時 (BANANAPI_NUM_ALLOWED_IDS=K，見 compile_decoder.py)，
+#     BANANAPI_ALLOWED_IDS=<ids.npy> 給允許的 token (要包含 <eos>)，prefill 和每一步都只算這些 token 的 logits；
+#     不足 K 個的用 pad_allowed_ids 重複第一個 id 補齊，不影響 argmax ===
+allowed_ids = None
+if os.environ.get("BANANAPI_ALLOWED_IDS"):
+    ids = np.load(os.environ["BANANAPI_ALLOWED_IDS"])
+    allowed_ids = pad_allowed_ids(ids, int(os.environ.get("BANANAPI_NUM_ALLOWED_IDS", ids.size)))
+    assert takes_allowed_ids(decoder_prefill_vm), "decoder_model.so 沒有用 num_allowed_ids 編譯"
+    inputs.append(tvm.nd.array(allowed_ids))
+
 # Initialize empty KV (self + cross) for prefill decoder
 
 # === Decoder profiling ===
@@ -131,10 +168,7 @@ print("End of decoder prefill:", end_time)
 print("Decoder prefill takes: ", (end_time-start_time).total_seconds())
 
 
-logits = out[0].numpy()
-next_token = int(np.argmax(logits[0, -1]))
-
-assert logits.ndim == 2 or logits.ndim == 3, "logits 維度不符"
+next_token = pick_next_token(out[0], allowed_ids)
 
 tokens.append(next_token)
 # print(f"⬆️ Next token: {next_token} ({tokenizer.decode([next_token])})")
@@ -163,6 +197,16 @@ decoder_vm = VirtualMachine(
 max_length = 64
 all_reports = []  # Store all profiling reports
 
+if allowed_ids is not None:
+    assert takes_allowed_ids(decoder_vm), "decoder_with_past_model.so 沒有用 num_allowed_ids 編譯"
+
+# === cross-attention 的 K/V (index 2,3,6,7,10,11,14,15) 整段解碼都不變：pin 住之後 bananapi 只 pack 一次 (BANANAPI_PIN_CROSS_KV=0 關掉) ===
+pin_operands = tvm.get_global_func("runtime.bananapi_pin_operands", allow_missing=True)
+if pin_operands is not None and os.environ.get("BANANAPI_PIN_CROSS_KV", "1") != "0":
+    pin_operands(*[decoder_kvs[i] for i in [2,3,6,7,10,11,14,15]])
+else:
+    pin_operands = None
+
 start_time = datetime.now()
 print(f"Start of decoder token generation: {start_time}")
 
@@ -170,6 +214,8 @@ for step in range(1, max_length):
     # print(f"\n=== Step {step} ===")
     input_ids = np.array([[tokens[-1]]], dtype="int64")
     inputs = [tvm.nd.array(input_ids)] + decoder_kvs
+    if allowed_ids is not None:
+        inputs.append(tvm.nd.array(allowed_ids))
 
     # Profile every step (optional: skip warm-up steps)
     # === Decoder profiling ===
@@ -192,8 +238,7 @@ for step in range(1, max_length):
     end_time = datetime.now()
 
 
-    logits = out[0].numpy()
-    next_token = int(np.argmax(logits[0, -1]))
+    next_token = pick_next_token(out[0], allowed_ids)
     tokens.append(next_token)
     # print(f"⬆️ Next token: {next_token} ({tokenizer.decode([next_token])})")
 
@@ -205,6 +250,10 @@ for step in range(1, max_length):
     for i, dst_idx in enumerate([0,1,4,5,8,9,12,13]):
         decoder_kvs[dst_idx] = out[i + 1]
 
+# 解除 pin，釋放 pack 好的 K/V
+if pin_operands is not None:
+    pin_operands()
+
 print(f"End of decoder token generation: {end_time}")
 print(f"Decoder token generation takes: {(end_time-start_time).total_seconds()}")
 
@@ -31,6 +31,14 @@ def init_zero_past_kv(num_layers=4, num_heads=6, head_dim=64,
         ]
     return kvs
 
+def pick_next_token(out0):
+    """Greedy token from output 0: logits, or token ids already reduced by bananapi.matmul_argmax."""
+    arr = out0.numpy()
+    if arr.dtype.kind in "iu":
+        return int(arr.reshape(-1)[-1])
+    assert arr.ndim == 2 or arr.ndim == 3, "logits 維度不符"
+    return int(np.argmax(arr[0, -1]))
+
 def insert_profile_report(csv_str):
     """Insert one profile report (CSV string format) into the global aggregator."""
     reader = csv.DictReader(csv_str.strip().splitlines())
@@ -131,10 +139,7 @@ print("End of decoder prefill:", end_time)
 print("Decoder prefill takes: ", (end_time-start_time).total_seconds())
 
 
-logits = out[0].numpy()
-next_token = int(np.argmax(logits[0, -1]))
-
-assert logits.ndim == 2 or logits.ndim == 3, "logits 維度不符"
+next_token = pick_next_token(out[0])
 
 tokens.append(next_token)
 # print(f"⬆️ Next token: {next_token} ({tokenizer.decode([next_token])})")
@@ -192,8 +197,7 @@ for step in range(1, max_length):
     end_time = datetime.now()
 
 
-    logits = out[0].numpy()
-    next_token = int(np.argmax(logits[0, -1]))
+    next_token = pick_next_token(out[0])
     tokens.append(next_token)
     # print(f"⬆️ Next token: {next_token} ({tokenizer.decode([next_token])})")
 
@@ -2,6 +2,11 @@
 #include <cstdint>
 #include <dlpack/dlpack.h>
 #include <iostream>
+// a view's start is data + byte_offset
+static inline float* tensor_data(const DLTensor* t) {
+    return reinterpret_cast<float*>(static_cast<char*>(t->data) + t->byte_offset);
+}
+
 // -------------------- classic --------------------
 // core kernel, operates on one [n, m] x [m, o] -> [n, o]
 
@@ -25,9 +30,9 @@ void matmul_bxb(std::vector<const DLTensor*>& data_entry_,
                 int n, int m, int o, int batch) {
     //std::cout<<"batch"<<std::endl;
  
-    const float* A = static_cast<const float*>(data_entry_[0]->data);
-    const float* B = static_cast<const float*>(data_entry_[1]->data);
-    float*       C = static_cast<float*>(data_entry_[2]->data);
+    const float* A = tensor_data(data_entry_[0]);
+    const float* B = tensor_data(data_entry_[1]);
+    float*       C = tensor_data(data_entry_[2]);
     for (int bidx = 0; bidx < batch; ++bidx) {
         //std::cout<<bidx<<std::endl;
         const float* Ab = A + bidx * n * m;
@@ -40,9 +45,9 @@ void matmul_bxb(std::vector<const DLTensor*>& data_entry_,
 // -------------------- Batch x Single --------------------
 void matmul_bxs(std::vector<const DLTensor*>& data_entry_,
                 int n, int m, int o, int batch) {
-    const float* A = static_cast<const float*>(data_entry_[0]->data);
-    const float* B = static_cast<const float*>(data_entry_[1]->data);
-    float*       C = static_cast<float*>(data_entry_[2]->data);
+    const float* A = tensor_data(data_entry_[0]);
+    const float* B = tensor_data(data_entry_[1]);
+    float*       C = tensor_data(data_entry_[2]);
     //std::cout<<"single"<<std::endl;
     for (int bidx = 0; bidx < batch; ++bidx) {
         //std::cout<<bidx<<std::endl;
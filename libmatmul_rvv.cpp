@@ -3,8 +3,25 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <dlpack/dlpack.h>
 #include <riscv_vector.h>
+#include "rvv_jit.h"
 
 // === Blocking tile size ===
 #ifndef MC
@@ -17,6 +34,15 @@
 #define KC 128
 #endif
 
+/**
+ * First element of a tensor: DLPack keeps data aligned and puts a view's
+ * start in byte_offset, which every entry point below has to honour.
+ */
+template <typename T>
+static inline T* tensor_data(const DLTensor* t) {
+    return reinterpret_cast<T*>(static_cast<char*>(t->data) + t->byte_offset);
+}
+
 // ==================== 1. PACK_B (The Gap Remover) ====================
 /**
  * Pack B tile into contiguous 1D buffer: [KC][NC] layout (row-major)
@@ -113,94 +139,388 @@ static inline void microkernel_rvv_unit_stride(
     }
 }
 
+/**
+ * JIT-generated replacement for microkernel_rvv_unit_stride (see rvv_jit.h),
+ * specialized to (mc, kc, nc, lda, ldc), the VLEN of this CPU and the
+ * epilogue. nullptr unless BANANAPI_JIT=1, or if no kernel could be made.
+ */
+static bool jit_enabled() {
+    static const bool enabled = [] {
+        const char* env = std::getenv("BANANAPI_JIT");
+        return env && atoi(env) == 1;
+    }();
+    return enabled;
+}
+
+static RvvJitKernel jit_microkernel(int mc, int kc, int nc, int lda, int ldc, int epilogue) {
+    if (!jit_enabled()) return nullptr;
+    static const int vlen = (int)__riscv_vsetvlmax_e32m1() * 32;
+    RvvJitConfig cfg = {mc, kc, nc, lda, ldc, vlen, epilogue};
+
+    // Tiles repeat, so remember the last kernel of this thread
+    static thread_local RvvJitConfig last_cfg = {0, 0, 0, 0, 0, 0, -1};
+    static thread_local RvvJitKernel last_fn = nullptr;
+    if (last_fn == nullptr || cfg < last_cfg || last_cfg < cfg) {
+        last_fn = RvvJitCache::Get().Lookup(cfg);
+        last_cfg = cfg;
+    }
+    return last_fn;
+}
+
 // ==================== 3. BLOCKED MATMUL (3-Loop Tiling) ====================
 /**
- * Blocked matrix multiplication: C = A * B
- * A: [n][m] row-major
- * B: [m][o] row-major  
- * C: [n][o] row-major
+ * Pack the whole of B into consecutive [kc][nc] tiles, in the order the
+ * blocked driver visits them (jc outer, pc inner).
+ *
+ * Because every tile is stored with its real width nc, the tile for
+ * (jc, pc) starts at Bp + jc*m + pc*nc and the packed matrix occupies
+ * exactly m*o floats, so no padding bookkeeping is required.
+ *
+ * @param B: Source matrix [m][o] (row-major)
+ * @param ldb: Leading dimension of B (o, or more for a column slice)
+ * @param m: Number of rows in B
+ * @param o: Number of columns in B
+ * @param Bp: Destination buffer (must be at least m*o floats)
  */
-void do_block_matmul(
-    const float* A, 
-    const float* B, 
-    float* C,
-    int n, 
-    int m, 
-    int o
-) {
-    // Aligned packing buffer (static to avoid repeated allocation)
-    static float Bpack[KC * NC] __attribute__((aligned(64)));
-    
-    // Loop J: Tile columns of B (and C)
+static void pack_B_full(const float* B, int ldb, int m, int o, float* Bp) {
     for (int jc = 0; jc < o; jc += NC) {
         int nc = (jc + NC <= o) ? NC : (o - jc);
+        for (int pc = 0; pc < m; pc += KC) {
+            int kc = (pc + KC <= m) ? KC : (m - pc);
+            pack_B_tile(B, ldb, pc, kc, jc, nc,
+                        Bp + (size_t)jc * (size_t)m + (size_t)pc * (size_t)nc);
+        }
+    }
+}
+
+/**
+ * Blocked activation layout
+ *
+ * The layout pack_B_full produces, used for activations as well: a [rows][cols]
+ * matrix is stored as column panels of NC columns (the last one narrower),
+ * each panel row-major with its own width w:
+ *   X(r, c) = X + p*rows + r*w + (c - p),   p = c - c % NC,  w = min(NC, cols - p)
+ * It has the same size as the row-major matrix. A kernel can write its C
+ * straight into it (C_BLOCKED), and the next kernel reads it either as a
+ * pre-packed B or, one panel at a time, as A (A_BLOCKED), so an
+ * intermediate never goes through pack_B_tile or a row-major round trip.
+ */
+#define MATMUL_A_BLOCKED 1
+#define MATMUL_C_BLOCKED 2
+
+/**
+ * Rows of the K tile starting at pc: KC, clipped at the end of B and, for a
+ * blocked A, at the end of A's column panel so the A tile stays in one panel.
+ */
+static inline int k_tile(int pc, int m, int layout) {
+    int kc = (pc + KC <= m) ? KC : (m - pc);
+    if (layout & MATMUL_A_BLOCKED) {
+        int pa = pc - pc % NC;
+        int wa = (pa + NC <= m) ? NC : (m - pa);
+        if (pc + kc > pa + wa) kc = pa + wa - pc;  // do not cross the panel
+    }
+    return kc;
+}
+
+/**
+ * C_tile[mc][nc] (+)= A_tile[mc][kc] * Btile[kc][nc] with leading dimensions
+ * lda / ldc; the first K tile (first) overwrites C_tile instead.
+ */
+static inline void tile_kernel(
+    const float* A_tile, int lda, const float* Btile, float* C_tile, int ldc,
+    int mc, int kc, int nc, bool first
+) {
+    // JIT kernels store the first K-tile; otherwise zero C and accumulate
+    int epilogue = first ? RVV_JIT_STORE : RVV_JIT_ACCUMULATE;
+    if (RvvJitKernel jit = jit_microkernel(mc, kc, nc, lda, ldc, epilogue)) {
+        jit(A_tile, Btile, C_tile);
+        return;
+    }
+    if (first) {
+        for (int i = 0; i < mc; ++i) {
+            memset(C_tile + (size_t)i * (size_t)ldc, 0, (size_t)nc * sizeof(float));
+        }
+    }
+    microkernel_rvv_unit_stride(
+        A_tile, lda,    // A tile and its leading dimension
+        Btile,          // Packed B
+        C_tile, ldc,    // C tile and its leading dimension
+        mc, kc, nc      // Tile dimensions
+    );
+}
+
+/**
+ * C[ic:ic+mc][jc:jc+nc] += A[ic:ic+mc][pc:pc+kc] * Btile[kc][nc], where the
+ * first K tile (pc == 0) overwrites C instead. A and C may be in the blocked
+ * activation layout (see above) as selected by layout.
+ */
+static inline void compute_tile(
+    const float* A, const float* Btile, float* C,
+    int n, int m, int o,
+    int ic, int mc, int jc, int nc, int pc, int kc,
+    int layout
+) {
+    bool a_blocked = (layout & MATMUL_A_BLOCKED) != 0;
+    bool c_blocked = (layout & MATMUL_C_BLOCKED) != 0;
+
+    // C tile: row-major, or rows of column panel jc in the blocked layout
+    float* C_tile = c_blocked ? C + (size_t)jc * (size_t)n + (size_t)ic * (size_t)nc
+                              : C + (size_t)ic * (size_t)o + (size_t)jc;
+    int ldc = c_blocked ? nc : o;
+
+    // A tile: row-major, or inside one column panel of blocked A
+    const float* A_tile = A + (size_t)ic * (size_t)m + (size_t)pc;
+    int lda = m;
+    if (a_blocked) {
+        int pa = pc - pc % NC;
+        int wa = (pa + NC <= m) ? NC : (m - pa);
+        A_tile = A + (size_t)pa * (size_t)n + (size_t)ic * (size_t)wa + (size_t)(pc - pa);
+        lda = wa;
+    }
+
+    tile_kernel(A_tile, lda, Btile, C_tile, ldc, mc, kc, nc, pc == 0);
+}
+
+/**
+ * Pipelined B packing (BANANAPI_PACK_PIPELINE, on unless set to 0): the
+ * drivers keep two B tile buffers and pack the next tile into one while the
+ * microkernel reads the current tile from the other. The packing is cut into
+ * PACK_SLICES row slices issued between row slices of the current tile's
+ * compute, each preceded by prefetch hints for its source rows, so the B
+ * loads that miss in cache overlap the FMAs instead of stalling in a
+ * separate packing phase.
+ */
+#define PACK_SLICES 4
+
+static bool pack_pipeline_enabled() {
+    static const bool enabled = [] {
+        const char* env = std::getenv("BANANAPI_PACK_PIPELINE");
+        return !(env && *env && atoi(env) == 0);
+    }();
+    return enabled;
+}
+
+/**
+ * Rows [pc, pc+kc) x columns [jc, jc+nc) of B (leading dimension ldb) to be
+ * packed into dst; nothing to do when dst is nullptr.
+ */
+struct PackJob {
+    const float* B;
+    int ldb;
+    int pc, kc, jc, nc;
+    float* dst;
+};
+
+/** Rows [k0, k1) of job, as a job of their own. */
+static inline PackJob pack_job_rows(const PackJob& job, int k0, int k1) {
+    PackJob part = job;
+    part.pc = job.pc + k0;
+    part.kc = k1 - k0;
+    if (job.dst) part.dst = job.dst + (size_t)k0 * (size_t)job.nc;
+    return part;
+}
+
+static inline void prefetch_pack_source(const PackJob& job) {
+    for (int k = 0; k < job.kc; ++k) {
+        const char* row = reinterpret_cast<const char*>(
+            job.B + (size_t)(job.pc + k) * (size_t)job.ldb + (size_t)job.jc);
+        for (size_t b = 0; b < (size_t)job.nc * sizeof(float); b += 64) {
+            __builtin_prefetch(row + b);
+        }
+    }
+}
+
+/**
+ * compute_tile with the packing of next interleaved: the mc rows are
+ * computed in up to PACK_SLICES slices (multiples of 4 rows, for the
+ * register blocking of the JIT kernels), and after each slice the matching
+ * share of next's rows is packed. next must not write Btile.
+ */
+static void compute_tile_pipelined(
+    const float* A, const float* Btile, float* C,
+    int n, int m, int o,
+    int ic, int mc, int jc, int nc, int pc, int kc,
+    int layout, const PackJob& next
+) {
+    if (next.dst == nullptr) {
+        compute_tile(A, Btile, C, n, m, o, ic, mc, jc, nc, pc, kc, layout);
+        return;
+    }
+    int slices = mc < 4 * PACK_SLICES ? 1 : PACK_SLICES;
+    for (int s = 0; s < slices; ++s) {
+        int r0 = (mc * s / slices) & ~3;
+        int r1 = s + 1 == slices ? mc : (mc * (s + 1) / slices) & ~3;
+        PackJob part = pack_job_rows(next, next.kc * s / slices, next.kc * (s + 1) / slices);
+        prefetch_pack_source(part);
+        compute_tile(A, Btile, C, n, m, o, ic + r0, r1 - r0, jc, nc, pc, kc, layout);
+        pack_B_tile(part.B, part.ldb, part.pc, part.kc, part.jc, part.nc, part.dst);
+    }
+}
+
+/**
+ * Column range [j_begin, j_end) of do_block_matmul (j_begin a multiple of
+ * NC), walking tiles in (jc, ic, pc) order on the calling thread.
+ */
+static void block_matmul_columns(
+    const float* A, const float* B, float* C,
+    int n, int m, int o, const float* Bpre, int layout,
+    int j_begin, int j_end
+) {
+    // Aligned packing buffers (static to avoid repeated allocation). Per thread,
+    // because matmul_async runs kernels while the caller may run its own.
+    static thread_local float Bpack[2][KC * NC] __attribute__((aligned(64)));
+    bool pipelined = Bpre == nullptr && pack_pipeline_enabled();
+    int cur = 0;            // buffer holding the current tile
+    bool ready = false;     // ... already packed while computing the previous one
+
+    // Loop J: Tile columns of B (and C)
+    for (int jc = j_begin; jc < j_end; jc += NC) {
+        int nc = (jc + NC <= j_end) ? NC : (j_end - jc);
         
         // Loop I: Tile rows of A (and C)
         for (int ic = 0; ic < n; ic += MC) {
             int mc = (ic + MC <= n) ? MC : (n - ic);
             
-            // Initialize C tile to zero (for accumulation across K-tiles)
-            for (int i = 0; i < mc; ++i) {
-                float* C_row = C + (size_t)(ic + i) * (size_t)o + (size_t)jc;
-                memset(C_row, 0, (size_t)nc * sizeof(float));
-            }
-            
             // Loop P: Tile inner dimension K (and accumulate into C)
-            for (int pc = 0; pc < m; pc += KC) {
-                int kc = (pc + KC <= m) ? KC : (m - pc);
+            int kc = 0;
+            for (int pc = 0; pc < m; pc += kc) {
+                kc = k_tile(pc, m, layout);
                 
-                // Pack B tile: [kc][nc] contiguous
-                pack_B_tile(B, o, pc, kc, jc, nc, Bpack);
+                // Pack B tile: [kc][nc] contiguous (or reuse the pre-packed one)
+                const float* Btile = Bpack[cur];
+                if (Bpre) {
+                    Btile = Bpre + (size_t)jc * (size_t)m + (size_t)pc * (size_t)nc;
+                } else if (!ready) {
+                    pack_B_tile(B, o, pc, kc, jc, nc, Bpack[cur]);
+                }
                 
-                // Compute: C[ic:ic+mc][jc:jc+nc] += A[ic:ic+mc][pc:pc+kc] * Bpack[kc][nc]
-                const float* A_tile = A + (size_t)ic * (size_t)m + (size_t)pc;
-                float* C_tile = C + (size_t)ic * (size_t)o + (size_t)jc;
+                // The tile after this one; the same B tile again (K fits in
+                // one tile, next ic) is simply kept
+                PackJob next = {B, o, 0, 0, 0, 0, nullptr};
+                ready = false;
+                if (pipelined) {
+                    int npc = pc + kc, njc = jc, nnc = nc;
+                    bool more = true;
+                    if (npc >= m) {
+                        npc = 0;
+                        if (ic + MC >= n) {
+                            njc = jc + NC;
+                            nnc = (njc + NC <= j_end) ? NC : (j_end - njc);
+                            more = njc < j_end;
+                        }
+                    }
+                    if (more && (njc != jc || npc != pc)) {
+                        next = PackJob{B, o, npc, k_tile(npc, m, layout), njc, nnc, Bpack[cur ^ 1]};
+                    }
+                    ready = more;
+                }
                 
-                microkernel_rvv_unit_stride(
-                    A_tile, m,      // A tile and its leading dimension
-                    Bpack,          // Packed B
-                    C_tile, o,      // C tile and its leading dimension
-                    mc, kc, nc      // Tile dimensions
-                );
+                // Compute: C[ic:ic+mc][jc:jc+nc] += A[ic:ic+mc][pc:pc+kc] * Bpack[kc][nc]
+                compute_tile_pipelined(A, Btile, C, n, m, o, ic, mc, jc, nc, pc, kc, layout, next);
+                if (next.dst) cur ^= 1;
             }
         }
     }
 }
 
+/**
+ * Blocked matrix multiplication: C = A * B
+ * A: [n][m] row-major
+ * B: [m][o] row-major  
+ * C: [n][o] row-major
+ *
+ * If Bpre is given it must hold B already packed by pack_B_full; the
+ * driver then reads tiles from it instead of packing B itself.
+ * layout: MATMUL_A_BLOCKED / MATMUL_C_BLOCKED switch A / C to the blocked
+ * activation layout.
+ */
+void do_block_matmul(
+    const float* A, 
+    const float* B, 
+    float* C,
+    int n, 
+    int m, 
+    int o,
+    const float* Bpre = nullptr,
+    int layout = 0
+) {
+    block_matmul_columns(A, B, C, n, m, o, Bpre, layout, 0, o);
+}
+
 // ==================== 4. BATCH PROCESSING ====================
 
+// Batched small-K engine (section 12), used when K fits in one KC tile
+static bool small_k_applies(int m, int layout);
+static void small_k_matmul(
+    const float* A, const float* B, float* C,
+    int n, int m, int o, int batch, size_t b_stride,
+    const float* Bpre, int layout);
+
+// Generic path split over the CPU clusters (section 14)
+static void do_block_matmul_parallel(
+    const float* A, const float* B, float* C,
+    int n, int m, int o, const float* Bpre, int layout);
+
+// Kernels specialized for registered (K, N) shapes (section 13), nullptr if none
+typedef void (*FixedMatmulFn)(const float* A, const float* B, float* C,
+                              int n, int batch, size_t b_stride, const float* Bpre);
+static FixedMatmulFn find_fixed_kernel(int m, int o, int layout);
+
 // Batch x Batch: Each batch index has its own A, B, C
 void matmul_bxb(
     std::vector<const DLTensor*>& data_entry_,
-    int n, int m, int o, int batch
+    int n, int m, int o, int batch,
+    const float* Bpre = nullptr,
+    int layout = 0
 ) {
-    const float* A = static_cast<const float*>(data_entry_[0]->data);
-    const float* B = static_cast<const float*>(data_entry_[1]->data);
-    float* C = static_cast<float*>(data_entry_[2]->data);
+    const float* A = tensor_data<const float>(data_entry_[0]);
+    const float* B = tensor_data<const float>(data_entry_[1]);
+    float* C = tensor_data<float>(data_entry_[2]);
+
+    if (FixedMatmulFn fixed = find_fixed_kernel(m, o, layout)) {
+        fixed(A, B, C, n, batch, (size_t)m * (size_t)o, Bpre);
+        return;
+    }
+    if (small_k_applies(m, layout)) {
+        small_k_matmul(A, B, C, n, m, o, batch, (size_t)m * (size_t)o, Bpre, layout);
+        return;
+    }
 
     for (int b = 0; b < batch; ++b) {
         const float* A_batch = A + (size_t)b * (size_t)n * (size_t)m;
         const float* B_batch = B + (size_t)b * (size_t)m * (size_t)o;
+        const float* Bp_batch = Bpre ? Bpre + (size_t)b * (size_t)m * (size_t)o : nullptr;
         float* C_batch = C + (size_t)b * (size_t)n * (size_t)o;
         
-        do_block_matmul(A_batch, B_batch, C_batch, n, m, o);
+        do_block_matmul_parallel(A_batch, B_batch, C_batch, n, m, o, Bp_batch, layout);
     }
 }
 
 // Batch x Single: All batches share the same B
 void matmul_bxs(
     std::vector<const DLTensor*>& data_entry_,
-    int n, int m, int o, int batch
+    int n, int m, int o, int batch,
+    const float* Bpre = nullptr,
+    int layout = 0
 ) {
-    const float* A = static_cast<const float*>(data_entry_[0]->data);
-    const float* B = static_cast<const float*>(data_entry_[1]->data);
-    float* C = static_cast<float*>(data_entry_[2]->data);
+    const float* A = tensor_data<const float>(data_entry_[0]);
+    const float* B = tensor_data<const float>(data_entry_[1]);
+    float* C = tensor_data<float>(data_entry_[2]);
+
+    if (FixedMatmulFn fixed = find_fixed_kernel(m, o, layout)) {
+        fixed(A, B, C, n, batch, 0, Bpre);
+        return;
+    }
+    if (small_k_applies(m, layout)) {
+        small_k_matmul(A, B, C, n, m, o, batch, 0, Bpre, layout);
+        return;
+    }
 
     for (int b = 0; b < batch; ++b) {
         const float* A_batch = A + (size_t)b * (size_t)n * (size_t)m;
         float* C_batch = C + (size_t)b * (size_t)n * (size_t)o;
         
-        do_block_matmul(A_batch, B, C_batch, n, m, o);
+        do_block_matmul_parallel(A_batch, B, C_batch, n, m, o, Bpre, layout);
     }
 }
 
@@ -221,4 +541,1660 @@ void matmul(
     } else {
         matmul_bxs(data_entry_, n, m, o, batch);
     }
-}
\ No newline at end of file
+}
+
+// ==================== 6. PRE-PACKED WEIGHTS ====================
+/**
+ * Report the tile sizes this library was built with. The runtime stores
+ * them next to serialized packed weights, so a library rebuilt with other
+ * MC/KC/NC never consumes a stale packed layout.
+ */
+extern "C"
+void matmul_tile_config(int* mc, int* kc, int* nc) {
+    *mc = MC;
+    *kc = KC;
+    *nc = NC;
+}
+
+/**
+ * Pack `batch` consecutive [m][o] matrices into the layout consumed by
+ * matmul_prepacked. The packed form has the same size as the input.
+ */
+extern "C"
+void matmul_pack_B(const float* B, int batch, int m, int o, float* Bp) {
+    for (int b = 0; b < batch; ++b) {
+        size_t off = (size_t)b * (size_t)m * (size_t)o;
+        pack_B_full(B + off, o, m, o, Bp + off);
+    }
+}
+
+/**
+ * Same contract as matmul(), but B is taken from Bp (produced by
+ * matmul_pack_B) instead of data_entry_[1].
+ */
+extern "C"
+void matmul_prepacked(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp
+) {
+    int batch = (int)shapeA[0];
+    int n = (int)shapeA[1];
+    int m = (int)shapeA[2];
+    int o = (shapeB.size() == 3) ? (int)shapeB[2] : (int)shapeB[1];
+
+    if (shapeB.size() == 3) {
+        matmul_bxb(data_entry_, n, m, o, batch, Bp);
+    } else {
+        matmul_bxs(data_entry_, n, m, o, batch, Bp);
+    }
+}
+
+// ==================== 7. BLOCK-SPARSE WEIGHTS ====================
+/**
+ * Block-sparse B in a column-panel BSR format.
+ *
+ * B [m][o] is cut into [bk][bn] blocks, bn being a multiple of the vector
+ * length. For every block column jb (columns jb*bn .. jb*bn+bn-1) only the
+ * non-zero blocks are kept, in increasing k order:
+ *   col_ptr[jb] .. col_ptr[jb+1]-1 : indices of those blocks
+ *   k_idx[z]                       : block row of block z (rows k_idx[z]*bk ..)
+ *   vals + z*bk*bn                 : block z, row-major [bk][bn], zero padded
+ *                                    past the last row / column of B
+ */
+static inline bool block_is_zero(const float* B, int m, int o, int kb, int jb, int bk, int bn) {
+    int k_end = (kb + 1) * bk < m ? (kb + 1) * bk : m;
+    int j_end = (jb + 1) * bn < o ? (jb + 1) * bn : o;
+    for (int k = kb * bk; k < k_end; ++k) {
+        const float* B_row = B + (size_t)k * (size_t)o;
+        for (int j = jb * bn; j < j_end; ++j) {
+            if (B_row[j] != 0.0f) return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Number of non-zero [bk][bn] blocks of B, i.e. the length of k_idx.
+ */
+extern "C"
+int64_t matmul_bsr_count(const float* B, int m, int o, int bk, int bn) {
+    int64_t nnzb = 0;
+    for (int jb = 0; jb * bn < o; ++jb) {
+        for (int kb = 0; kb * bk < m; ++kb) {
+            if (!block_is_zero(B, m, o, kb, jb, bk, bn)) ++nnzb;
+        }
+    }
+    return nnzb;
+}
+
+/**
+ * Compress B into the BSR format above.
+ *
+ * @param col_ptr: ceil(o/bn)+1 entries
+ * @param k_idx: matmul_bsr_count() entries
+ * @param vals: matmul_bsr_count()*bk*bn floats
+ */
+extern "C"
+void matmul_pack_B_bsr(
+    const float* B, int m, int o, int bk, int bn,
+    int32_t* col_ptr, int32_t* k_idx, float* vals
+) {
+    int32_t z = 0;
+    for (int jb = 0; jb * bn < o; ++jb) {
+        col_ptr[jb] = z;
+        int j0 = jb * bn;
+        int w = (j0 + bn <= o) ? bn : (o - j0);
+        for (int kb = 0; kb * bk < m; ++kb) {
+            if (block_is_zero(B, m, o, kb, jb, bk, bn)) continue;
+            float* blk = vals + (size_t)z * (size_t)bk * (size_t)bn;
+            memset(blk, 0, (size_t)bk * (size_t)bn * sizeof(float));
+            for (int kk = 0; kk < bk && kb * bk + kk < m; ++kk) {
+                memcpy(blk + (size_t)kk * (size_t)bn,
+                       B + (size_t)(kb * bk + kk) * (size_t)o + (size_t)j0,
+                       (size_t)w * sizeof(float));
+            }
+            k_idx[z++] = kb;
+        }
+    }
+    col_ptr[(o + bn - 1) / bn] = z;
+}
+
+/**
+ * C = A * B for block-sparse B: C[n][o], A[n][m] row-major.
+ *
+ * Same jc/ic tiling as do_block_matmul, but the pc loop only visits the
+ * non-zero blocks of each block column, so pruned blocks cost neither
+ * loads nor FMAs. The accumulators start at zero and every C element is
+ * stored exactly once, which also removes the memset pass.
+ */
+void do_block_matmul_bsr(
+    const float* A, float* C,
+    int n, int m, int o, int bk, int bn,
+    const int32_t* col_ptr, const int32_t* k_idx, const float* vals
+) {
+    // Loop J: panels of NC columns, made of whole bn-wide block columns
+    int panel = (NC / bn > 0) ? (NC / bn) * bn : bn;
+    for (int jc = 0; jc < o; jc += panel) {
+        int j_end = (jc + panel <= o) ? (jc + panel) : o;
+        
+        // Loop I: Tile rows of A (and C), so the A tile stays cached across the panel
+        for (int ic = 0; ic < n; ic += MC) {
+            int mc = (ic + MC <= n) ? MC : (n - ic);
+            
+            for (int j0 = jc; j0 < j_end; j0 += bn) {
+                int jb = j0 / bn;
+                int w = (j0 + bn <= o) ? bn : (o - j0);
+                
+                for (int i = 0; i < mc; ++i) {
+                    const float* A_row = A + (size_t)(ic + i) * (size_t)m;
+                    float* C_row = C + (size_t)(ic + i) * (size_t)o;
+                    
+                    int col = 0;
+                    while (col < w) {
+                        size_t vl = __riscv_vsetvl_e32m1((size_t)(w - col));
+                        vfloat32m1_t vacc = __riscv_vfmv_v_f_f32m1(0.0f, vl);
+                        
+                        // Loop P: non-zero blocks only
+                        for (int32_t z = col_ptr[jb]; z < col_ptr[jb + 1]; ++z) {
+                            int k0 = k_idx[z] * bk;
+                            int kc = (k0 + bk <= m) ? bk : (m - k0);
+                            const float* blk = vals + (size_t)z * (size_t)bk * (size_t)bn + (size_t)col;
+                            for (int kk = 0; kk < kc; ++kk) {
+                                vfloat32m1_t bv = __riscv_vle32_v_f32m1(blk + (size_t)kk * (size_t)bn, vl);
+                                vacc = __riscv_vfmacc_vf_f32m1(vacc, A_row[k0 + kk], bv, vl);
+                            }
+                        }
+                        
+                        __riscv_vse32_v_f32m1(C_row + j0 + col, vacc, vl);
+                        col += (int)vl;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Same contract as matmul() with a shared 2D B that has been compressed by
+ * matmul_pack_B_bsr; data_entry_[1] is not read.
+ */
+extern "C"
+void matmul_bsr(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    int bk, int bn,
+    const int32_t* col_ptr, const int32_t* k_idx, const float* vals
+) {
+    int batch = (int)shapeA[0];
+    int n = (int)shapeA[1];
+    int m = (int)shapeA[2];
+    int o = (int)shapeB[shapeB.size() - 1];
+    const float* A = tensor_data<const float>(data_entry_[0]);
+    float* C = tensor_data<float>(data_entry_[2]);
+
+    for (int b = 0; b < batch; ++b) {
+        do_block_matmul_bsr(A + (size_t)b * (size_t)n * (size_t)m,
+                            C + (size_t)b * (size_t)n * (size_t)o,
+                            n, m, o, bk, bn, col_ptr, k_idx, vals);
+    }
+}
+
+// ==================== 8. WORKER POOL ====================
+/**
+ * CPUs grouped by the L2 cache they share, read from sysfs:
+ * cpuN/cache/index2/shared_cpu_list, else cpuN/topology/cluster_id, else
+ * cpuN/topology/physical_package_id. The SpacemiT K1 of the Banana Pi F3
+ * reports two clusters of four cores. Only CPUs in this process's affinity
+ * mask count; without sysfs every CPU is one cluster.
+ */
+static std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        if (part.empty() || part[0] < '0' || part[0] > '9') continue;
+        int lo = atoi(part.c_str()), hi = lo;
+        size_t dash = part.find('-');
+        if (dash != std::string::npos) hi = atoi(part.c_str() + dash + 1);
+        for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+static std::string read_sysfs(const std::string& path) {
+    std::ifstream f(path.c_str());
+    std::string line;
+    if (f) std::getline(f, line);
+    return line;
+}
+
+static std::vector<std::vector<int>> read_cpu_clusters() {
+    const std::string root = "/sys/devices/system/cpu/";
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    std::vector<int> cpus = parse_cpu_list(read_sysfs(root + "online"));
+    if (cpus.empty()) {
+        int n = (int)std::thread::hardware_concurrency();
+        for (int c = 0; c < n; ++c) cpus.push_back(c);
+    }
+
+    std::map<std::string, std::vector<int>> groups;
+    for (int c : cpus) {
+        if (have_mask && !CPU_ISSET(c, &allowed)) continue;
+        std::string cpu = root + "cpu" + std::to_string(c);
+        std::string key = read_sysfs(cpu + "/cache/index2/shared_cpu_list");
+        if (key.empty()) key = read_sysfs(cpu + "/topology/cluster_id");
+        if (key.empty()) key = read_sysfs(cpu + "/topology/physical_package_id");
+        groups[key].push_back(c);
+    }
+
+    std::vector<std::vector<int>> clusters;
+    for (auto& g : groups) clusters.push_back(g.second);
+    // Order clusters by their first CPU
+    std::sort(clusters.begin(), clusters.end());
+    return clusters;
+}
+
+/**
+ * Barrier for the threads of one cluster; they only wait for each other for
+ * the few microseconds of packing a B tile, so waiters spin (with yield).
+ */
+class SpinBarrier {
+public:
+    explicit SpinBarrier(int count) : count_(count) {}
+
+    void Wait() {
+        if (count_ <= 1) return;
+        uint32_t gen = generation_.load(std::memory_order_acquire);
+        if (waiting_.fetch_add(1, std::memory_order_acq_rel) + 1 == count_) {
+            waiting_.store(0, std::memory_order_relaxed);
+            generation_.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        while (generation_.load(std::memory_order_acquire) == gen) std::this_thread::yield();
+    }
+
+private:
+    int count_;
+    std::atomic<int> waiting_{0};
+    std::atomic<uint32_t> generation_{0};
+};
+
+/**
+ * Where one thread of a RunOnEachThread region sits: its cluster, its rank
+ * among the cluster's threads, the cluster's barrier and the two B tile
+ * buffers the cluster packs into together.
+ */
+struct TeamMember {
+    int cluster, num_clusters;
+    int rank, cluster_size;
+    SpinBarrier* barrier;
+    float* Bpack[2];
+};
+
+/**
+ * Persistent worker pool shared by the parallel kernels of this library.
+ *
+ * ParallelFor(num_tasks, fn) hands out task indices [0, num_tasks)
+ * dynamically; fn(task, thread) also receives the index of the executing
+ * thread (0 = caller) for per-thread scratch state. The calling thread
+ * works too and the call returns once every task has finished. A
+ * ParallelFor issued from inside a task runs serially on that thread.
+ *
+ * RunOnEachThread(fn) runs fn exactly once on every thread with its
+ * TeamMember, for work split by cluster (section 14); nested, it runs once
+ * as a team of one.
+ *
+ * Threads are spread round-robin over the CPU clusters and workers are
+ * pinned to one core of theirs; the caller is pinned to its cluster for
+ * the duration of each RunOnEachThread and gets its own affinity back after.
+ *   BANANAPI_NUM_THREADS: pool size, default all CPUs of the used clusters
+ *   BANANAPI_CLUSTERS:    clusters to use, e.g. "1" or "0,1" (default all),
+ *                         so two sessions can each own one cluster
+ *   BANANAPI_PIN_THREADS=0: do not pin
+ */
+class WorkerPool {
+public:
+    static WorkerPool& Get() {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    int num_threads() const { return (int)workers_.size() + 1; }
+
+    /**
+     * Kernel thread ids of the workers (not the caller), for profilers
+     * that count per thread. Waits until every worker has started.
+     */
+    int WorkerTids(int64_t* tids, int max) {
+        int n = (int)workers_.size();
+        for (int i = 0; i < n && i < max; ++i) {
+            while (tids_[i].load(std::memory_order_acquire) == 0) std::this_thread::yield();
+            tids[i] = tids_[i].load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    void ParallelFor(int num_tasks, const std::function<void(int, int)>& fn) {
+        if (num_tasks <= 0) return;
+        if (workers_.empty() || num_tasks == 1 || in_parallel_) {
+            for (int t = 0; t < num_tasks; ++t) fn(t, 0);
+            return;
+        }
+        std::lock_guard<std::mutex> region(region_mu_);
+        Launch(&fn, num_tasks, false);
+    }
+
+    void RunOnEachThread(const std::function<void(const TeamMember&)>& fn) {
+        if (workers_.empty() || in_parallel_) {
+            static thread_local float Bpack[2][KC * NC] __attribute__((aligned(64)));
+            TeamMember solo = {0, 1, 0, 1, nullptr, {Bpack[0], Bpack[1]}};
+            fn(solo);
+            return;
+        }
+        std::function<void(int, int)> job = [&](int, int thread) { fn(members_[thread]); };
+        std::lock_guard<std::mutex> region(region_mu_);
+        CallerPin pin(*this);
+        Launch(&job, num_threads(), true);
+    }
+
+private:
+    WorkerPool() {
+        std::vector<std::vector<int>> clusters = read_cpu_clusters();
+        const char* sel = std::getenv("BANANAPI_CLUSTERS");
+        if (sel && *sel && !clusters.empty()) {
+            std::vector<std::vector<int>> chosen;
+            for (int c : parse_cpu_list(sel)) {
+                if (c < (int)clusters.size()) chosen.push_back(clusters[c]);
+            }
+            if (!chosen.empty()) clusters.swap(chosen);
+        }
+        if (clusters.empty()) clusters.push_back(std::vector<int>());
+
+        int total = 0;
+        for (auto& c : clusters) total += (int)c.size();
+        int n = total > 0 ? total : (int)std::thread::hardware_concurrency();
+        const char* env = std::getenv("BANANAPI_NUM_THREADS");
+        if (env && *env) n = atoi(env);
+        if (n < 1) n = 1;
+        const char* pin = std::getenv("BANANAPI_PIN_THREADS");
+        pin_ = !(pin && *pin && atoi(pin) == 0);
+
+        // Thread i belongs to cluster i % C; a cluster gets no more threads than cores
+        int num_clusters = (int)clusters.size() < n ? (int)clusters.size() : n;
+        std::vector<int> size(num_clusters, 0);
+        for (int i = 0; i < n; ++i) {
+            int c = i % num_clusters;
+            members_.push_back(TeamMember{c, num_clusters, size[c]++, 0, nullptr, {nullptr, nullptr}});
+        }
+        for (int c = 0; c < num_clusters; ++c) {
+            barriers_.emplace_back(new SpinBarrier(size[c]));
+            buffers_.emplace_back(new float[2 * KC * NC + 16]);
+            cluster_cpus_.push_back(clusters[c]);
+        }
+        for (TeamMember& t : members_) {
+            t.cluster_size = size[t.cluster];
+            t.barrier = barriers_[t.cluster].get();
+            // 64-byte aligned start of the cluster's packing buffers
+            uintptr_t p = reinterpret_cast<uintptr_t>(buffers_[t.cluster].get());
+            t.Bpack[0] = reinterpret_cast<float*>((p + 63) & ~(uintptr_t)63);
+            t.Bpack[1] = t.Bpack[0] + KC * NC;
+        }
+
+        tids_.reset(new std::atomic<int64_t>[n]);
+        for (int i = 0; i < n; ++i) tids_[i].store(0);
+        for (int i = 1; i < n; ++i) {
+            workers_.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+            ++generation_;
+        }
+        cv_.notify_all();
+        for (auto& t : workers_) t.join();
+    }
+
+    void Launch(const std::function<void(int, int)>* fn, int num_tasks, bool each) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            job_ = fn;
+            num_tasks_ = num_tasks;
+            each_ = each;
+            next_task_.store(0);
+            pending_ = (int)workers_.size();
+            ++generation_;
+        }
+        cv_.notify_all();
+        RunTasks(0);
+        std::unique_lock<std::mutex> lk(mu_);
+        done_cv_.wait(lk, [this] { return pending_ == 0; });
+        job_ = nullptr;
+    }
+
+    void RunTasks(int thread) {
+        in_parallel_ = true;
+        if (each_) {
+            (*job_)(thread, thread);
+        } else {
+            int t;
+            while ((t = next_task_.fetch_add(1)) < num_tasks_) (*job_)(t, thread);
+        }
+        in_parallel_ = false;
+    }
+
+    void Pin(const std::vector<int>& cpus) {
+        if (!pin_ || cpus.empty()) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpus) CPU_SET(c, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // The caller may be any thread (TVM's, matmul_async's, the application's):
+    // pin it to cluster 0 for one region and restore the mask it had before
+    class CallerPin {
+    public:
+        explicit CallerPin(WorkerPool& pool) : saved_(false) {
+            if (!pool.pin_ || pool.cluster_cpus_[0].empty()) return;
+            saved_ = pthread_getaffinity_np(pthread_self(), sizeof(mask_), &mask_) == 0;
+            if (saved_) pool.Pin(pool.cluster_cpus_[0]);
+        }
+        ~CallerPin() {
+            if (saved_) pthread_setaffinity_np(pthread_self(), sizeof(mask_), &mask_);
+        }
+
+    private:
+        cpu_set_t mask_;
+        bool saved_;
+    };
+
+    void WorkerLoop(int thread) {
+        tids_[thread - 1].store((int64_t)syscall(SYS_gettid), std::memory_order_release);
+        const TeamMember& me = members_[thread];
+        const std::vector<int>& cpus = cluster_cpus_[me.cluster];
+        if (!cpus.empty()) Pin(std::vector<int>(1, cpus[me.rank % cpus.size()]));
+
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [&] { return generation_ != seen; });
+                seen = generation_;
+                if (stop_) return;
+            }
+            RunTasks(thread);
+            std::lock_guard<std::mutex> lk(mu_);
+            if (--pending_ == 0) done_cv_.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::vector<TeamMember> members_;                    // per thread
+    std::vector<std::unique_ptr<SpinBarrier>> barriers_; // per cluster
+    std::vector<std::unique_ptr<float[]>> buffers_;      // per cluster
+    std::vector<std::vector<int>> cluster_cpus_;         // per cluster
+    std::unique_ptr<std::atomic<int64_t>[]> tids_;       // per worker
+    bool pin_ = true;
+    std::mutex region_mu_;                 // one parallel region at a time
+    std::mutex mu_;
+    std::condition_variable cv_, done_cv_;
+    const std::function<void(int, int)>* job_ = nullptr;
+    int num_tasks_ = 0;
+    bool each_ = false;
+    std::atomic<int> next_task_{0};
+    int pending_ = 0;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+    static thread_local bool in_parallel_;
+};
+
+thread_local bool WorkerPool::in_parallel_ = false;
+
+/**
+ * Write the kernel thread ids of up to max pool workers to tids and return
+ * the number of workers; starts the pool if needed. The bananapi runtime
+ * opens its BANANAPI_PERF counters on these threads, which run most of
+ * every parallel kernel.
+ */
+extern "C"
+int matmul_worker_tids(int64_t* tids, int max) {
+    return WorkerPool::Get().WorkerTids(tids, max);
+}
+
+// ==================== 9. LOGITS GEMV + TOP-K ====================
+/**
+ * Insert (v, j) into a top-k list kept sorted by descending score, ties
+ * broken by the lower index (np.argmax semantics).
+ */
+static inline void topk_push(float* val, int64_t* idx, int& size, int k, float v, int64_t j) {
+    if (size == k && !(v > val[k - 1] || (v == val[k - 1] && j < idx[k - 1]))) return;
+    int pos = (size < k) ? size++ : k - 1;
+    while (pos > 0 && (val[pos - 1] < v || (val[pos - 1] == v && idx[pos - 1] > j))) {
+        val[pos] = val[pos - 1];
+        idx[pos] = idx[pos - 1];
+        --pos;
+    }
+    val[pos] = v;
+    idx[pos] = j;
+}
+
+/**
+ * out[0:w] = a[0:m] * Bpanel[0:m][0:w], where Bpanel rows are ldb apart.
+ * LMUL=4 accumulators make every k step read one long contiguous run of
+ * the panel row.
+ */
+static inline void gemv_panel(const float* a, const float* Bpanel, int ldb, int m, int w, float* out) {
+    int col = 0;
+    while (col < w) {
+        size_t vl = __riscv_vsetvl_e32m4((size_t)(w - col));
+        vfloat32m4_t vacc = __riscv_vfmv_v_f_f32m4(0.0f, vl);
+        for (int k = 0; k < m; ++k) {
+            vfloat32m4_t bv = __riscv_vle32_v_f32m4(Bpanel + (size_t)k * (size_t)ldb + (size_t)col, vl);
+            vacc = __riscv_vfmacc_vf_f32m4(vacc, a[k], bv, vl);
+        }
+        __riscv_vse32_v_f32m4(out + col, vacc, vl);
+        col += (int)vl;
+    }
+}
+
+/**
+ * Fused logits projection + top-k: for every row r of A [rows][m], keep
+ * only the k largest entries of A[r] * B (B: [m][o]) without ever
+ * materializing the [rows][o] logits.
+ *
+ * The vocabulary is streamed in NC-wide column panels distributed over the
+ * worker pool; each thread folds the panels it computes into its own
+ * running top-k, and the per-thread lists are merged at the end.
+ *
+ * @param Bp: B packed by matmul_pack_B, or nullptr to read B row-major
+ * @param values: [rows][k] scores, may be nullptr
+ * @param indices: [rows][k] column indices
+ */
+static void gemv_topk(
+    const float* A, const float* B, const float* Bp,
+    int rows, int m, int o, int k,
+    float* values, int64_t* indices
+) {
+    WorkerPool& pool = WorkerPool::Get();
+    int nthreads = pool.num_threads();
+    int npanels = (o + NC - 1) / NC;
+    std::vector<float> tval((size_t)nthreads * rows * k);
+    std::vector<int64_t> tidx((size_t)nthreads * rows * k);
+    std::vector<int> tsize((size_t)nthreads * rows, 0);
+
+    pool.ParallelFor(rows * npanels, [&](int task, int thread) {
+        int r = task / npanels;
+        int jc = (task % npanels) * NC;
+        int nc = (jc + NC <= o) ? NC : (o - jc);
+        float logits[NC] __attribute__((aligned(64)));
+        if (Bp) {
+            gemv_panel(A + (size_t)r * m, Bp + (size_t)jc * (size_t)m, nc, m, nc, logits);
+        } else {
+            gemv_panel(A + (size_t)r * m, B + jc, o, m, nc, logits);
+        }
+        size_t slot = (size_t)thread * rows + r;
+        float* val = &tval[slot * k];
+        int64_t* idx = &tidx[slot * k];
+        for (int j = 0; j < nc; ++j) topk_push(val, idx, tsize[slot], k, logits[j], jc + j);
+    });
+
+    std::vector<float> val(k);
+    std::vector<int64_t> idx(k);
+    for (int r = 0; r < rows; ++r) {
+        int size = 0;
+        for (int t = 0; t < nthreads; ++t) {
+            size_t slot = (size_t)t * rows + r;
+            for (int i = 0; i < tsize[slot]; ++i) {
+                topk_push(val.data(), idx.data(), size, k, tval[slot * k + i], tidx[slot * k + i]);
+            }
+        }
+        for (int i = 0; i < k; ++i) {
+            if (values) values[(size_t)r * k + i] = val[i];
+            indices[(size_t)r * k + i] = idx[i];
+        }
+    }
+}
+
+/**
+ * bananapi.matmul_argmax / bananapi.matmul_topk entry point.
+ *
+ * A: data_entry_[0] with shapeA [batch, n, m]; B: data_entry_[1] with
+ * shapeB [m, o] (or Bp, packed by matmul_pack_B). Writes the k best
+ * scores / column indices of every one of the batch*n rows.
+ */
+extern "C"
+void matmul_topk(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp,
+    int k,
+    float* values,
+    int64_t* indices
+) {
+    int rows = (int)(shapeA[0] * shapeA[1]);
+    int m = (int)shapeA[2];
+    int o = (int)shapeB[shapeB.size() - 1];
+    const float* A = tensor_data<const float>(data_entry_[0]);
+    const float* B = tensor_data<const float>(data_entry_[1]);
+    gemv_topk(A, B, Bp, rows, m, o, k, values, indices);
+}
+
+// ==================== 10. ASYNCHRONOUS SUBMISSION ====================
+/**
+ * FIFO of kernels executed by one dispatcher thread, so the caller (the
+ * TVM VM thread) can keep running host ops while an offloaded matmul is
+ * in flight. A job may itself use the worker pool. Tokens increase by one
+ * per submission; since jobs complete in order, token t is done once
+ * completed_ >= t.
+ */
+class AsyncQueue {
+public:
+    static AsyncQueue& Get() {
+        static AsyncQueue queue;
+        return queue;
+    }
+
+    uint64_t Submit(std::function<void()> job) {
+        std::lock_guard<std::mutex> lk(mu_);
+        jobs_.push_back(std::move(job));
+        uint64_t token = ++submitted_;
+        cv_.notify_all();
+        return token;
+    }
+
+    void Wait(uint64_t token) {
+        std::unique_lock<std::mutex> lk(mu_);
+        done_cv_.wait(lk, [&] { return completed_ >= token; });
+    }
+
+private:
+    AsyncQueue() : thread_([this] { Loop(); }) {}
+
+    ~AsyncQueue() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    void Loop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [this] { return stop_ || head_ < jobs_.size(); });
+                if (head_ == jobs_.size()) return;
+                job = std::move(jobs_[head_++]);
+                if (head_ == jobs_.size()) {
+                    jobs_.clear();
+                    head_ = 0;
+                }
+            }
+            job();
+            std::lock_guard<std::mutex> lk(mu_);
+            ++completed_;
+            done_cv_.notify_all();
+        }
+    }
+
+    std::mutex mu_;
+    std::condition_variable cv_, done_cv_;
+    std::vector<std::function<void()>> jobs_;
+    size_t head_ = 0;
+    uint64_t submitted_ = 0;
+    uint64_t completed_ = 0;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+/**
+ * Enqueue matmul() (or matmul_prepacked() when Bp is given) and return a
+ * completion token for matmul_wait(). Only the data pointers of the
+ * operands are captured: A, B, Bp and C must stay alive and untouched
+ * until the token has been waited for.
+ */
+extern "C"
+uint64_t matmul_async(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp
+) {
+    std::vector<DLTensor> tensors;
+    for (const DLTensor* t : data_entry_) tensors.push_back(*t);
+    return AsyncQueue::Get().Submit([tensors, shapeA, shapeB, Bp]() mutable {
+        std::vector<const DLTensor*> entries;
+        for (const DLTensor& t : tensors) entries.push_back(&t);
+        if (Bp) {
+            matmul_prepacked(entries, shapeA, shapeB, Bp);
+        } else {
+            matmul(entries, shapeA, shapeB);
+        }
+    });
+}
+
+/**
+ * Block until the job identified by token (and every earlier one) is done.
+ */
+extern "C"
+void matmul_wait(uint64_t token) {
+    AsyncQueue::Get().Wait(token);
+}
+// ==================== 11. BLOCKED ACTIVATIONS ====================
+/**
+ * Same contract as matmul_prepacked(), with A and/or C in the blocked
+ * activation layout (see section 3) as selected by layout. A B in that
+ * layout is passed as Bp: it is exactly what matmul_pack_B would produce.
+ * Bp may be nullptr for a row-major B.
+ */
+extern "C"
+void matmul_blocked(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp,
+    int layout
+) {
+    int batch = (int)shapeA[0];
+    int n = (int)shapeA[1];
+    int m = (int)shapeA[2];
+    int o = (shapeB.size() == 3) ? (int)shapeB[2] : (int)shapeB[1];
+
+    if (shapeB.size() == 3) {
+        matmul_bxb(data_entry_, n, m, o, batch, Bp, layout);
+    } else {
+        matmul_bxs(data_entry_, n, m, o, batch, Bp, layout);
+    }
+}
+
+// ==================== 12. BATCHED SMALL-K GEMM ====================
+/**
+ * Per-head attention scores such as [6,1500,64]x[6,64,1500] have K <= KC, so
+ * do_block_matmul would run a single pc iteration per tile: zero C, reload it
+ * into the accumulator and pack a B tile that is used once. This engine
+ * handles every K <= KC matmul instead:
+ *   - every (batch, ic, jc) tile is one task of the worker pool, so heads and
+ *     tiles are spread over the threads together;
+ *   - accumulators start at zero in registers and C is written exactly once;
+ *   - B rows are read in place (they are contiguous over the nc columns of a
+ *     tile), or from the pre-packed tile when one is given.
+ */
+#define SMALL_K_MR 4
+
+/**
+ * Compute C[mc][nc] = A[mc][kc] * B[kc][nc] (no accumulation into C).
+ * Four rows of A share every B vector load.
+ *
+ * @param Ablk: A tile (row-major, leading dimension lda)
+ * @param Bblk: B tile (row-major, leading dimension ldb)
+ * @param Cblk: C tile (row-major, leading dimension ldc)
+ */
+static inline void microkernel_rvv_store(
+    const float* Ablk,
+    int lda,
+    const float* Bblk,
+    int ldb,
+    float* Cblk,
+    int ldc,
+    int mc,
+    int kc,
+    int nc
+) {
+    int i = 0;
+    for (; i + SMALL_K_MR <= mc; i += SMALL_K_MR) {
+        const float* a0 = Ablk + (size_t)i * (size_t)lda;
+        const float* a1 = a0 + lda;
+        const float* a2 = a1 + lda;
+        const float* a3 = a2 + lda;
+        float* c0 = Cblk + (size_t)i * (size_t)ldc;
+
+        int col = 0;
+        while (col < nc) {
+            size_t vl = __riscv_vsetvl_e32m1((size_t)(nc - col));
+            vfloat32m1_t acc0 = __riscv_vfmv_v_f_f32m1(0.0f, vl);
+            vfloat32m1_t acc1 = __riscv_vfmv_v_f_f32m1(0.0f, vl);
+            vfloat32m1_t acc2 = __riscv_vfmv_v_f_f32m1(0.0f, vl);
+            vfloat32m1_t acc3 = __riscv_vfmv_v_f_f32m1(0.0f, vl);
+
+            for (int k = 0; k < kc; ++k) {
+                vfloat32m1_t bv = __riscv_vle32_v_f32m1(Bblk + (size_t)k * (size_t)ldb + col, vl);
+                acc0 = __riscv_vfmacc_vf_f32m1(acc0, a0[k], bv, vl);
+                acc1 = __riscv_vfmacc_vf_f32m1(acc1, a1[k], bv, vl);
+                acc2 = __riscv_vfmacc_vf_f32m1(acc2, a2[k], bv, vl);
+                acc3 = __riscv_vfmacc_vf_f32m1(acc3, a3[k], bv, vl);
+            }
+
+            __riscv_vse32_v_f32m1(c0 + col, acc0, vl);
+            __riscv_vse32_v_f32m1(c0 + ldc + col, acc1, vl);
+            __riscv_vse32_v_f32m1(c0 + 2 * (size_t)ldc + col, acc2, vl);
+            __riscv_vse32_v_f32m1(c0 + 3 * (size_t)ldc + col, acc3, vl);
+            col += (int)vl;
+        }
+    }
+
+    // Remaining rows one at a time
+    for (; i < mc; ++i) {
+        const float* a = Ablk + (size_t)i * (size_t)lda;
+        float* c = Cblk + (size_t)i * (size_t)ldc;
+
+        int col = 0;
+        while (col < nc) {
+            size_t vl = __riscv_vsetvl_e32m1((size_t)(nc - col));
+            vfloat32m1_t acc = __riscv_vfmv_v_f_f32m1(0.0f, vl);
+            for (int k = 0; k < kc; ++k) {
+                vfloat32m1_t bv = __riscv_vle32_v_f32m1(Bblk + (size_t)k * (size_t)ldb + col, vl);
+                acc = __riscv_vfmacc_vf_f32m1(acc, a[k], bv, vl);
+            }
+            __riscv_vse32_v_f32m1(c + col, acc, vl);
+            col += (int)vl;
+        }
+    }
+}
+
+/**
+ * K fits in one KC tile. A blocked A is only row-major-equivalent (a single
+ * panel) when K also fits in one NC panel.
+ */
+static bool small_k_applies(int m, int layout) {
+    if (m > KC) return false;
+    if ((layout & MATMUL_A_BLOCKED) && m > NC) return false;
+    return true;
+}
+
+/**
+ * C[b] = A[b] * B[b] for every batch index, B[b] = B + b*b_stride
+ * (b_stride 0 for a shared B). Bpre, if given, is B packed by matmul_pack_B
+ * with the same stride. layout as for do_block_matmul.
+ */
+static void small_k_matmul(
+    const float* A, const float* B, float* C,
+    int n, int m, int o, int batch, size_t b_stride,
+    const float* Bpre, int layout
+) {
+    bool c_blocked = (layout & MATMUL_C_BLOCKED) != 0;
+    int row_tiles = (n + MC - 1) / MC;
+    int col_tiles = (o + NC - 1) / NC;
+
+    WorkerPool::Get().ParallelFor(batch * row_tiles * col_tiles, [&](int task, int) {
+        int b = task / (row_tiles * col_tiles);
+        int ic = (task / col_tiles) % row_tiles * MC;
+        int jc = task % col_tiles * NC;
+        int mc = (ic + MC <= n) ? MC : (n - ic);
+        int nc = (jc + NC <= o) ? NC : (o - jc);
+
+        const float* A_tile = A + (size_t)b * (size_t)n * (size_t)m + (size_t)ic * (size_t)m;
+        float* C_batch = C + (size_t)b * (size_t)n * (size_t)o;
+        float* C_tile = c_blocked ? C_batch + (size_t)jc * (size_t)n + (size_t)ic * (size_t)nc
+                                  : C_batch + (size_t)ic * (size_t)o + (size_t)jc;
+        int ldc = c_blocked ? nc : o;
+
+        // With a single K tile the packed tile for column jc starts at jc*m
+        const float* B_tile;
+        int ldb;
+        if (Bpre) {
+            B_tile = Bpre + (size_t)b * b_stride + (size_t)jc * (size_t)m;
+            ldb = nc;
+        } else {
+            B_tile = B + (size_t)b * b_stride + (size_t)jc;
+            ldb = o;
+        }
+
+        microkernel_rvv_store(A_tile, m, B_tile, ldb, C_tile, ldc, mc, m, nc);
+    });
+}
+
+// ==================== 13. SHAPE-SPECIALIZED KERNELS ====================
+/**
+ * Whisper-tiny only ever multiplies by a handful of (K, N) shapes. For those
+ * the kernels below are instantiated with K, N and every leading dimension
+ * as template parameters, so tile counts, tail widths and vector lengths are
+ * compile-time constants: the K loop is fully unrolled, the column loop runs
+ * whole vectors of FIXED_VL lanes with at most one constant-width tail, and
+ * no vsetvl depends on a runtime bound. Only M stays a runtime value.
+ *
+ * To add a shape, append X(K, N) to BANANAPI_FIXED_SHAPES. Unregistered
+ * shapes, the blocked layouts, and BANANAPI_FIXED_KERNELS=0 use the generic
+ * path (small_k_matmul / do_block_matmul).
+ */
+#define BANANAPI_FIXED_SHAPES(X) \
+    X(384, 384)      /* attention q / k / v / out projections */ \
+    X(384, 1536)     /* MLP fc1 */ \
+    X(1536, 384)     /* MLP fc2 */ \
+    X(64, 1500)      /* q x k^T against 1500 encoder frames */ \
+    X(1500, 64)      /* scores x v over 1500 encoder frames */ \
+    X(384, 51865)    /* logits */
+
+// Lanes of one LMUL=4 float vector at the minimum VLEN the target guarantees
+#ifndef FIXED_VL
+#ifdef __riscv_v_min_vlen
+#define FIXED_VL (__riscv_v_min_vlen / 8)
+#else
+#define FIXED_VL 16
+#endif
+#endif
+
+/**
+ * C[rows][col:col+vl] (+)= A[rows][KT] * B[KT][col:col+vl] for one or two
+ * rows. Called with a constant vl, so after inlining every vsetvl and the
+ * unrolled K loop use immediate bounds.
+ */
+template <int KT, int LDA, int LDB, int LDC, bool ACC>
+static inline __attribute__((always_inline)) void fixed_rows(
+    const float* a0, const float* Bt, float* c0, int rows, int col, size_t vl
+) {
+    vl = __riscv_vsetvl_e32m4(vl);
+    if (rows == 2) {
+        const float* a1 = a0 + LDA;
+        float* c1 = c0 + LDC;
+        vfloat32m4_t acc0 = ACC ? __riscv_vle32_v_f32m4(c0 + col, vl) : __riscv_vfmv_v_f_f32m4(0.0f, vl);
+        vfloat32m4_t acc1 = ACC ? __riscv_vle32_v_f32m4(c1 + col, vl) : __riscv_vfmv_v_f_f32m4(0.0f, vl);
+#pragma GCC unroll 128
+        for (int k = 0; k < KT; ++k) {
+            vfloat32m4_t bv = __riscv_vle32_v_f32m4(Bt + (size_t)k * LDB + col, vl);
+            acc0 = __riscv_vfmacc_vf_f32m4(acc0, a0[k], bv, vl);
+            acc1 = __riscv_vfmacc_vf_f32m4(acc1, a1[k], bv, vl);
+        }
+        __riscv_vse32_v_f32m4(c0 + col, acc0, vl);
+        __riscv_vse32_v_f32m4(c1 + col, acc1, vl);
+    } else {
+        vfloat32m4_t acc = ACC ? __riscv_vle32_v_f32m4(c0 + col, vl) : __riscv_vfmv_v_f_f32m4(0.0f, vl);
+#pragma GCC unroll 128
+        for (int k = 0; k < KT; ++k) {
+            vfloat32m4_t bv = __riscv_vle32_v_f32m4(Bt + (size_t)k * LDB + col, vl);
+            acc = __riscv_vfmacc_vf_f32m4(acc, a0[k], bv, vl);
+        }
+        __riscv_vse32_v_f32m4(c0 + col, acc, vl);
+    }
+}
+
+/**
+ * C[mc][NT] (+)= A[mc][KT] * Bt[KT][NT] with every bound but mc known at
+ * compile time. ACC = false writes C without reading it.
+ */
+template <int KT, int NT, int LDA, int LDB, int LDC, bool ACC>
+static void microkernel_fixed(const float* Ablk, const float* Bt, float* Cblk, int mc) {
+    const int VL = FIXED_VL;
+    const int FULL = NT - NT % VL;
+    for (int i = 0; i < mc; i += 2) {
+        int rows = (i + 2 <= mc) ? 2 : 1;
+        const float* a = Ablk + (size_t)i * LDA;
+        float* c = Cblk + (size_t)i * LDC;
+        for (int col = 0; col < FULL; col += VL) {
+            fixed_rows<KT, LDA, LDB, LDC, ACC>(a, Bt, c, rows, col, VL);
+        }
+        if (NT % VL) {
+            fixed_rows<KT, LDA, LDB, LDC, ACC>(a, Bt, c, rows, FULL, NT % VL);
+        }
+    }
+}
+
+/**
+ * One [mc][NT] tile of C = A * B for a registered (M, O). B is packed per K
+ * tile (or taken from Bpre) exactly as in do_block_matmul; a single K tile
+ * reads B in place and, like every first K tile, writes C without a memset.
+ */
+template <int M, int O, int NT>
+static void fixed_tile(const float* A_tile, const float* B, const float* Bpre,
+                       float* C_tile, int jc, int mc) {
+    const int KFULL = M / KC;
+    const int KTAIL = M % KC;
+
+    if (M <= KC) {
+        if (Bpre) {
+            microkernel_fixed<M, NT, M, NT, O, false>(A_tile, Bpre + (size_t)jc * M, C_tile, mc);
+        } else {
+            microkernel_fixed<M, NT, M, O, O, false>(A_tile, B + jc, C_tile, mc);
+        }
+        return;
+    }
+
+    static thread_local float Bpack[KC * NC] __attribute__((aligned(64)));
+    for (int p = 0; p < KFULL; ++p) {
+        int pc = p * KC;
+        const float* Bt = Bpack;
+        if (Bpre) {
+            Bt = Bpre + (size_t)jc * M + (size_t)pc * NT;
+        } else {
+            pack_B_tile(B, O, pc, KC, jc, NT, Bpack);
+        }
+        if (p == 0) {
+            microkernel_fixed<KC, NT, M, NT, O, false>(A_tile + pc, Bt, C_tile, mc);
+        } else {
+            microkernel_fixed<KC, NT, M, NT, O, true>(A_tile + pc, Bt, C_tile, mc);
+        }
+    }
+    if (KTAIL) {
+        int pc = KFULL * KC;
+        const float* Bt = Bpack;
+        if (Bpre) {
+            Bt = Bpre + (size_t)jc * M + (size_t)pc * NT;
+        } else {
+            pack_B_tile(B, O, pc, KTAIL, jc, NT, Bpack);
+        }
+        microkernel_fixed<KTAIL, NT, M, NT, O, true>(A_tile + pc, Bt, C_tile, mc);
+    }
+}
+
+/**
+ * FixedMatmulFn for (M, O): every (batch, ic, jc) tile is one worker pool
+ * task, as in small_k_matmul. Full NC panels and the tail panel are separate
+ * instantiations.
+ */
+template <int M, int O>
+static void fixed_matmul(const float* A, const float* B, float* C,
+                         int n, int batch, size_t b_stride, const float* Bpre) {
+    const int NFULL = O / NC;
+    const int NTAIL = O % NC;
+    const int col_tiles = NFULL + (NTAIL ? 1 : 0);
+    int row_tiles = (n + MC - 1) / MC;
+
+    WorkerPool::Get().ParallelFor(batch * row_tiles * col_tiles, [&](int task, int) {
+        int b = task / (row_tiles * col_tiles);
+        int ic = (task / col_tiles) % row_tiles * MC;
+        int t = task % col_tiles;
+        int mc = (ic + MC <= n) ? MC : (n - ic);
+
+        const float* A_tile = A + (size_t)b * (size_t)n * M + (size_t)ic * M;
+        const float* B_batch = B ? B + (size_t)b * b_stride : nullptr;
+        const float* Bp_batch = Bpre ? Bpre + (size_t)b * b_stride : nullptr;
+        float* C_tile = C + (size_t)b * (size_t)n * O + (size_t)ic * O + (size_t)t * NC;
+
+        if (t < NFULL) {
+            fixed_tile<M, O, NC>(A_tile, B_batch, Bp_batch, C_tile, t * NC, mc);
+        } else {
+            fixed_tile<M, O, NTAIL>(A_tile, B_batch, Bp_batch, C_tile, NFULL * NC, mc);
+        }
+    });
+}
+
+struct FixedShape {
+    int m, o;
+    FixedMatmulFn fn;
+};
+
+#define BANANAPI_FIXED_ENTRY(M, O) { M, O, &fixed_matmul<M, O> },
+static const FixedShape kFixedShapes[] = { BANANAPI_FIXED_SHAPES(BANANAPI_FIXED_ENTRY) };
+#undef BANANAPI_FIXED_ENTRY
+
+static FixedMatmulFn find_fixed_kernel(int m, int o, int layout) {
+    static const bool enabled = [] {
+        const char* env = std::getenv("BANANAPI_FIXED_KERNELS");
+        return !(env && *env && atoi(env) == 0);
+    }();
+    if (!enabled || layout != 0) return nullptr;
+    for (const FixedShape& s : kFixedShapes) {
+        if (s.m == m && s.o == o) return s.fn;
+    }
+    return nullptr;
+}
+
+// ==================== 14. CLUSTER-PARTITIONED BLOCKED MATMUL ====================
+/**
+ * do_block_matmul over the worker pool, laid out for the cache topology:
+ *   - column panels (NC wide) go round-robin to the CPU clusters, so a B
+ *     panel is only ever read through one cluster's L2;
+ *   - the threads of a cluster pack each [kc][nc] B tile together into the
+ *     cluster's shared buffer (a slice of the kc rows each), meet at the
+ *     cluster barrier, and then split the ic row tiles among themselves;
+ *   - with a pre-packed B there is nothing to pack and no barrier;
+ *   - pipelined (see compute_tile_pipelined), each thread packs its slice of
+ *     the cluster's next tile into the other buffer while it computes on the
+ *     current one, so a tile costs one barrier and no packing phase.
+ * When A has at most MC rows (a decoder step) there is nothing to split
+ * along ic, so every thread takes whole panels instead.
+ */
+static void do_block_matmul_parallel(
+    const float* A, const float* B, float* C,
+    int n, int m, int o, const float* Bpre, int layout
+) {
+    WorkerPool& pool = WorkerPool::Get();
+    if (pool.num_threads() == 1) {
+        do_block_matmul(A, B, C, n, m, o, Bpre, layout);
+        return;
+    }
+
+    int npanels = (o + NC - 1) / NC;
+
+    if (n <= MC) {
+        pool.ParallelFor(npanels, [&](int p, int) {
+            int jc = p * NC;
+            int nc = (jc + NC <= o) ? NC : (o - jc);
+            block_matmul_columns(A, B, C, n, m, o, Bpre, layout, jc, jc + nc);
+        });
+        return;
+    }
+
+    int row_tiles = (n + MC - 1) / MC;
+    bool pipelined = Bpre == nullptr && pack_pipeline_enabled();
+    pool.RunOnEachThread([&](const TeamMember& me) {
+        // This thread's share of the row tiles of every panel of its cluster
+        int t0 = row_tiles * me.rank / me.cluster_size;
+        int t1 = row_tiles * (me.rank + 1) / me.cluster_size;
+        int cur = 0;  // buffer holding the current tile
+
+        for (int p = me.cluster; p < npanels; p += me.num_clusters) {
+            int jc = p * NC;
+            int nc = (jc + NC <= o) ? NC : (o - jc);
+            int kc = 0;
+            for (int pc = 0; pc < m; pc += kc) {
+                kc = k_tile(pc, m, layout);
+
+                // This thread's slice of a tile's rows
+                auto own_rows = [&](const PackJob& job) {
+                    return pack_job_rows(job, job.kc * me.rank / me.cluster_size,
+                                         job.kc * (me.rank + 1) / me.cluster_size);
+                };
+
+                const float* Btile = me.Bpack[cur];
+                if (Bpre) {
+                    Btile = Bpre + (size_t)jc * (size_t)m + (size_t)pc * (size_t)nc;
+                } else if (!pipelined || (p == me.cluster && pc == 0)) {
+                    PackJob part = own_rows(PackJob{B, o, pc, kc, jc, nc, me.Bpack[cur]});
+                    pack_B_tile(B, o, part.pc, part.kc, jc, nc, part.dst);
+                    me.barrier->Wait();  // tile complete
+                }
+
+                // Pipelined: the cluster's tile after this one, our slice of it
+                PackJob next = {B, o, 0, 0, 0, 0, nullptr};
+                if (pipelined) {
+                    int npc = pc + kc, njc = jc, nnc = nc;
+                    if (npc >= m) {
+                        npc = 0;
+                        njc = jc + NC * me.num_clusters;
+                        nnc = (njc + NC <= o) ? NC : (o - njc);
+                    }
+                    if (njc < o) {
+                        next = own_rows(PackJob{B, o, npc, k_tile(npc, m, layout), njc, nnc,
+                                                me.Bpack[cur ^ 1]});
+                    }
+                }
+
+                // Spread the packing over this thread's row tiles
+                int tiles = t1 - t0;
+                for (int t = t0; t < t1; ++t) {
+                    int ic = t * MC;
+                    int mc = (ic + MC <= n) ? MC : (n - ic);
+                    PackJob part = pack_job_rows(next, next.kc * (t - t0) / tiles,
+                                                 next.kc * (t - t0 + 1) / tiles);
+                    compute_tile_pipelined(A, Btile, C, n, m, o, ic, mc, jc, nc, pc, kc,
+                                           layout, part);
+                }
+                if (tiles == 0 && next.dst) {
+                    pack_B_tile(B, o, next.pc, next.kc, next.jc, next.nc, next.dst);
+                }
+
+                // Everyone done with this tile before it is repacked; pipelined,
+                // the next one is complete in the other buffer
+                if (!Bpre) me.barrier->Wait();
+                if (pipelined) cur ^= 1;
+            }
+        }
+    });
+}
+
+// ==================== 15. MULTI-OUTPUT MATMUL ====================
+/**
+ * Horizontally fused matmuls sharing their A, e.g. the Q, K and V
+ * projections of one attention block: B is the column concatenation
+ * [B_0 | B_1 | ...] ([m][o], o = sum of widths) and output s receives
+ * columns [off_s, off_s + widths[s]) straight into its own C_s
+ * [rows][widths[s]], so nothing is split afterwards.
+ *
+ * Every segment is packed on its own by pack_B_full, so no column panel
+ * straddles two outputs; segment s starts at Bp + off_s*m and the whole
+ * packed form is m*o floats.
+ */
+extern "C"
+void matmul_pack_B_multi(const float* B, int m, int o, const int64_t* widths, int count, float* Bp) {
+    size_t off = 0;
+    for (int s = 0; s < count; ++s) {
+        pack_B_full(B + off, o, m, (int)widths[s], Bp + off * (size_t)m);
+        off += (size_t)widths[s];
+    }
+}
+
+/**
+ * C_s = A * B_s for every segment s, with one dispatch and one parallel
+ * region. A is [batch][n][m] and B a shared [m][o], so batches are just
+ * more rows. A task takes one MC row tile of A and sweeps it across a
+ * group of panels of all segments while the tile stays in cache, which
+ * reads A from memory once instead of once per projection. Panels are
+ * split into just enough groups to give every thread a task, also when
+ * there is a single row tile (a decoder step).
+ *
+ * data_entry_ holds A, B, then the widths.size() outputs. Bp is the output
+ * of matmul_pack_B_multi, or nullptr to pack B here.
+ */
+extern "C"
+void matmul_multi(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp,
+    const std::vector<int64_t>& widths
+) {
+    int rows = (int)(shapeA[0] * shapeA[1]);
+    int m = (int)shapeA[2];
+    int o = (int)shapeB[1];
+    int count = (int)widths.size();
+    const float* A = tensor_data<const float>(data_entry_[0]);
+
+    std::vector<float> packed;
+    if (!Bp) {
+        packed.resize((size_t)m * (size_t)o);
+        matmul_pack_B_multi(tensor_data<const float>(data_entry_[1]), m, o,
+                            widths.data(), count, packed.data());
+        Bp = packed.data();
+    }
+
+    struct Panel { int seg, jc, nc; };
+    std::vector<Panel> panels;
+    std::vector<size_t> seg_off(count);
+    size_t off = 0;
+    for (int s = 0; s < count; ++s) {
+        seg_off[s] = off;
+        int w = (int)widths[s];
+        for (int jc = 0; jc < w; jc += NC) {
+            Panel p = {s, jc, (jc + NC <= w) ? NC : (w - jc)};
+            panels.push_back(p);
+        }
+        off += (size_t)w;
+    }
+    int npanels = (int)panels.size();
+
+    WorkerPool& pool = WorkerPool::Get();
+    int row_tiles = (rows + MC - 1) / MC;
+    int groups = (pool.num_threads() + row_tiles - 1) / row_tiles;
+    groups = std::max(1, std::min(groups, npanels));
+
+    pool.ParallelFor(row_tiles * groups, [&](int task, int) {
+        int ic = (task / groups) * MC;
+        int mc = (ic + MC <= rows) ? MC : (rows - ic);
+        int g = task % groups;
+        for (int q = npanels * g / groups; q < npanels * (g + 1) / groups; ++q) {
+            const Panel& p = panels[q];
+            int w = (int)widths[p.seg];
+            float* C = tensor_data<float>(data_entry_[2 + p.seg]);
+            const float* Bseg = Bp + seg_off[p.seg] * (size_t)m + (size_t)p.jc * (size_t)m;
+            int kc = 0;
+            for (int pc = 0; pc < m; pc += kc) {
+                kc = k_tile(pc, m, 0);
+                compute_tile(A, Bseg + (size_t)pc * (size_t)p.nc, C,
+                             rows, m, w, ic, mc, p.jc, p.nc, pc, kc, 0);
+            }
+        }
+    });
+}
+
+// ==================== 16. STRIDED VIEWS ====================
+/**
+ * A [batch][rows][cols] float operand read through DLPack strides:
+ * element (b, r, c) is at p[b*sb + r*sr + c*sc]. A 2D tensor has sb = 0
+ * (shared by every batch); strides == nullptr means row-major.
+ */
+struct StridedView {
+    float* p;
+    int64_t sb, sr, sc;
+};
+
+static StridedView view_of(const DLTensor* t) {
+    int nd = t->ndim;
+    StridedView v;
+    v.p = tensor_data<float>(t);
+    if (t->strides) {
+        v.sc = t->strides[nd - 1];
+        v.sr = t->strides[nd - 2];
+        v.sb = (nd >= 3) ? t->strides[nd - 3] : 0;
+    } else {
+        v.sc = 1;
+        v.sr = t->shape[nd - 1];
+        v.sb = (nd >= 3) ? t->shape[nd - 1] * t->shape[nd - 2] : 0;
+    }
+    return v;
+}
+
+/**
+ * pack_B_tile for a strided B. Rows of unit column stride are copied as
+ * usual; a transposed view (e.g. K^T sliced out of a [seq][heads*dim]
+ * tensor) is walked along its contiguous k direction instead.
+ */
+static inline void pack_B_tile_strided(
+    const float* B, int64_t rs, int64_t cs,
+    int pc, int kc, int jc, int nc, float* Bp
+) {
+    if (cs == 1) {
+        for (int k = 0; k < kc; ++k) {
+            memcpy(Bp + (size_t)k * (size_t)nc, B + (pc + k) * rs + jc, (size_t)nc * sizeof(float));
+        }
+    } else if (rs < cs) {
+        for (int j = 0; j < nc; ++j) {
+            const float* col = B + (jc + j) * cs + pc * rs;
+            for (int k = 0; k < kc; ++k) Bp[(size_t)k * (size_t)nc + j] = col[k * rs];
+        }
+    } else {
+        for (int k = 0; k < kc; ++k) {
+            const float* row = B + (pc + k) * rs + jc * cs;
+            for (int j = 0; j < nc; ++j) Bp[(size_t)k * (size_t)nc + j] = row[j * cs];
+        }
+    }
+}
+
+/**
+ * Same contract as matmul_prepacked() (Bp may be nullptr), but A, B and C
+ * may be arbitrary strided views with a byte_offset: per-head slices,
+ * permuted (transposed) operands, or a C written straight into a permuted
+ * output. Tensors have rank 2 or 3, the batch dimensions already collapsed.
+ *
+ * No operand is copied as a whole. B is gathered tile by tile while it is
+ * packed anyway, A rows are used in place when their column stride is 1
+ * (the row stride becomes lda) and gathered into a tile otherwise, and a C
+ * with a column stride is accumulated in a tile and scattered once.
+ */
+extern "C"
+void matmul_strided(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp
+) {
+    int batch = (int)shapeA[0];
+    int n = (int)shapeA[1];
+    int m = (int)shapeA[2];
+    int o = (int)shapeB[shapeB.size() - 1];
+    size_t bp_stride = (shapeB.size() == 3) ? (size_t)m * (size_t)o : 0;
+    StridedView A = view_of(data_entry_[0]);
+    StridedView B = view_of(data_entry_[1]);
+    StridedView C = view_of(data_entry_[2]);
+
+    int row_tiles = (n + MC - 1) / MC;
+    int col_tiles = (o + NC - 1) / NC;
+    WorkerPool::Get().ParallelFor(batch * col_tiles * row_tiles, [&](int task, int) {
+        static thread_local float Apack[MC * KC] __attribute__((aligned(64)));
+        static thread_local float Bpack[KC * NC] __attribute__((aligned(64)));
+        static thread_local float Cbuf[MC * NC] __attribute__((aligned(64)));
+        int b = task / (col_tiles * row_tiles);
+        int jc = (task / row_tiles) % col_tiles * NC;
+        int ic = task % row_tiles * MC;
+        int mc = (ic + MC <= n) ? MC : (n - ic);
+        int nc = (jc + NC <= o) ? NC : (o - jc);
+
+        const float* Ab = A.p + b * A.sb + ic * A.sr;
+        const float* Bb = B.p + b * B.sb;
+        float* Cb = C.p + b * C.sb + ic * C.sr + jc * C.sc;
+        bool c_direct = C.sc == 1;
+        float* C_tile = c_direct ? Cb : Cbuf;
+        int ldc = c_direct ? (int)C.sr : nc;
+
+        int kc = 0;
+        for (int pc = 0; pc < m; pc += kc) {
+            kc = k_tile(pc, m, 0);
+            const float* Btile = Bpack;
+            if (Bp) {
+                Btile = Bp + b * bp_stride + (size_t)jc * (size_t)m + (size_t)pc * (size_t)nc;
+            } else {
+                pack_B_tile_strided(Bb, B.sr, B.sc, pc, kc, jc, nc, Bpack);
+            }
+
+            const float* A_tile = Ab + pc * A.sc;
+            int lda = (int)A.sr;
+            if (A.sc != 1) {
+                for (int i = 0; i < mc; ++i) {
+                    for (int k = 0; k < kc; ++k) {
+                        Apack[i * kc + k] = A_tile[i * A.sr + k * A.sc];
+                    }
+                }
+                A_tile = Apack;
+                lda = kc;
+            }
+            tile_kernel(A_tile, lda, Btile, C_tile, ldc, mc, kc, nc, pc == 0);
+        }
+
+        if (!c_direct) {
+            for (int i = 0; i < mc; ++i) {
+                for (int j = 0; j < nc; ++j) Cb[i * C.sr + j * C.sc] = Cbuf[i * nc + j];
+            }
+        }
+    });
+}
+
+/**
+ * matmul_pack_B for a strided B view of rank 2 ([m][o], shared by every
+ * batch) or 3 ([batch][m][o]): the packed form is what matmul_strided and
+ * matmul_prepacked take as Bp, batch*m*o (or m*o) floats.
+ *
+ * Used for activations that stay unchanged over many calls, e.g. the
+ * cross-attention K^T / V of the decoder, so that later calls skip the
+ * gather of every tile.
+ */
+extern "C"
+void matmul_pack_B_strided(const DLTensor* B_tensor, float* Bp) {
+    int nd = B_tensor->ndim;
+    int batch = (nd == 3) ? (int)B_tensor->shape[0] : 1;
+    int m = (int)B_tensor->shape[nd - 2];
+    int o = (int)B_tensor->shape[nd - 1];
+    StridedView B = view_of(B_tensor);
+
+    int col_tiles = (o + NC - 1) / NC;
+    WorkerPool::Get().ParallelFor(batch * col_tiles, [&](int task, int) {
+        int b = task / col_tiles;
+        int jc = task % col_tiles * NC;
+        int nc = (jc + NC <= o) ? NC : (o - jc);
+        float* panel = Bp + (size_t)b * (size_t)m * (size_t)o + (size_t)jc * (size_t)m;
+        pack_B_tile_strided(B.p + b * B.sb, B.sr, B.sc, 0, m, jc, nc, panel);
+    });
+}
+
+// ==================== 17. LAYER-NORM PROLOGUE ====================
+/**
+ * Xn[i][:] = (X[i][:] - mean_i) * rstd_i * gamma + beta for the rows of
+ * one A row tile, with mean_i and rstd_i = 1 / sqrt(var_i + eps) taken
+ * over the m entries of row i (two passes, so var is not a difference of
+ * large sums).
+ */
+static void layernorm_rows(
+    const float* X, int rows, int m,
+    const float* gamma, const float* beta, float eps, float* Xn
+) {
+    for (int i = 0; i < rows; ++i) {
+        const float* x = X + (size_t)i * (size_t)m;
+        float* y = Xn + (size_t)i * (size_t)m;
+
+        vfloat32m1_t vsum = __riscv_vfmv_v_f_f32m1(0.0f, 1);
+        for (int k = 0; k < m;) {
+            size_t vl = __riscv_vsetvl_e32m1((size_t)(m - k));
+            vsum = __riscv_vfredusum_vs_f32m1_f32m1(__riscv_vle32_v_f32m1(x + k, vl), vsum, vl);
+            k += (int)vl;
+        }
+        float mean = __riscv_vfmv_f_s_f32m1_f32(vsum) / (float)m;
+
+        vfloat32m1_t vsq = __riscv_vfmv_v_f_f32m1(0.0f, 1);
+        for (int k = 0; k < m;) {
+            size_t vl = __riscv_vsetvl_e32m1((size_t)(m - k));
+            vfloat32m1_t d = __riscv_vfsub_vf_f32m1(__riscv_vle32_v_f32m1(x + k, vl), mean, vl);
+            vsq = __riscv_vfredusum_vs_f32m1_f32m1(__riscv_vfmul_vv_f32m1(d, d, vl), vsq, vl);
+            k += (int)vl;
+        }
+        float rstd = 1.0f / std::sqrt(__riscv_vfmv_f_s_f32m1_f32(vsq) / (float)m + eps);
+
+        for (int k = 0; k < m;) {
+            size_t vl = __riscv_vsetvl_e32m1((size_t)(m - k));
+            vfloat32m1_t d = __riscv_vfsub_vf_f32m1(__riscv_vle32_v_f32m1(x + k, vl), mean, vl);
+            d = __riscv_vfmul_vf_f32m1(d, rstd, vl);
+            vfloat32m1_t out = __riscv_vfmacc_vv_f32m1(__riscv_vle32_v_f32m1(beta + k, vl),
+                                                       d, __riscv_vle32_v_f32m1(gamma + k, vl), vl);
+            __riscv_vse32_v_f32m1(y + k, out, vl);
+            k += (int)vl;
+        }
+    }
+}
+
+/**
+ * C = layer_norm(X, gamma, beta, eps) * B, normalizing over the last axis
+ * of X, which is the K dimension of the matmul. X is [batch][n][m] and B a
+ * shared [m][o], so batches are just more rows.
+ *
+ * The normalized activation only ever exists as the A panel of one MC row
+ * tile: a task normalizes its [mc][m] panel (per-thread, it stays in L2),
+ * then sweeps it across a group of B column panels exactly as matmul_multi
+ * does, so X is read once and nothing round-trips through memory.
+ *
+ * data_entry_ holds X, B, gamma, beta and C. Bp is the output of
+ * matmul_pack_B, or nullptr to pack B here.
+ */
+extern "C"
+void matmul_layernorm(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bp,
+    float eps
+) {
+    int rows = (int)(shapeA[0] * shapeA[1]);
+    int m = (int)shapeA[2];
+    int o = (int)shapeB[1];
+    const float* X = tensor_data<const float>(data_entry_[0]);
+    const float* gamma = tensor_data<const float>(data_entry_[2]);
+    const float* beta = tensor_data<const float>(data_entry_[3]);
+    float* C = tensor_data<float>(data_entry_[4]);
+
+    std::vector<float> packed;
+    if (!Bp) {
+        packed.resize((size_t)m * (size_t)o);
+        pack_B_full(tensor_data<const float>(data_entry_[1]), o, m, o, packed.data());
+        Bp = packed.data();
+    }
+
+    WorkerPool& pool = WorkerPool::Get();
+    int npanels = (o + NC - 1) / NC;
+    int row_tiles = (rows + MC - 1) / MC;
+    int groups = (pool.num_threads() + row_tiles - 1) / row_tiles;
+    groups = std::max(1, std::min(groups, npanels));
+
+    pool.ParallelFor(row_tiles * groups, [&](int task, int) {
+        static thread_local std::vector<float> Apanel;
+        int ic = (task / groups) * MC;
+        int mc = (ic + MC <= rows) ? MC : (rows - ic);
+        int g = task % groups;
+        Apanel.resize((size_t)MC * (size_t)m);
+        layernorm_rows(X + (size_t)ic * (size_t)m, mc, m, gamma, beta, eps, Apanel.data());
+
+        for (int p = npanels * g / groups; p < npanels * (g + 1) / groups; ++p) {
+            int jc = p * NC;
+            int nc = (jc + NC <= o) ? NC : (o - jc);
+            int kc = 0;
+            for (int pc = 0; pc < m; pc += kc) {
+                kc = k_tile(pc, m, 0);
+                const float* Btile = Bp + (size_t)jc * (size_t)m + (size_t)pc * (size_t)nc;
+                tile_kernel(Apanel.data() + pc, m, Btile, C + (size_t)ic * (size_t)o + (size_t)jc, o,
+                            mc, kc, nc, pc == 0);
+            }
+        }
+    });
+}
+
+// ==================== 18. VOCABULARY GATHER GEMV ====================
+/**
+ * a[0:m] . b[0:m], with b's elements ldb floats apart. Full vectors are
+ * accumulated lane-wise and reduced once; only the tail is reduced on
+ * its own.
+ */
+static inline float dot_rvv(const float* a, const float* b, int ldb, int m) {
+    size_t vlmax = __riscv_vsetvlmax_e32m1();
+    ptrdiff_t bstride = (ptrdiff_t)ldb * (ptrdiff_t)sizeof(float);
+    vfloat32m1_t vacc = __riscv_vfmv_v_f_f32m1(0.0f, vlmax);
+    int k = 0;
+    for (; k + (int)vlmax <= m; k += (int)vlmax) {
+        vfloat32m1_t bv = (ldb == 1) ? __riscv_vle32_v_f32m1(b + k, vlmax)
+                                     : __riscv_vlse32_v_f32m1(b + (size_t)k * (size_t)ldb, bstride, vlmax);
+        vacc = __riscv_vfmacc_vv_f32m1(vacc, __riscv_vle32_v_f32m1(a + k, vlmax), bv, vlmax);
+    }
+    vfloat32m1_t vsum = __riscv_vfredusum_vs_f32m1_f32m1(vacc, __riscv_vfmv_v_f_f32m1(0.0f, 1), vlmax);
+    if (k < m) {
+        size_t vl = __riscv_vsetvl_e32m1((size_t)(m - k));
+        vfloat32m1_t bv = (ldb == 1) ? __riscv_vle32_v_f32m1(b + k, vl)
+                                     : __riscv_vlse32_v_f32m1(b + (size_t)k * (size_t)ldb, bstride, vl);
+        vsum = __riscv_vfredusum_vs_f32m1_f32m1(
+            __riscv_vfmul_vv_f32m1(__riscv_vle32_v_f32m1(a + k, vl), bv, vl), vsum, vl);
+    }
+    return __riscv_vfmv_f_s_f32m1_f32(vsum);
+}
+
+/** Vocabulary ids handed to matmul_gather per task. */
+static const int GATHER_IDS_PER_TASK = 64;
+
+/**
+ * Bt[j][k] = B[k][j]: the [o][m] row layout of matmul_gather, in which the
+ * weights of one vocabulary entry are m contiguous floats. Done once at
+ * load time for a constant B.
+ */
+extern "C"
+void matmul_pack_B_rows(const float* B, int m, int o, float* Bt) {
+    int ntasks = (o + GATHER_IDS_PER_TASK - 1) / GATHER_IDS_PER_TASK;
+    WorkerPool::Get().ParallelFor(ntasks, [&](int task, int) {
+        int j0 = task * GATHER_IDS_PER_TASK;
+        int j1 = std::min(o, j0 + GATHER_IDS_PER_TASK);
+        for (int k = 0; k < m; ++k) {
+            const float* src = B + (size_t)k * (size_t)o;
+            for (int j = j0; j < j1; ++j) Bt[(size_t)j * (size_t)m + k] = src[j];
+        }
+    });
+}
+
+/**
+ * bananapi.matmul_gather entry point: C[r][i] = A[r] . B[:, ids[i]], the
+ * logits of only the vocabulary entries listed in ids.
+ *
+ * data_entry_ holds A ([batch, n, m] as shapeA), B ([m, o] as shapeB), the
+ * int32 / int64 ids ([K], every one in [0, o)) and C ([batch, n, K]). Only
+ * the K needed weight columns are read, so the weight traffic of one
+ * decoding step drops from m*o to m*K floats.
+ *
+ * @param Bt: B in the row layout of matmul_pack_B_rows, or nullptr to read
+ *            the columns of B with strided loads
+ */
+extern "C"
+void matmul_gather(
+    std::vector<const DLTensor*>& data_entry_,
+    std::vector<int64_t>& shapeA,
+    std::vector<int64_t>& shapeB,
+    const float* Bt
+) {
+    int rows = (int)(shapeA[0] * shapeA[1]);
+    int m = (int)shapeA[2];
+    int o = (int)shapeB[1];
+    const float* A = tensor_data<const float>(data_entry_[0]);
+    const float* B = tensor_data<const float>(data_entry_[1]);
+    const DLTensor* ids_tensor = data_entry_[2];
+    float* C = tensor_data<float>(data_entry_[3]);
+    int nids = 1;
+    for (int d = 0; d < ids_tensor->ndim; ++d) nids *= (int)ids_tensor->shape[d];
+    bool ids64 = ids_tensor->dtype.bits == 64;
+    const int64_t* ids_l = ids64 ? tensor_data<const int64_t>(ids_tensor) : nullptr;
+    const int32_t* ids_i = ids64 ? nullptr : tensor_data<const int32_t>(ids_tensor);
+
+    int ntasks = (nids + GATHER_IDS_PER_TASK - 1) / GATHER_IDS_PER_TASK;
+    WorkerPool::Get().ParallelFor(ntasks, [&](int task, int) {
+        int i1 = std::min(nids, (task + 1) * GATHER_IDS_PER_TASK);
+        for (int i = task * GATHER_IDS_PER_TASK; i < i1; ++i) {
+            int64_t id = ids64 ? ids_l[i] : (int64_t)ids_i[i];
+            const float* w = Bt ? Bt + (size_t)id * (size_t)m : B + id;
+            int ldw = Bt ? 1 : o;
+            // Every row of A reuses the weight row while it is still in L1.
+            for (int r = 0; r < rows; ++r) {
+                C[(size_t)r * (size_t)nids + i] = dot_rvv(A + (size_t)r * (size_t)m, w, ldw, m);
+            }
+        }
+    });
+}
@@ -0,0 +1,330 @@
+// rvv_jit.h - in-process RVV machine-code emitter for the matmul microkernel
+//
+// Included by libmatmul_rvv.cpp. Everything except the executable-memory part
+// (section 3) is plain C++, so the encoder and the kernel emitter build and
+// can be checked on any host:
+//
+//   echo '#include "rvv_jit.h"
+//   int main() { return rvv_jit_selftest(stdout); }' | g++ -std=c++11 -x c++ - -o jit_check && ./jit_check
+//
+// rvv_jit_selftest() compares the encoder with words produced by
+// `llvm-mc -triple=riscv64 -mattr=+v -show-encoding`, and emits one kernel
+// per epilogue. rvv_jit_dump() writes a kernel as raw words so it can be
+// disassembled off-board, e.g.
+//   llvm-objcopy -I binary -O elf64-littleriscv k.bin k.o && llvm-objdump -D --mattr=+v k.o
+#ifndef RVV_JIT_H
+#define RVV_JIT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#if defined(__riscv) && defined(__linux__)
+#include <sys/mman.h>
+#define RVV_JIT_EXECUTABLE 1
+#endif
+
+// ==================== 1. ENCODER ====================
+/**
+ * The handful of RV64GCV instructions the microkernel needs, encoded as
+ * 32-bit words. Register arguments are architectural numbers (x5 = t0,
+ * f10 = fa0, v8 = v8).
+ */
+class RvvAsm {
+public:
+    enum { ZERO = 0, RA = 1, T0 = 5, T1 = 6, T2 = 7, A0 = 10, A1 = 11, A2 = 12,
+           T3 = 28, T4 = 29, T5 = 30, T6 = 31 };
+    enum { FA0 = 10, FA1 = 11 };
+
+    // vtype for SEW=32, tail / mask agnostic; lmul_log2 in 0..3 (m1..m8)
+    static uint32_t vtype_e32(int lmul_log2) {
+        return (1u << 7) | (1u << 6) | (2u << 3) | (uint32_t)lmul_log2;
+    }
+
+    static uint32_t i_type(int imm, int rs1, int funct3, int rd, int opcode) {
+        return ((uint32_t)(imm & 0xfff) << 20) | ((uint32_t)rs1 << 15) |
+               ((uint32_t)funct3 << 12) | ((uint32_t)rd << 7) | (uint32_t)opcode;
+    }
+    static uint32_t addi(int rd, int rs1, int imm) { return i_type(imm, rs1, 0, rd, 0x13); }
+    static uint32_t addiw(int rd, int rs1, int imm) { return i_type(imm, rs1, 0, rd, 0x1b); }
+    static uint32_t flw(int fd, int rs1, int imm) { return i_type(imm, rs1, 2, fd, 0x07); }
+    static uint32_t jalr(int rd, int rs1, int imm) { return i_type(imm, rs1, 0, rd, 0x67); }
+    static uint32_t ret() { return jalr(ZERO, RA, 0); }
+    static uint32_t add(int rd, int rs1, int rs2) {
+        return ((uint32_t)rs2 << 20) | ((uint32_t)rs1 << 15) | ((uint32_t)rd << 7) | 0x33;
+    }
+    static uint32_t lui(int rd, int imm20) {
+        return ((uint32_t)(imm20 & 0xfffff) << 12) | ((uint32_t)rd << 7) | 0x37;
+    }
+    // beq rs1, rs2, off (off in bytes, even, +-4 KiB)
+    static uint32_t beq(int rs1, int rs2, int off) {
+        uint32_t u = (uint32_t)off;
+        return (((u >> 12) & 1) << 31) | (((u >> 5) & 0x3f) << 25) | ((uint32_t)rs2 << 20) |
+               ((uint32_t)rs1 << 15) | (((u >> 1) & 0xf) << 8) | (((u >> 11) & 1) << 7) | 0x63;
+    }
+    // jal rd, off (off in bytes, even, +-1 MiB)
+    static uint32_t jal(int rd, int off) {
+        uint32_t u = (uint32_t)off;
+        return (((u >> 20) & 1) << 31) | (((u >> 1) & 0x3ff) << 21) | (((u >> 11) & 1) << 20) |
+               (((u >> 12) & 0xff) << 12) | ((uint32_t)rd << 7) | 0x6f;
+    }
+
+    static uint32_t vsetvli(int rd, int rs1, uint32_t vtype) {
+        return ((vtype & 0x7ff) << 20) | ((uint32_t)rs1 << 15) | (7u << 12) | ((uint32_t)rd << 7) | 0x57;
+    }
+    static uint32_t vsetivli(int rd, int avl, uint32_t vtype) {
+        return (3u << 30) | ((vtype & 0x3ff) << 20) | ((uint32_t)(avl & 0x1f) << 15) | (7u << 12) |
+               ((uint32_t)rd << 7) | 0x57;
+    }
+    // unit-stride, unmasked, EEW=32
+    static uint32_t vle32(int vd, int rs1) { return (1u << 25) | ((uint32_t)rs1 << 15) | (6u << 12) | ((uint32_t)vd << 7) | 0x07; }
+    static uint32_t vse32(int vs3, int rs1) { return (1u << 25) | ((uint32_t)rs1 << 15) | (6u << 12) | ((uint32_t)vs3 << 7) | 0x27; }
+    // vd[i] += f[rs1] * vs2[i]
+    static uint32_t vfmacc_vf(int vd, int fs1, int vs2) {
+        return (0x2cu << 26) | (1u << 25) | ((uint32_t)vs2 << 20) | ((uint32_t)fs1 << 15) | (5u << 12) |
+               ((uint32_t)vd << 7) | 0x57;
+    }
+    static uint32_t vmv_v_i(int vd, int simm5) {
+        return (0x17u << 26) | (1u << 25) | ((uint32_t)(simm5 & 0x1f) << 15) | (3u << 12) | ((uint32_t)vd << 7) | 0x57;
+    }
+
+    std::vector<uint32_t> code;
+
+    void emit(uint32_t w) { code.push_back(w); }
+    int pc() const { return (int)code.size() * 4; }
+
+    // rd = value (32-bit signed)
+    void li(int rd, int32_t value) {
+        if (value >= -2048 && value < 2048) {
+            emit(addi(rd, ZERO, value));
+            return;
+        }
+        int32_t lo = (int32_t)((uint32_t)value << 20) >> 20;
+        emit(lui(rd, (int)(((int64_t)value - lo) >> 12)));
+        if (lo) emit(addiw(rd, rd, lo));
+    }
+
+    // rd = rs1 + value, via tmp when value does not fit an immediate
+    void add_imm(int rd, int rs1, int32_t value, int tmp) {
+        if (value >= -2048 && value < 2048) {
+            emit(addi(rd, rs1, value));
+        } else {
+            li(tmp, value);
+            emit(add(rd, rs1, tmp));
+        }
+    }
+};
+
+// ==================== 2. MICROKERNEL EMITTER ====================
+#define RVV_JIT_STORE 0       // C  = A * B (no read of C, no memset needed)
+#define RVV_JIT_ACCUMULATE 1  // C += A * B
+
+/**
+ * One generated microkernel: C[mc][nc] (+)= A[mc][kc] * Bp[kc][nc], with Bp
+ * packed as in pack_B_tile. Everything is fixed at generation time.
+ */
+struct RvvJitConfig {
+    int mc, kc, nc;
+    int lda, ldc;
+    int vlen;       // VLEN in bits
+    int epilogue;   // RVV_JIT_STORE / RVV_JIT_ACCUMULATE
+
+    bool operator<(const RvvJitConfig& o) const {
+        return std::tie(mc, kc, nc, lda, ldc, vlen, epilogue) <
+               std::tie(o.mc, o.kc, o.nc, o.lda, o.ldc, o.vlen, o.epilogue);
+    }
+};
+
+// Generated code: void kernel(const float* A, const float* Bp, float* C)
+typedef void (*RvvJitKernel)(const float* A, const float* Bp, float* C);
+
+/**
+ * Emit the kernel for cfg; empty if cfg is out of range (then the caller
+ * uses the intrinsic microkernel).
+ *
+ * Per row of A the code walks nc in LMUL=4 chunks of vlen/8 lanes, the last
+ * one shorter; every vl is a constant. The K loop is fully unrolled with the
+ * scalar load and the B load of step k+1 issued before the FMA of step k
+ * (fa0/v16 and fa1/v20 alternate), which matters on in-order cores.
+ *
+ *   a0 = A row, a1 = Bp, a2 = C row, t0 = rows left,
+ *   t2 = B cursor, t3 = C chunk, t4 = B row stride, t5 = A / t6 = C row stride
+ */
+inline std::vector<uint32_t> rvv_jit_emit_microkernel(const RvvJitConfig& cfg) {
+    typedef RvvAsm R;
+    // flw reaches A[k] with a 12-bit offset
+    if (cfg.mc <= 0 || cfg.kc <= 0 || cfg.nc <= 0 || cfg.kc > 512 || cfg.vlen < 64) {
+        return std::vector<uint32_t>();
+    }
+    const int lanes = cfg.vlen / 8;  // e32, m4
+    const uint32_t vtype = R::vtype_e32(2);
+
+    R a;
+    a.li(R::T0, cfg.mc);
+    a.li(R::T4, cfg.nc * 4);
+    a.li(R::T5, cfg.lda * 4);
+    a.li(R::T6, cfg.ldc * 4);
+
+    int row = a.pc();
+    for (int col = 0; col < cfg.nc; col += lanes) {
+        int vl = (cfg.nc - col < lanes) ? (cfg.nc - col) : lanes;
+        if (vl < 32) {
+            a.emit(R::vsetivli(R::ZERO, vl, vtype));
+        } else {
+            a.li(R::T1, vl);
+            a.emit(R::vsetvli(R::ZERO, R::T1, vtype));
+        }
+
+        a.add_imm(R::T3, R::A2, col * 4, R::T1);
+        if (cfg.epilogue == RVV_JIT_ACCUMULATE) {
+            a.emit(R::vle32(8, R::T3));
+        } else {
+            a.emit(R::vmv_v_i(8, 0));
+        }
+
+        a.add_imm(R::T2, R::A1, col * 4, R::T1);
+        a.emit(R::flw(R::FA0, R::A0, 0));
+        a.emit(R::vle32(16, R::T2));
+        for (int k = 0; k < cfg.kc; ++k) {
+            int cur_f = (k & 1) ? R::FA1 : R::FA0, cur_v = (k & 1) ? 20 : 16;
+            int nxt_f = (k & 1) ? R::FA0 : R::FA1, nxt_v = (k & 1) ? 16 : 20;
+            if (k + 1 < cfg.kc) {
+                a.emit(R::add(R::T2, R::T2, R::T4));
+                a.emit(R::flw(nxt_f, R::A0, (k + 1) * 4));
+                a.emit(R::vle32(nxt_v, R::T2));
+            }
+            a.emit(R::vfmacc_vf(8, cur_f, cur_v));
+        }
+        a.emit(R::vse32(8, R::T3));
+    }
+
+    // next row; the body can exceed the +-4 KiB of a branch, so jump back with jal
+    a.emit(R::add(R::A0, R::A0, R::T5));
+    a.emit(R::add(R::A2, R::A2, R::T6));
+    a.emit(R::addi(R::T0, R::T0, -1));
+    a.emit(R::beq(R::T0, R::ZERO, 8));
+    a.emit(R::jal(R::ZERO, row - a.pc()));
+    a.emit(R::ret());
+    return a.code;
+}
+
+/** Write the kernel for cfg as little-endian words to path (for disassembly). */
+inline bool rvv_jit_dump(const RvvJitConfig& cfg, const char* path) {
+    std::vector<uint32_t> code = rvv_jit_emit_microkernel(cfg);
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    size_t n = fwrite(code.data(), sizeof(uint32_t), code.size(), f);
+    fclose(f);
+    return n == code.size();
+}
+
+/**
+ * Check the encoder against reference encodings and that a kernel is
+ * emitted for both epilogues. Returns the number of failures.
+ */
+inline int rvv_jit_selftest(FILE* log) {
+    typedef RvvAsm R;
+    struct Case { const char* text; uint32_t got, want; };
+    const uint32_t m4 = R::vtype_e32(2), m1 = R::vtype_e32(0);
+    const Case cases[] = {
+        {"vsetvli zero, t1, e32, m4, ta, ma", R::vsetvli(R::ZERO, R::T1, m4), 0x0d237057},
+        {"vsetivli zero, 16, e32, m4, ta, ma", R::vsetivli(R::ZERO, 16, m4), 0xcd287057},
+        {"vsetivli zero, 31, e32, m1, ta, ma", R::vsetivli(R::ZERO, 31, m1), 0xcd0ff057},
+        {"vle32.v v8, (t3)", R::vle32(8, R::T3), 0x020e6407},
+        {"vle32.v v20, (t2)", R::vle32(20, R::T2), 0x0203ea07},
+        {"vse32.v v8, (t3)", R::vse32(8, R::T3), 0x020e6427},
+        {"vmv.v.i v8, 0", R::vmv_v_i(8, 0), 0x5e003457},
+        {"vfmacc.vf v8, fa0, v16", R::vfmacc_vf(8, R::FA0, 16), 0xb3055457},
+        {"vfmacc.vf v8, fa1, v20", R::vfmacc_vf(8, R::FA1, 20), 0xb345d457},
+        {"flw fa0, 2044(a0)", R::flw(R::FA0, R::A0, 2044), 0x7fc52507},
+        {"flw fa1, 4(a0)", R::flw(R::FA1, R::A0, 4), 0x00452587},
+        {"addi t2, a1, 508", R::addi(R::T2, R::A1, 508), 0x1fc58393},
+        {"addi t0, t0, -1", R::addi(R::T0, R::T0, -1), 0xfff28293},
+        {"add a0, a0, t5", R::add(R::A0, R::A0, R::T5), 0x01e50533},
+        {"add t2, t2, t4", R::add(R::T2, R::T2, R::T4), 0x01d383b3},
+        {"lui t1, 0x12345", R::lui(R::T1, 0x12345), 0x12345337},
+        {"addiw t1, t1, -1", R::addiw(R::T1, R::T1, -1), 0xfff3031b},
+        {"beqz t0, 8", R::beq(R::T0, R::ZERO, 8), 0x00028463},
+        {"j -1024", R::jal(R::ZERO, -1024), 0xc01ff06f},
+        {"ret", R::ret(), 0x00008067},
+    };
+
+    int failures = 0;
+    for (const Case& c : cases) {
+        if (c.got != c.want) {
+            ++failures;
+            if (log) fprintf(log, "rvv_jit: %-36s got %08x want %08x\n", c.text, c.got, c.want);
+        }
+    }
+
+    // li must reproduce the value for both immediate forms
+    R a;
+    a.li(R::T1, 0x12345000 - 1);
+    if (a.code.size() != 2 || a.code[0] != 0x12345337 || a.code[1] != 0xfff3031b) {
+        ++failures;
+        if (log) fprintf(log, "rvv_jit: li t1, 0x12344fff is not lui + addiw\n");
+    }
+
+    for (int epi = RVV_JIT_STORE; epi <= RVV_JIT_ACCUMULATE; ++epi) {
+        RvvJitConfig cfg = {64, 128, 100, 384, 1500, 256, epi};
+        if (rvv_jit_emit_microkernel(cfg).empty()) {
+            ++failures;
+            if (log) fprintf(log, "rvv_jit: no kernel emitted for epilogue %d\n", epi);
+        }
+    }
+
+    if (log) fprintf(log, "rvv_jit: %d failure(s)\n", failures);
+    return failures;
+}
+
+// ==================== 3. EXECUTABLE CACHE ====================
+/**
+ * Generated kernels, keyed by configuration. Code goes into a private
+ * mapping that is made read + execute once written; kernels are never freed.
+ */
+class RvvJitCache {
+public:
+    static RvvJitCache& Get() {
+        static RvvJitCache cache;
+        return cache;
+    }
+
+    RvvJitKernel Lookup(const RvvJitConfig& cfg) {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = kernels_.find(cfg);
+        if (it != kernels_.end()) return it->second;
+        RvvJitKernel fn = Generate(cfg);
+        kernels_[cfg] = fn;
+        return fn;
+    }
+
+private:
+    RvvJitKernel Generate(const RvvJitConfig& cfg) {
+#ifdef RVV_JIT_EXECUTABLE
+        std::vector<uint32_t> code = rvv_jit_emit_microkernel(cfg);
+        if (code.empty()) return nullptr;
+        size_t bytes = code.size() * sizeof(uint32_t);
+        void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        memcpy(mem, code.data(), bytes);
+        if (mprotect(mem, bytes, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, bytes);
+            return nullptr;
+        }
+        __builtin___clear_cache((char*)mem, (char*)mem + bytes);
+        return reinterpret_cast<RvvJitKernel>(mem);
+#else
+        (void)cfg;
+        return nullptr;
+#endif
+    }
+
+    std::mutex mu_;
+    std::map<RvvJitConfig, RvvJitKernel> kernels_;
+};
+
+#endif  // RVV_JIT_H
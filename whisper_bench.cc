@@ -0,0 +1,424 @@
+/*!
+ * \file whisper_bench.cc
+ * \brief End-to-end latency harness for the three Whisper-tiny modules.
+ *
+ * Loads encoder_model.so, decoder_model.so and decoder_with_past_model.so through the TVM C++
+ * runtime and runs the same encode -> prefill -> greedy decode loop as inference.py, on fixed
+ * inputs, N times. Reports p50/p90/p99 per stage, decode tokens per second and peak RSS.
+ *
+ * Build on the board (see Readme.md):
+ *   g++ -std=c++17 -O2 -o whisper_bench whisper_bench.cc \
+ *       -I ~/tvm/include -I ~/tvm/3rdparty/dlpack/include -I ~/tvm/3rdparty/dmlc-core/include \
+ *       -L ~/tvm/build -ltvm_runtime -ldl -pthread
+ */
+#include <dlpack/dlpack.h>
+#include <sys/resource.h>
+#include <tvm/runtime/container/array.h>
+#include <tvm/runtime/container/shape_tuple.h>
+#include <tvm/runtime/memory/memory_manager.h>
+#include <tvm/runtime/module.h>
+#include <tvm/runtime/ndarray.h>
+#include <tvm/runtime/packed_func.h>
+#include <tvm/runtime/registry.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace tvm::runtime;
+
+namespace {
+
+/*! \brief Command line options. */
+struct Options {
+  std::string model_dir = "./onnx";
+  /*! \brief Raw float32 [1, 80, 3000] log-mel features, e.g. numpy's mel.tofile(); synthetic if empty. */
+  std::string mel_path;
+  std::string csv_path;
+  int iters = 10;
+  int warmup = 1;
+  /*! \brief Decode steps after prefill, fixed so that every iteration does the same work. */
+  int steps = 32;
+  bool stop_at_eos = false;
+  /*! \brief Encoder frames that hold audio, as runtime.bananapi_set_valid_length; 0 = all 1500. */
+  int64_t valid_frames = 0;
+  /*! \brief Pin the cross-attention KV for the decode loop (runtime.bananapi_pin_operands). */
+  bool pin_cross_kv = true;
+  /*!
+   * \brief Raw int64 token ids, e.g. numpy's ids.tofile(), fed as the allowed_ids input of modules
+   * compiled with num_allowed_ids; padded to num_allowed_ids (0 = as many as the file holds).
+   */
+  std::string allowed_ids_path;
+  int64_t num_allowed_ids = 0;
+  int64_t start_token = 50258;
+  int64_t eos_token = 50257;
+};
+
+constexpr int kNumLayers = 4;
+constexpr int kEncoderFrames = 1500;
+/*! \brief Positions of the self-attention KV among the 16 past KVs, see inference.py. */
+constexpr int kSelfKvIndex[] = {0, 1, 4, 5, 8, 9, 12, 13};
+/*! \brief Positions of the cross-attention KV, unchanged after prefill. */
+constexpr int kCrossKvIndex[] = {2, 3, 6, 7, 10, 11, 14, 15};
+
+/*! \brief Call f with a list of tensors as its arguments. */
+TVMRetValue CallWithTensors(const PackedFunc& f, const std::vector<NDArray>& args) {
+  std::vector<TVMValue> values(args.size());
+  std::vector<int> codes(args.size());
+  TVMArgsSetter setter(values.data(), codes.data());
+  for (size_t i = 0; i < args.size(); ++i) setter(i, args[i]);
+  TVMRetValue rv;
+  f.CallPacked(TVMArgs(values.data(), codes.data(), static_cast<int>(args.size())), &rv);
+  return rv;
+}
+
+/*! \brief A relax VM running one compiled module on the CPU. */
+class VMModel {
+ public:
+  explicit VMModel(const std::string& path) {
+    Module exec = Module::LoadFromFile(path);
+    vm_ = exec.GetFunction("vm_load_executable")();
+    int pooled = static_cast<int>(memory::AllocatorType::kPooled);
+    vm_.GetFunction("vm_initialization")(static_cast<int>(kDLCPU), 0, pooled,
+                                         static_cast<int>(kDLCPU), 0, pooled);
+    main_ = vm_.GetFunction("main");
+    ICHECK(main_ != nullptr) << path << " has no main function";
+  }
+
+  ObjectRef Run(const std::vector<NDArray>& args) const {
+    return CallWithTensors(main_, args).operator ObjectRef();
+  }
+
+  /*! \brief Whether main has a parameter of this name, e.g. allowed_ids of restrict_vocabulary. */
+  bool HasParam(const std::string& name) {
+    int arity = vm_.GetFunction("get_function_arity")("main");
+    PackedFunc param_name = vm_.GetFunction("get_function_param_name");
+    for (int i = 0; i < arity; ++i) {
+      if (param_name("main", i).operator std::string() == name) return true;
+    }
+    return false;
+  }
+
+ private:
+  Module vm_;
+  PackedFunc main_;
+};
+
+NDArray Field(const ObjectRef& out, size_t i) {
+  if (const auto* arr = out.as<ArrayNode>()) return Downcast<NDArray>(arr->at(i));
+  ICHECK_EQ(i, 0U) << "module returned a single tensor";
+  return Downcast<NDArray>(out);
+}
+
+size_t NumFields(const ObjectRef& out) {
+  if (const auto* arr = out.as<ArrayNode>()) return arr->size();
+  return 1;
+}
+
+/*!
+ * \brief Greedy token from output 0: logits, or token ids reduced by bananapi.matmul_argmax. With
+ * allowed_ids defined the logits only cover those tokens, and logit i belongs to allowed_ids[i].
+ */
+int64_t PickNextToken(const ObjectRef& out0, const NDArray& allowed_ids) {
+  if (const auto* arr = out0.as<ArrayNode>()) {
+    // bananapi.matmul_topk: (values, indices) sorted by score, take the best index
+    NDArray indices = Downcast<NDArray>(arr->at(1));
+    int64_t size = 1;
+    for (int i = 0; i < indices->ndim; ++i) size *= indices->shape[i];
+    int64_t first_of_last_row = size - indices->shape[indices->ndim - 1];
+    const char* data = static_cast<const char*>(indices->data) + indices->byte_offset;
+    if (indices->dtype.bits == 64) return reinterpret_cast<const int64_t*>(data)[first_of_last_row];
+    return reinterpret_cast<const int32_t*>(data)[first_of_last_row];
+  }
+  NDArray t = Downcast<NDArray>(out0);
+  const char* data = static_cast<const char*>(t->data) + t->byte_offset;
+  int64_t size = 1;
+  for (int i = 0; i < t->ndim; ++i) size *= t->shape[i];
+  if (t->dtype.code == kDLInt || t->dtype.code == kDLUInt) {
+    if (t->dtype.bits == 64) return reinterpret_cast<const int64_t*>(data)[size - 1];
+    return reinterpret_cast<const int32_t*>(data)[size - 1];
+  }
+  ICHECK(t->ndim == 2 || t->ndim == 3) << "unexpected logits rank " << t->ndim;
+  int64_t vocab = t->shape[t->ndim - 1];
+  const float* row = reinterpret_cast<const float*>(data) + (size - vocab);
+  int64_t best = std::max_element(row, row + vocab) - row;
+  if (allowed_ids.defined()) return static_cast<const int64_t*>(allowed_ids->data)[best];
+  return best;
+}
+
+NDArray TokenTensor(int64_t token) {
+  NDArray ids = NDArray::Empty(ShapeTuple({1, 1}), DLDataType{kDLInt, 64, 1}, {kDLCPU, 0});
+  *static_cast<int64_t*>(ids->data) = token;
+  return ids;
+}
+
+NDArray LoadMel(const std::string& path) {
+  const int64_t size = 1 * 80 * 3000;
+  NDArray mel = NDArray::Empty(ShapeTuple({1, 80, 3000}), DLDataType{kDLFloat, 32, 1}, {kDLCPU, 0});
+  float* data = static_cast<float*>(mel->data);
+  if (path.empty()) {
+    // Deterministic stand-in with the value range of Whisper's normalized log-mel.
+    for (int64_t i = 0; i < size; ++i) data[i] = 0.5f * std::sin(0.001f * i) - 0.2f;
+    return mel;
+  }
+  std::ifstream in(path, std::ios::binary);
+  ICHECK(in) << "cannot open " << path;
+  in.read(reinterpret_cast<char*>(data), size * sizeof(float));
+  ICHECK(in.gcount() == static_cast<std::streamsize>(size * sizeof(float)))
+      << path << " must hold 1*80*3000 float32 values";
+  return mel;
+}
+
+/*! \brief int64 [k] allowed ids from a raw file, padded with the first id like pad_allowed_ids. */
+NDArray LoadAllowedIds(const std::string& path, int64_t k) {
+  std::ifstream in(path, std::ios::binary);
+  ICHECK(in) << "cannot open " << path;
+  std::vector<int64_t> ids;
+  int64_t id;
+  while (in.read(reinterpret_cast<char*>(&id), sizeof(id))) ids.push_back(id);
+  if (k == 0) k = static_cast<int64_t>(ids.size());
+  ICHECK(!ids.empty() && static_cast<int64_t>(ids.size()) <= k)
+      << path << " must hold between 1 and " << k << " int64 token ids";
+  int64_t pad = ids[0];
+  ids.resize(k, pad);
+  NDArray out = NDArray::Empty(ShapeTuple({k}), DLDataType{kDLInt, 64, 1}, {kDLCPU, 0});
+  std::copy(ids.begin(), ids.end(), static_cast<int64_t*>(out->data));
+  return out;
+}
+
+/*! \brief Wall time of one encode/prefill/decode pass. */
+struct IterationTiming {
+  double encoder_ms = 0, prefill_ms = 0, decode_ms = 0, total_ms = 0;
+  std::vector<double> step_ms;
+  int tokens = 0;
+  /*! \brief Pinned B packs in the first and in later decode steps, and reuses of packed forms. */
+  bool pack_counts = false;
+  int64_t first_step_packs = 0, later_step_packs = 0, pack_reuses = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+double Ms(Clock::time_point begin, Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+IterationTiming RunOnce(const VMModel& encoder, const VMModel& prefill, const VMModel& decoder,
+                        const NDArray& mel, const NDArray& allowed_ids, const Options& opt) {
+  IterationTiming timing;
+  auto t0 = Clock::now();
+  NDArray encoder_out = Field(encoder.Run({mel}), 0);
+  auto t1 = Clock::now();
+  std::vector<NDArray> prefill_args = {TokenTensor(opt.start_token), encoder_out};
+  if (allowed_ids.defined()) prefill_args.push_back(allowed_ids);
+  ObjectRef out = prefill.Run(prefill_args);
+  auto t2 = Clock::now();
+  timing.encoder_ms = Ms(t0, t1);
+  timing.prefill_ms = Ms(t1, t2);
+
+  ICHECK_EQ(NumFields(out), 1U + 4 * kNumLayers) << "decoder_model.so must return logits + 16 KVs";
+  int64_t token = PickNextToken(out.as<ArrayNode>()->at(0), allowed_ids);
+  std::vector<NDArray> kvs;
+  for (size_t i = 1; i < NumFields(out); ++i) kvs.push_back(Field(out, i));
+  const PackedFunc* pin = opt.pin_cross_kv ? Registry::Get("runtime.bananapi_pin_operands") : nullptr;
+  if (pin != nullptr) {
+    std::vector<NDArray> cross;
+    for (int i : kCrossKvIndex) cross.push_back(kvs[i]);
+    CallWithTensors(*pin, cross);
+  }
+  const PackedFunc* pack_counts =
+      pin != nullptr ? Registry::Get("runtime.bananapi_pinned_pack_counts") : nullptr;
+  auto read_counts = [&]() { return (*pack_counts)().operator ShapeTuple(); };
+  ShapeTuple counts_before, counts_first;
+  if (pack_counts != nullptr) counts_before = counts_first = read_counts();
+
+  for (int step = 0; step < opt.steps; ++step) {
+    if (opt.stop_at_eos && token == opt.eos_token) break;
+    std::vector<NDArray> args = {TokenTensor(token)};
+    args.insert(args.end(), kvs.begin(), kvs.end());
+    if (allowed_ids.defined()) args.push_back(allowed_ids);
+    auto s0 = Clock::now();
+    ObjectRef step_out = decoder.Run(args);
+    token = PickNextToken(step_out.as<ArrayNode>()->at(0), allowed_ids);
+    auto s1 = Clock::now();
+    timing.step_ms.push_back(Ms(s0, s1));
+    for (int i = 0; i < 2 * kNumLayers; ++i) kvs[kSelfKvIndex[i]] = Field(step_out, i + 1);
+    ++timing.tokens;
+    if (pack_counts != nullptr && step == 0) counts_first = read_counts();
+  }
+  if (pack_counts != nullptr) {
+    ShapeTuple counts_end = read_counts();
+    timing.pack_counts = true;
+    timing.first_step_packs = counts_first[0] - counts_before[0];
+    timing.later_step_packs = counts_end[0] - counts_first[0];
+    timing.pack_reuses = counts_end[1] - counts_before[1];
+  }
+  if (pin != nullptr) (*pin)();
+  auto t3 = Clock::now();
+  timing.decode_ms = Ms(t2, t3);
+  timing.total_ms = Ms(t0, t3);
+  return timing;
+}
+
+/*! \brief Nearest-rank percentile of an already sorted sample. */
+double Percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+  return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+void PrintRow(const char* name, std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  double mean = 0;
+  for (double x : v) mean += x;
+  mean = v.empty() ? 0 : mean / v.size();
+  std::printf("%-14s %6zu %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", name, v.size(), mean,
+              Percentile(v, 50), Percentile(v, 90), Percentile(v, 99), v.empty() ? 0 : v.front(),
+              v.empty() ? 0 : v.back());
+}
+
+/*! \brief Peak resident set size of the process in KiB. */
+long PeakRssKiB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;  // KiB on Linux
+}
+
+void Usage(const char* argv0) {
+  std::fprintf(stderr,
+               "usage: %s [--model-dir DIR] [--mel FILE] [--iters N] [--warmup N] [--steps N]\n"
+               "          [--stop-at-eos] [--valid-frames N] [--no-pin-cross-kv] [--csv FILE]\n"
+               "          [--allowed-ids FILE [--num-allowed-ids K]]\n",
+               argv0);
+  std::exit(1);
+}
+
+Options ParseArgs(int argc, char** argv) {
+  Options opt;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) Usage(argv[0]);
+      return argv[++i];
+    };
+    if (arg == "--model-dir") {
+      opt.model_dir = value();
+    } else if (arg == "--mel") {
+      opt.mel_path = value();
+    } else if (arg == "--iters") {
+      opt.iters = std::stoi(value());
+    } else if (arg == "--warmup") {
+      opt.warmup = std::stoi(value());
+    } else if (arg == "--steps") {
+      opt.steps = std::stoi(value());
+    } else if (arg == "--stop-at-eos") {
+      opt.stop_at_eos = true;
+    } else if (arg == "--valid-frames") {
+      opt.valid_frames = std::stoll(value());
+    } else if (arg == "--no-pin-cross-kv") {
+      opt.pin_cross_kv = false;
+    } else if (arg == "--csv") {
+      opt.csv_path = value();
+    } else if (arg == "--allowed-ids") {
+      opt.allowed_ids_path = value();
+    } else if (arg == "--num-allowed-ids") {
+      opt.num_allowed_ids = std::stoll(value());
+    } else {
+      Usage(argv[0]);
+    }
+  }
+  if (opt.iters < 1 || opt.warmup < 0 || opt.steps < 0 || opt.valid_frames < 0 ||
+      opt.num_allowed_ids < 0 || (opt.num_allowed_ids > 0 && opt.allowed_ids_path.empty())) {
+    Usage(argv[0]);
+  }
+  return opt;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options opt = ParseArgs(argc, argv);
+  VMModel encoder(opt.model_dir + "/encoder_model.so");
+  VMModel prefill(opt.model_dir + "/decoder_model.so");
+  VMModel decoder(opt.model_dir + "/decoder_with_past_model.so");
+  NDArray mel = LoadMel(opt.mel_path);
+  NDArray allowed_ids;
+  if (!opt.allowed_ids_path.empty()) {
+    allowed_ids = LoadAllowedIds(opt.allowed_ids_path, opt.num_allowed_ids);
+    ICHECK(prefill.HasParam("allowed_ids") && decoder.HasParam("allowed_ids"))
+        << "--allowed-ids needs decoder_model.so and decoder_with_past_model.so compiled with "
+           "num_allowed_ids";
+  }
+  long rss_after_load = PeakRssKiB();
+  if (opt.valid_frames > 0) {
+    const PackedFunc* set_valid_length = Registry::Get("runtime.bananapi_set_valid_length");
+    ICHECK(set_valid_length != nullptr) << "--valid-frames needs a TVM built with the bananapi runtime";
+    (*set_valid_length)(opt.valid_frames, static_cast<int64_t>(kEncoderFrames));
+  }
+
+  for (int i = 0; i < opt.warmup; ++i) RunOnce(encoder, prefill, decoder, mel, allowed_ids, opt);
+
+  std::vector<IterationTiming> runs;
+  for (int i = 0; i < opt.iters; ++i) {
+    runs.push_back(RunOnce(encoder, prefill, decoder, mel, allowed_ids, opt));
+    std::fprintf(stderr, "iteration %d: %.1f ms, %d tokens\n", i, runs.back().total_ms,
+                 runs.back().tokens);
+  }
+
+  std::vector<double> encoder_ms, prefill_ms, step_ms, decode_ms, total_ms, tokens_per_s;
+  for (const auto& r : runs) {
+    encoder_ms.push_back(r.encoder_ms);
+    prefill_ms.push_back(r.prefill_ms);
+    decode_ms.push_back(r.decode_ms);
+    total_ms.push_back(r.total_ms);
+    step_ms.insert(step_ms.end(), r.step_ms.begin(), r.step_ms.end());
+    if (r.tokens > 0) tokens_per_s.push_back(r.tokens / (r.decode_ms / 1000.0));
+  }
+
+  std::printf("%d iterations (%d warm-up), %d decode steps, %lld of %d encoder frames\n\n",
+              opt.iters, opt.warmup, opt.steps,
+              static_cast<long long>(opt.valid_frames > 0 ? opt.valid_frames : kEncoderFrames),
+              kEncoderFrames);
+  std::printf("%-14s %6s %12s %12s %12s %12s %12s %12s\n", "stage (ms)", "n", "mean", "p50",
+              "p90", "p99", "min", "max");
+  PrintRow("encoder", encoder_ms);
+  PrintRow("prefill", prefill_ms);
+  PrintRow("decode_step", step_ms);
+  PrintRow("decode_total", decode_ms);
+  PrintRow("end_to_end", total_ms);
+  std::printf("\n");
+  PrintRow("tokens/s", tokens_per_s);
+  std::printf("\npeak RSS: %.1f MiB (%.1f MiB after loading the modules)\n",
+              PeakRssKiB() / 1024.0, rss_after_load / 1024.0);
+  if (!runs.empty() && runs.front().pack_counts) {
+    int64_t first = 0, later = 0, reuses = 0, later_steps = 0;
+    for (const auto& r : runs) {
+      later_steps += std::max(r.tokens - 1, 0);
+      first += r.first_step_packs;
+      later += r.later_step_packs;
+      reuses += r.pack_reuses;
+    }
+    std::printf("pinned cross-attention K/V: %lld packs in decode step 1, %lld in later steps, "
+                "%lld reuses\n",
+                static_cast<long long>(first), static_cast<long long>(later),
+                static_cast<long long>(reuses));
+    if (later > 0 || (later_steps > 0 && reuses == 0)) {
+      std::printf("warning: later decode steps do not reuse the packed cross-attention K/V; "
+                  "is decoder_with_past_model.so compiled with bananapi offload and fuse_views?\n");
+    }
+  }
+
+  if (!opt.csv_path.empty()) {
+    std::ofstream csv(opt.csv_path);
+    csv << "iteration,encoder_ms,prefill_ms,decode_ms,total_ms,tokens\n";
+    for (size_t i = 0; i < runs.size(); ++i) {
+      csv << i << "," << runs[i].encoder_ms << "," << runs[i].prefill_ms << ","
+          << runs[i].decode_ms << "," << runs[i].total_ms << "," << runs[i].tokens << "\n";
+    }
+  }
+  return 0;
+}